@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -100,6 +101,27 @@ void delete_unused_fifo(char *name)
 	FREE(name);
 }
 
+/* creates a file of the given size on the ramdisk and maps it shared, so a
+ * child landslide can map the same file and poll it without any syscalls.
+ * the filename is malloced, as with create_file; unmap before delete_file. */
+void *create_shared_file(struct file *f, const char *prefix, unsigned int id,
+			 unsigned int size)
+{
+	char buf[BUF_SIZE];
+	scnprintf(buf, BUF_SIZE, FIFO_DIR "%s-%u-%lu.shm",
+		  prefix, id, timestamp());
+	f->filename = XSTRDUP(buf);
+
+	f->fd = open(f->filename, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	assert(f->fd >= 0 && "failed create shared file");
+	int ret = ftruncate(f->fd, size);
+	assert(ret == 0 && "failed size shared file");
+
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+	assert(map != MAP_FAILED && "failed map shared file");
+	return map;
+}
+
 void unset_cloexec(int fd)
 {
 	/* communication pipes were opened with CLOEXEC set so as not to race
@@ -34,6 +34,9 @@ char *create_fifo(const char *prefix, unsigned int id);
 void open_fifo(struct file *f, char *name, int flags);
 void delete_unused_fifo(char *name);
 
+void *create_shared_file(struct file *f, const char *prefix, unsigned int id,
+			 unsigned int size);
+
 void move_file_to(struct file *f, const char *dirpath);
 void unset_cloexec(int fd);
 
@@ -26,7 +26,12 @@
 
 static unsigned int job_id = 0;
 
+/* Options that differ between jobs go in the dynamic config as runtime
+ * options, so every job's static config is the same, and landslide need only be
+ * built once. The first job to start builds it under this lock; later jobs see
+ * landslide_built and tell build.sh to skip straight to the dynamic config. */
 static pthread_mutex_t compile_landslide_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool landslide_built = false;
 
 extern char **environ;
 
@@ -98,6 +103,7 @@ struct job *new_job(struct pp_set *config, bool reproduce, bool minimize)
 	j->trace_filename = NULL;
 	j->trace_length = (unsigned int)-1;
 	j->need_rerun = false;
+	j->replay_filename = NULL;
 	j->fab_timestamp = 0;
 	j->fab_cputime = 0;
 	j->current_cpu = (unsigned long)-1;
@@ -129,12 +135,17 @@ static void *run_job(void *arg)
 
 	XWRITE(&j->config_static, "TEST_CASE=%s\n", test_name);
 	XWRITE(&j->config_static, "VERBOSE=%d\n", preempt_everywhere ? 0 : verbose ? 1 : 0);
-	XWRITE(&j->config_static, "ICB=%d\n", use_icb ? 1 : j->minimizing_trace ? 1 : 0);
 	XWRITE(&j->config_static, "PREEMPT_EVERYWHERE=%d\n", preempt_everywhere ? 1 : 0);
 	XWRITE(&j->config_static, "PURE_HAPPENS_BEFORE=%d\n", pure_hb ? 1 : 0);
 
 	// XXX(#120): TEST_CASE must be defined before PPs are specified.
 	XWRITE(&j->config_dynamic, "TEST_CASE=%s\n", test_name);
+	XWRITE(&j->config_dynamic, "runtime_option ICB %d\n",
+	       use_icb ? 1 : j->minimizing_trace ? 1 : 0);
+	if (j->replay_filename != NULL) {
+		XWRITE(&j->config_dynamic, "replay_choices %s\n",
+		       j->replay_filename);
+	}
 	XWRITE(&j->config_dynamic, "%s %s\n", without, mx_lock);
 	XWRITE(&j->config_dynamic, "%s %s\n", without, mx_unlock);
 	if (pintos) {
@@ -245,20 +256,27 @@ static void *run_job(void *arg)
 	move_file_to(&j->config_static,  LANDSLIDE_PATH);
 	move_file_to(&j->config_dynamic, LANDSLIDE_PATH);
 
-	/* while multiple landslides can run at once, compiling each one from a
-	 * different config is mutually exclusive. we'll release this as soon as
-	 * we get a message from the child that it's up and running. */
+	/* while multiple landslides can run at once, compiling landslide is
+	 * mutually exclusive. if we are the one to build it, we'll release this
+	 * as soon as we get a message from the child that it's up and running;
+	 * otherwise we needn't wait at all. */
 	assert(j->current_cpu != (unsigned long)-1);
 	stop_using_cpu(j->current_cpu);
 	LOCK(&compile_landslide_lock);
 	start_using_cpu(j->current_cpu);
+	bool need_build = !landslide_built;
+	if (!need_build) {
+		UNLOCK(&compile_landslide_lock);
+	}
 
 	bool bug_in_subspace = bug_already_found(j->config) && !j->minimizing_trace;
 	bool too_late = TIME_UP();
 	if (bug_in_subspace || too_late) {
 		DBG("[JOB %d] %s; aborting compilation.\n", j->id,
 		    bug_in_subspace ? "bug already found" : "time ran out");
-		UNLOCK(&compile_landslide_lock);
+		if (need_build) {
+			UNLOCK(&compile_landslide_lock);
+		}
 		messaging_abort(&mess);
 		delete_file(&j->config_static, true);
 		delete_file(&j->config_dynamic, true);
@@ -288,11 +306,12 @@ static void *run_job(void *arg)
 		/* child process; landslide-to-be */
 		/* assemble commandline arguments */
 		char *execname = "./" LANDSLIDE_PROGNAME;
-		char *const argv[4] = {
+		char *const argv[5] = {
 			[0] = execname,
 			[1] = j->config_static.filename,
 			[2] = j->config_dynamic.filename,
-			[3] = NULL,
+			[3] = need_build ? NULL : "prebuilt",
+			[4] = NULL,
 		};
 
 		DBG("[JOB %d] '%s %s %s > %s 2> %s'\n", j->id, execname,
@@ -316,7 +335,11 @@ static void *run_job(void *arg)
 	/* should take 1 to 4 seconds for child to come alive */
 	bool child_alive = wait_for_child(&mess);
 
-	UNLOCK(&compile_landslide_lock);
+	if (need_build) {
+		/* if it failed, let the next job try building it afresh */
+		landslide_built = child_alive;
+		UNLOCK(&compile_landslide_lock);
+	}
 
 	if (child_alive) {
 		/* may take as long as the state space is large */
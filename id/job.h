@@ -53,6 +53,9 @@ struct job {
 	char *trace_filename;
 	unsigned int trace_length;
 	bool need_rerun;
+	/* choice trace to follow on the 1st branch, to reproduce a known bug
+	 * without searching; or if need_rerun, the one for the rerun to follow */
+	char *replay_filename;
 	unsigned long fab_timestamp;
 	unsigned long fab_cputime;
 	unsigned long current_cpu;
@@ -10,6 +10,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "bug.h"
@@ -62,6 +63,7 @@ struct input_message {
 			char trace_filename[MESSAGE_BUF_SIZE];
 			unsigned int trace_length;
 			unsigned int icb_preemption_count;
+			bool replayed;
 		} bug;
 
 		struct {
@@ -80,6 +82,16 @@ struct output_message {
 	bool value;
 };
 
+/* Shared with the child through a mapped file. Rather than answering a
+ * SHOULD_CONTINUE query and a SUSPEND_TIME query at the end of each of its
+ * branches, we publish our verdicts here for it to poll. Each suspend is
+ * followed by a RESUME_TIME message once the job is rescheduled. */
+struct control_block {
+	unsigned int magic;
+	volatile bool should_abort;
+	volatile unsigned int suspends;
+};
+
 /* glue */
 
 static void send(int output_fd, struct output_message *m)
@@ -92,15 +104,22 @@ static void send(int output_fd, struct output_message *m)
 
 static bool recv(int input_fd, struct input_message *m)
 {
-	int ret = read(input_fd, m, sizeof(struct input_message));
-	if (ret == sizeof(struct input_message)) {
-		assert(m->magic == MESSAGING_MAGIC && "wrong magic");
-		return true;
-	} else {
-		/* pipe was closed before next message was sent */
-		assert(ret == 0 && "read input msg failed");
-		return false;
+	/* the child writes its messages in batches bigger than PIPE_BUF, so one
+	 * message may arrive in pieces. */
+	unsigned int total = 0;
+	while (total < sizeof(struct input_message)) {
+		int ret = read(input_fd, (char *)m + total,
+			       sizeof(struct input_message) - total);
+		if (ret == 0) {
+			/* pipe was closed before next message was sent */
+			assert(total == 0 && "pipe closed mid-message");
+			return false;
+		}
+		assert(ret > 0 && "read input msg failed");
+		total += ret;
 	}
+	assert(m->magic == MESSAGING_MAGIC && "wrong magic");
+	return true;
 }
 
 /* event handling logic */
@@ -242,9 +261,6 @@ static void handle_estimate(struct messaging_state *state, struct job *j,
 	unsigned long eta = (unsigned long)remaining_usecs;
 	unsigned long time_left = time_remaining();
 
-	struct output_message reply;
-	reply.tag = SUSPEND_TIME;
-
 	assert(eta_factor >= 1);
 	if (elapsed_branches >= eta_threshold && time_left > HOMESTRETCH &&
 	    (eta_overflow || time_left * eta_factor < eta) &&
@@ -252,17 +268,15 @@ static void handle_estimate(struct messaging_state *state, struct job *j,
 		WARN("[JOB %d] State space too big (%u brs elapsed, "
 		     "time rem %lu, eta %lu) -- blocking!\n", j->id,
 		     elapsed_branches, time_left / 1000000, eta / 1000000);
-		/* Inform landslide instance to pause its time counter. */
-		reply.value = true;
-		send(state->output_pipe.fd, &reply);
+		/* Inform landslide instance to pause its time counter. It will
+		 * notice at its next estimate and wait for the resume. */
+		state->control->suspends++;
 		/* Wait until we get rescheduled. */
 		job_block(j);
 		/* Tell landslide instance to start timing again. */
+		struct output_message reply;
 		reply.tag = RESUME_TIME;
-		send(state->output_pipe.fd, &reply);
-	} else {
-		/* Normal operation. Tell landslide not to pause timing. */
-		reply.value = false;
+		reply.value = true;
 		send(state->output_pipe.fd, &reply);
 	}
 }
@@ -324,27 +338,53 @@ static void handle_crash(struct job *j, struct input_message *m)
 	}
 }
 
-static void move_trace_file(const char *trace_filename)
+/* must match landslide's arbiter.h */
+#define CHOICE_TRACE_SUFFIX ".choices"
+
+/* Returns the file's new path, or NULL if it was optional and didn't exist.
+ * NB. The new path works from LANDSLIDE_PATH as well as from here. */
+static char *move_to_root_path(const char *filename, bool optional)
 {
 	/* + 2 because 1 for the '/' in between and 1 for the null. */
 	unsigned int length_old =
-		strlen(LANDSLIDE_PATH) + strlen(trace_filename) + 2;
+		strlen(LANDSLIDE_PATH) + strlen(filename) + 2;
 	unsigned int length_new =
-		strlen(ROOT_PATH) + strlen(trace_filename) + 2;
+		strlen(ROOT_PATH) + strlen(filename) + 2;
 	char *old_path = XMALLOC(length_old, char);
 	char *new_path = XMALLOC(length_new, char);
-	scnprintf(old_path, length_old, "%s/%s", LANDSLIDE_PATH, trace_filename);
-	scnprintf(new_path, length_new, "%s/%s", ROOT_PATH, trace_filename);
-	XRENAME(old_path, new_path);
+	scnprintf(old_path, length_old, "%s/%s", LANDSLIDE_PATH, filename);
+	scnprintf(new_path, length_new, "%s/%s", ROOT_PATH, filename);
+	if (optional && access(old_path, F_OK) != 0) {
+		FREE(new_path);
+		new_path = NULL;
+	} else {
+		XRENAME(old_path, new_path);
+	}
 	FREE(old_path);
-	FREE(new_path);
+	return new_path;
+}
+
+/* Returns the path of the bug's choice trace, if landslide managed to write
+ * one, so it can be replayed. */
+static char *move_trace_file(const char *trace_filename)
+{
+	FREE(move_to_root_path(trace_filename, false));
+
+	unsigned int length =
+		strlen(trace_filename) + strlen(CHOICE_TRACE_SUFFIX) + 1;
+	char *choices_filename = XMALLOC(length, char);
+	scnprintf(choices_filename, length, "%s%s", trace_filename,
+		  CHOICE_TRACE_SUFFIX);
+	char *choices_path = move_to_root_path(choices_filename, true);
+	FREE(choices_filename);
+	return choices_path;
 }
 
 static void handle_found_a_bug(struct job *j, char *trace_filename,
 			       unsigned int trace_length,
-			       unsigned int icb_preemption_count)
+			       unsigned int icb_preemption_count, bool replayed)
 {
-	move_trace_file(trace_filename);
+	char *choices_path = move_trace_file(trace_filename);
 	/* NB. Harmless if/then/else race; could cause simply
 	 * extraneous bug reports when this races itself. */
 	if (bug_already_found(j->config) && !j->minimizing_trace) {
@@ -353,20 +393,31 @@ static void handle_found_a_bug(struct job *j, char *trace_filename,
 		WRITE_LOCK(&j->stats_lock);
 		j->cancelled = true;
 		RW_UNLOCK(&j->stats_lock);
+		FREE(choices_path);
 		return;
 	}
 
 	READ_LOCK(&j->stats_lock);
-	/* this should scare you. it scares me. */
-	bool need_rerun = testing_pintos() && j->elapsed_branches == 0;
+	/* this should scare you. it scares me. (unless landslide says it got
+	 * here by making every choice of a trace recorded by an earlier run;
+	 * then a fresh simics has hit the same bug by the same path twice.) */
+	bool need_rerun = testing_pintos() && j->elapsed_branches == 0 &&
+		!replayed;
 	RW_UNLOCK(&j->stats_lock);
 	if (need_rerun && !j->minimizing_trace) {
 		WRITE_LOCK(&j->stats_lock);
 		j->elapsed_branches++;
 		j->need_rerun = true;
+		/* the rerun will follow this branch to check the bug recurs; if
+		 * we ourselves strayed from an older trace, try the new one */
+		if (j->replay_filename != NULL) {
+			FREE(j->replay_filename);
+		}
+		j->replay_filename = choices_path;
 		RW_UNLOCK(&j->stats_lock);
 		return;
 	}
+	FREE(choices_path);
 
 	found_a_bug(trace_filename, j);
 
@@ -401,6 +452,14 @@ static void handle_found_a_bug(struct job *j, char *trace_filename,
 
 /* messaging logic */
 
+static void delete_control_file(struct messaging_state *state)
+{
+	int ret = munmap((void *)state->control, sizeof(struct control_block));
+	assert(ret == 0 && "failed unmap control file");
+	state->control = NULL;
+	delete_file(&state->control_file, true);
+}
+
 /* creates the fifo files on the filesystem, but does not block on them yet. */
 void messaging_init(struct messaging_state *state, struct file *config_static,
 		    struct file *config_dynamic, unsigned int job_id)
@@ -409,9 +468,16 @@ void messaging_init(struct messaging_state *state, struct file *config_static,
 	state->output_pipe_name = create_fifo("id-output-pipe", job_id);
 	state->ready = false;
 
+	state->control = create_shared_file(&state->control_file, "id-control",
+					    job_id, sizeof(struct control_block));
+	state->control->magic = MESSAGING_MAGIC;
+	state->control->should_abort = false;
+	state->control->suspends = 0;
+
 	/* our output is the child's input and V. V. */
 	XWRITE(config_dynamic, "output_pipe %s\n", state->input_pipe_name);
 	XWRITE(config_dynamic, "input_pipe %s\n", state->output_pipe_name);
+	XWRITE(config_dynamic, "control_file %s\n", state->control_file.filename);
 	XWRITE(config_static, "id_magic %u\n", MESSAGING_MAGIC);
 }
 
@@ -461,11 +527,18 @@ void talk_to_child(struct messaging_state *state, struct job *j)
 					m.content.estimate.total_usecs,
 					m.content.estimate.elapsed_usecs,
 					m.content.estimate.icb_cur_bound);
+			/* publish whether it should go on past its next branch */
+			if (!state->control->should_abort &&
+			    !handle_should_continue(j)) {
+				state->control->should_abort = true;
+			}
 		} else if (m.tag == FOUND_A_BUG) {
 			handle_found_a_bug(j, m.content.bug.trace_filename,
 					   m.content.bug.trace_length,
-					   m.content.bug.icb_preemption_count);
+					   m.content.bug.icb_preemption_count,
+					   m.content.bug.replayed);
 		} else if (m.tag == SHOULD_CONTINUE) {
+			/* superseded by the control block, but still answered */
 			struct output_message reply;
 			reply.tag = SHOULD_CONTINUE_REPLY;
 			reply.value = !handle_should_continue(j);
@@ -490,6 +563,7 @@ void finish_messaging(struct messaging_state *state)
 	} else {
 		delete_unused_fifo(state->output_pipe_name);
 	}
+	delete_control_file(state);
 }
 
 void messaging_abort(struct messaging_state *state)
@@ -498,4 +572,5 @@ void messaging_abort(struct messaging_state *state)
 	assert(state->output_pipe_name != NULL);
 	delete_unused_fifo(state->input_pipe_name);
 	delete_unused_fifo(state->output_pipe_name);
+	delete_control_file(state);
 }
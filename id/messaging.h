@@ -12,6 +12,7 @@
 #include "io.h"
 
 struct job;
+struct control_block;
 
 struct messaging_state {
 	char *input_pipe_name;
@@ -19,6 +20,9 @@ struct messaging_state {
 	struct file input_pipe;
 	struct file output_pipe;
 	bool ready;
+	/* mapped shared with the child; see messaging.c */
+	struct file control_file;
+	volatile struct control_block *control;
 };
 
 void messaging_init(struct messaging_state *state, struct file *config_static,
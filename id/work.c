@@ -295,8 +295,12 @@ static void process_work(struct job *j, bool was_blocked)
 			if (need_rerun) {
 				WARN("[JOB %d] failed on branch 1, needs rerun\n",
 				     j->id);
-				add_work(new_job(j->config, j->should_reproduce,
-						 j->minimizing_trace));
+				struct job *rerun = new_job(j->config,
+							    j->should_reproduce,
+							    j->minimizing_trace);
+				rerun->replay_filename = j->replay_filename;
+				j->replay_filename = NULL;
+				add_work(rerun);
 			} else
 			/* Job ran to completion. */
 			/* Don't let "small" jobs mark DRs as verified: they're
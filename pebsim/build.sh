@@ -44,6 +44,12 @@ function starting_threads {
 function id_magic {
 	echo -n
 }
+function runtime_option {
+	echo -n
+}
+function replay_choices {
+	echo -n
+}
 INPUT_PIPE=
 function input_pipe {
 	if [ ! -z "$INPUT_PIPE" ]; then
@@ -60,6 +66,14 @@ function output_pipe {
 	OUTPUT_PIPE=$1
 }
 
+CONTROL_FILE=
+function control_file {
+	if [ ! -z "$CONTROL_FILE" ]; then
+		die "control_file called more than once; oldval $CONTROL_FILE, newval $1"
+	fi
+	CONTROL_FILE=$1
+}
+
 # Doesn't work without the "./". Everything is awful forever.
 if [ ! -f "./$LANDSLIDE_CONFIG" ]; then
 	die "Where's $LANDSLIDE_CONFIG?"
@@ -74,6 +88,9 @@ EXTRA_VERBOSE=0
 TABULAR_TRACE=0
 OBFUSCATED_KERNEL=0
 PINTOS_KERNEL=
+BUILD_CACHE_DIR=build-cache
+BUILD_CACHE_ENTRIES=16
+WARM_START=0
 source ./$LANDSLIDE_CONFIG
 
 if [ ! -z "$QUICKSAND_CONFIG_STATIC" ]; then
@@ -135,6 +152,15 @@ verify_numeric PRINT_DATA_RACES
 verify_numeric VERBOSE
 verify_numeric EXTRA_VERBOSE
 verify_numeric TABULAR_TRACE
+if [ ! -z "$TREE_MEMORY_LIMIT_KB" ]; then
+	verify_numeric TREE_MEMORY_LIMIT_KB
+fi
+if [ ! -z "$ANALYSIS_THREADS" ]; then
+	verify_numeric ANALYSIS_THREADS
+fi
+verify_nonempty BUILD_CACHE_DIR
+verify_numeric BUILD_CACHE_ENTRIES
+verify_numeric WARM_START
 if [ "$TESTING_USERSPACE" = 1 ]; then
 	verify_nonempty EXEC
 fi
@@ -164,7 +190,7 @@ if [ -z "$PINTOS_KERNEL" ]; then
 	if ! grep "${TEST_CASE}_exec2obj_userapp_code_ptr" $KERNEL_IMG 2>&1 >/dev/null; then
 		die "Missing test program: $KERNEL_IMG isn't built with '$TEST_CASE'!"
 	fi
-else
+elif [ -z "$QUICKSAND_PREBUILT" ]; then
 	# Pintos. Verify
 	msg "Verifying bootfd built to run $TEST_CASE."
 	cd pintos || die "couldn't cd pintos"
@@ -194,12 +220,83 @@ if [ ! -z "$MISSING_ANNOTATIONS" ]; then
 	die "Please fix the missing annotations."
 fi
 
+#### Look up build cache ####
+
+# Built modules are kept in $BUILD_CACHE_DIR, one directory per variant, named
+# by the hash of everything the build depends on. Variants coexist, so jobs
+# (or whole quicksand runs) alternating between configs needn't rebuild.
+LANDSLIDE_SRC=../work/modules/landslide
+BUILD_KEY=`(md5sum < $KERNEL_IMG
+	md5sum < ./$LANDSLIDE_CONFIG
+	if [ ! -z "$QUICKSAND_CONFIG_STATIC" ]; then
+		md5sum < ./$QUICKSAND_CONFIG_STATIC
+	fi
+	# landslide-config.py checks bootfd.img's md5 for every kernel, not just
+	# pintos, so a cached config is only good for the same bootfd.img.
+	md5sum < bootfd.img
+	ls $LANDSLIDE_SRC/*.[ch] | grep -v student_specifics.h | xargs cat $LANDSLIDE_SRC/Makefile ./build.sh ./definegen.sh ./configgen.sh | md5sum
+	) | md5sum | cut -d' ' -f1`
+BUILD_CACHE_ENTRY="$BUILD_CACHE_DIR/$BUILD_KEY"
+BUILD_CACHED=
+if [ -f "$BUILD_CACHE_ENTRY/landslide.so" ]; then
+	BUILD_CACHED=yes
+fi
+
+# Tells simics which module to load, via ./landslide.
+function use_cached_build {
+	if [ ! -z "$LANDSLIDE_MODULE_DIR_FILE" ]; then
+		echo "$PWD/$BUILD_CACHE_ENTRY" > "$LANDSLIDE_MODULE_DIR_FILE" || die "couldn't write to $LANDSLIDE_MODULE_DIR_FILE"
+	fi
+	# Mark it recently used, so eviction spares it.
+	touch "$BUILD_CACHE_ENTRY"
+	if ! cmp "$BUILD_CACHE_ENTRY/landslide-config.py" landslide-config.py >/dev/null 2>/dev/null; then
+		cp "$BUILD_CACHE_ENTRY/landslide-config.py" landslide-config.py || die "couldn't restore landslide-config.py"
+	fi
+}
+
+function add_to_build_cache {
+	MODULE_SO=`ls ../work/*/lib/landslide.so 2>/dev/null | head -n 1`
+	if [ ! -f "$MODULE_SO" ]; then
+		die "Built landslide, but where's landslide.so?"
+	fi
+	mkdir -p "$BUILD_CACHE_DIR" || die "couldn't create $BUILD_CACHE_DIR"
+	# Assemble it to the side, so a concurrent lookup never sees half of it.
+	NEW_ENTRY=`mktemp -d "$BUILD_CACHE_DIR/new.XXXXXXXX"` || die "couldn't create temp dir in $BUILD_CACHE_DIR"
+	cp "$MODULE_SO" $HEADER landslide-config.py "$NEW_ENTRY" || die "couldn't copy build into $NEW_ENTRY"
+	if ! mv -T "$NEW_ENTRY" "$BUILD_CACHE_ENTRY" 2>/dev/null; then
+		# Someone else cached the same variant first.
+		rm -rf "$NEW_ENTRY"
+	fi
+	# Evict the least recently used variants. Other builders' half-assembled
+	# entries aren't variants yet; leave those alone.
+	ls -td "$BUILD_CACHE_DIR"/*/ | grep -v '/new\.[^/]*/$' | tail -n +$(($BUILD_CACHE_ENTRIES + 1)) | xargs rm -rf
+}
+
+if [ -z "$BUILD_CACHED" ]; then
+	if [ ! -z "$QUICKSAND_PREBUILT" ]; then
+		# An earlier job built this very variant, but it has since been
+		# evicted (or the cache was cleared). Just build it again.
+		err "Told landslide was prebuilt, but nothing is cached for these inputs; rebuilding."
+	fi
+	# Builders share ../work and the header, so take turns. Whoever went
+	# first may well have built and cached what we need meanwhile.
+	mkdir -p "$BUILD_CACHE_DIR" || die "couldn't create $BUILD_CACHE_DIR"
+	exec 9> "$BUILD_CACHE_DIR/build.lock" || die "couldn't open $BUILD_CACHE_DIR/build.lock"
+	flock 9 || die "couldn't lock $BUILD_CACHE_DIR/build.lock"
+	if [ -f "$BUILD_CACHE_ENTRY/landslide.so" ]; then
+		BUILD_CACHED=yes
+	fi
+fi
+
 #### Check file sanity ####
 
-HEADER=../work/modules/landslide/student_specifics.h
-STUDENT=../work/modules/landslide/student.c
+HEADER=$LANDSLIDE_SRC/student_specifics.h
+STUDENT=$LANDSLIDE_SRC/student.c
 SKIP_HEADER=
-if [ -L $HEADER ]; then
+if [ ! -z "$BUILD_CACHED" ]; then
+	# Built before from these same inputs; the cached module will be used.
+	SKIP_HEADER=yes
+elif [ -L $HEADER ]; then
 	rm $HEADER
 elif [ -f $HEADER ]; then
 	if grep 'automatically generated' $HEADER 2>&1 >/dev/null; then
@@ -236,7 +333,7 @@ if [ ! -z "$QUICKSAND_CONFIG_DYNAMIC" ]; then
 	# ./landslide defines QUICKSAND_CONFIG_TEMP as a temp file to use here
 	[ ! -z "$QUICKSAND_CONFIG_TEMP" ] || die "failed make temp file for PP config"
 
-	# commands are K, U, DR, I, and O.
+	# commands are K, U, DR, I, O, C, R, and P.
 	function within_function {
 		echo "K 0x`get_func $1` 0x`get_func_end $1` 1" >> "$QUICKSAND_CONFIG_TEMP" || die "couldn't write to $QUICKSAND_CONFIG_TEMP"
 	}
@@ -261,6 +358,18 @@ if [ ! -z "$QUICKSAND_CONFIG_DYNAMIC" ]; then
 	function output_pipe {
 		echo "O $1" >> "$QUICKSAND_CONFIG_TEMP" || die "couldn't write to $QUICKSAND_CONFIG_TEMP"
 	}
+	function control_file {
+		echo "C $1" >> "$QUICKSAND_CONFIG_TEMP" || die "couldn't write to $QUICKSAND_CONFIG_TEMP"
+	}
+	function runtime_option {
+		if [ -z "$1" -o -z "$2" ]; then
+			die "runtime_option needs two args: got \"$1\" and \"$2\""
+		fi
+		echo "R $1 $2" >> "$QUICKSAND_CONFIG_TEMP" || die "couldn't write to $QUICKSAND_CONFIG_TEMP"
+	}
+	function replay_choices {
+		echo "P $1" >> "$QUICKSAND_CONFIG_TEMP" || die "couldn't write to $QUICKSAND_CONFIG_TEMP"
+	}
 	source "$QUICKSAND_CONFIG_DYNAMIC"
 fi
 
@@ -278,11 +387,37 @@ fi
 
 #### Do the needful ####
 
+# Point 'kernel' at $KERNEL_IMG, which simics boots and landslide-config.py
+# checksums. Done even for cached builds, as the last build may have been for
+# some other kernel.
+if [ -f kernel -o -d kernel ]; then
+	if ! cmp "$KERNEL_IMG" kernel 2>&1 >/dev/null; then
+		if [ -L kernel ]; then
+			rm kernel
+			ln -s $KERNEL_IMG kernel
+		else
+			die "'kernel' exists, would be clobbered, please remove/relocate it."
+		fi
+	fi
+else
+	ln -s $KERNEL_IMG kernel
+fi
+
+if [ ! -z "$BUILD_CACHED" ]; then
+	use_cached_build
+	success "Using cached build $BUILD_KEY."
+	exit 0
+fi
+
 msg "Generating simics config..."
 ./configgen.sh > landslide-config.py || die "configgen.sh failed."
 if [ -z "$SKIP_HEADER" ]; then
 	msg "Generating header file..."
 	./definegen.sh > $HEADER || (rm -f $HEADER; die "definegen.sh failed.")
+	# Every annotated address is #defined above as a hex literal; collect
+	# them so landslide can skip instructions that aren't at any of them.
+	INTERESTING_EIPS=`awk 'NF == 3 && $1 == "#define" && $3 ~ /^0x[0-9a-fA-F]+$/ { printf " %s,", $3 }' $HEADER`
+	sed -i "\$i #define INTERESTING_EIPS {$INTERESTING_EIPS }\n" $HEADER || (rm -f $HEADER; die "Couldn't add interesting eips to $HEADER.")
 else
 	msg "Header already generated; skipping."
 fi
@@ -292,4 +427,6 @@ if [ ! -f $STUDENT ]; then
 fi
 # XXX FIXME: Shouldn't need to 'make clean' here. But trying to hack around bug #114.
 (cd ../work && make clean && make) || die "Building landslide failed."
+add_to_build_cache
+use_cached_build
 success "Build succeeded."
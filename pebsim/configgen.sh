@@ -46,6 +46,15 @@ OUTPUT_PIPE=
 function output_pipe {
 	OUTPUT_PIPE=$1
 }
+function control_file {
+	echo -n
+}
+function runtime_option {
+	echo -n
+}
+function replay_choices {
+	echo -n
+}
 
 function die {
 	echo -e "\033[01;31m$1\033[00m" >&2
@@ -63,6 +72,7 @@ fi
 TIMER_WRAPPER_DISPATCH=
 IDLE_TID=
 PINTOS_KERNEL=
+WARM_START=0
 source $CONFIG
 
 if [ ! -z "$QUICKSAND_CONFIG_STATIC" ]; then
@@ -85,19 +95,6 @@ if [ ! -f "./bootfd.img" ]; then
 	die "Where's bootfd.img?"
 fi
 
-if [ -f kernel -o -d kernel ]; then
-	if ! cmp "$KERNEL_IMG" kernel 2>&1 >/dev/null; then
-		if [ -L kernel ]; then
-			rm kernel
-			ln -s $KERNEL_IMG kernel
-		else
-			die "'kernel' exists, would be clobbered, please remove/relocate it."
-		fi
-	fi
-else
-	ln -s $KERNEL_IMG kernel
-fi
-
 # Generate file
 
 echo "# This function is automatically generated by configgen.sh."
@@ -111,6 +108,12 @@ else
 	echo "ls_pintos = \"no\""
 fi
 
+if [ "$WARM_START" = 1 ]; then
+	echo "ls_warm_start = \"yes\""
+else
+	echo "ls_warm_start = \"no\""
+fi
+
 echo "import hashlib"
 KERNEL_MD5=`md5sum kernel | cut -d" " -f1`
 echo -e "kernel_md5 = hashlib.md5(file(\"kernel\", \"r\").read()).hexdigest()"
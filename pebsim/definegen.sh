@@ -9,9 +9,34 @@
 
 source ./getfunc.sh
 
+# Takes lines of "start end" hex addresses (inclusive, as from get_func and
+# get_func_end) and prints them as C table rows sorted by start, with any
+# overlapping ranges merged, so landslide can binary search them instead of
+# scanning (see in_interval_table()). $1 is appended to each row as extra
+# columns, if the table needs any. Both columns are first padded to the same
+# width (get_func pads, get_func_end doesn't), so string order is numeric order.
+function interval_table {
+	grep -v '^$' | while read START END; do
+		printf "%08x %08x\n" "0x$START" "0x$END"
+	done | sort | awk -v extra="$1" '
+		function emit() { printf "\\\\\\n\\t{ 0x%s, 0x%s%s },", start, end, extra }
+		start != "" && ($1 "") <= (end "") { if (($2 "") > (end "")) end = $2; next }
+		start != "" { emit() }
+		{ start = $1; end = $2 }
+		END { if (start != "") emit() }'
+}
+
+# Merging too much would silently widen the tables, turning off shm tracking
+# across whatever code lies between the listed functions, so make sure ranges
+# that don't overlap come out as separate rows.
+INTERVAL_CHECK=`echo -ne "00105000 105100\n00100000 100010\n00100020 100030\n00100028 100040\n" | interval_table`
+if [ "`echo -n "$INTERVAL_CHECK" | grep -o "{ 0x" | wc -l`" != 3 ]; then
+	die "interval_table merged disjoint ranges: $INTERVAL_CHECK"
+fi
+
 SCHED_FUNCS=
 function sched_func {
-	SCHED_FUNCS="${SCHED_FUNCS}\\\\\n\t{ 0x`get_func $1`, 0x`get_func_end $1` },"
+	SCHED_FUNCS="${SCHED_FUNCS}`get_func $1` `get_func_end $1`\n"
 }
 
 IGNORE_SYMS=
@@ -48,10 +73,10 @@ function ignore_dr_function {
 	if [ "$USERSPACE_DR_FN" = 0 ]; then
 		# kernel
 		# the 0 parameter is unused (for now; there could be a whitelist later)
-		IGNORE_DR_FUNCTIONS="${IGNORE_DR_FUNCTIONS}\\\\\n\t{ 0x`get_func $1`, 0x`get_func_end $1`, 0 },"
+		IGNORE_DR_FUNCTIONS="${IGNORE_DR_FUNCTIONS}`get_func $1` `get_func_end $1`\n"
 	else
 		# user -- default, including no arg
-		IGNORE_DR_FUNCTIONS="${IGNORE_DR_FUNCTIONS}\\\\\n\t{ 0x`get_user_func $1`, 0x`get_user_func_end $1`, 0 },"
+		IGNORE_DR_FUNCTIONS="${IGNORE_DR_FUNCTIONS}`get_user_func $1` `get_user_func_end $1`\n"
 	fi
 }
 
@@ -132,6 +157,8 @@ PREEMPT_EVERYWHERE=0
 PURE_HAPPENS_BEFORE=0
 HTM=0
 HTM_ABORT_CODES=0
+TREE_MEMORY_LIMIT_KB=1024
+ANALYSIS_THREADS=2
 source $CONFIG
 
 source ./symbols.sh
@@ -604,7 +631,7 @@ echo
 # Things that are likely to always touch shared memory that you don't care about
 # such as runqueue links, but not those that the globals list filters out, such
 # as links inside each tcb.
-echo -e "#define GUEST_SCHEDULER_FUNCTIONS { $SCHED_FUNCS }"
+echo -e "#define GUEST_SCHEDULER_FUNCTIONS { `echo -ne "$SCHED_FUNCS" | interval_table` }"
 
 echo -e "#define GUEST_SCHEDULER_GLOBALS { $IGNORE_SYMS }"
 
@@ -648,7 +675,7 @@ echo -e "$EXTRA_SYMS"
 # if called from quicksand, these will be prepended to any dynamic pps.
 echo -e "#define KERN_WITHIN_FUNCTIONS { $WITHIN_KERN_FUNCTIONS }"
 echo -e "#define USER_WITHIN_FUNCTIONS { $WITHIN_USER_FUNCTIONS }"
-echo -e "#define IGNORE_DR_FUNCTIONS   { $IGNORE_DR_FUNCTIONS   }"
+echo -e "#define IGNORE_DR_FUNCTIONS   { `echo -ne "$IGNORE_DR_FUNCTIONS" | interval_table ", 0"`   }"
 
 echo "#define DATA_RACE_INFO { $DATA_RACE_INFO }"
 echo "#define DISK_IO_FNS { $DISK_IO_FNS }"
@@ -667,10 +694,13 @@ echo "#define VERBOSE $VERBOSE"
 echo "#define EXTRA_VERBOSE $EXTRA_VERBOSE"
 echo "#define TABULAR_TRACE $TABULAR_TRACE"
 echo "#define ALLOW_LOCK_HANDOFF $ALLOW_LOCK_HANDOFF"
+echo "#define TREE_MEMORY_LIMIT_KB $TREE_MEMORY_LIMIT_KB"
+echo "#define ANALYSIS_THREADS $ANALYSIS_THREADS"
+# Quicksand may turn ICB on per job at runtime, so the bound is always needed.
 if [ "$ICB" = 1 ]; then
 	echo "#define ICB"
-	echo "#define ICB_START_BOUND $ICB_START_BOUND"
 fi
+echo "#define ICB_START_BOUND $ICB_START_BOUND"
 
 if [ ! -z "$ID_WRAPPER_MAGIC" ]; then
 	echo "#define ID_WRAPPER_MAGIC $ID_WRAPPER_MAGIC"
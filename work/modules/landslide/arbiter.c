@@ -19,6 +19,7 @@
 #include "pp.h"
 #include "rand.h"
 #include "schedule.h"
+#include "snapshot.h"
 #include "user_specifics.h"
 #include "user_sync.h"
 #include "x86.h"
@@ -26,6 +27,9 @@
 void arbiter_init(struct arbiter_state *r)
 {
 	Q_INIT_HEAD(&r->choices);
+	ARRAY_LIST_INIT(&r->replay, 16);
+	r->replay_next = 0;
+	r->replay_abandoned = false;
 }
 
 void arbiter_append_choice(struct arbiter_state *r, unsigned int tid, bool txn, unsigned int xabort_code)
@@ -53,6 +57,115 @@ bool arbiter_pop_choice(struct arbiter_state *r, unsigned int *tid, bool *txn, u
 	}
 }
 
+/******************************************************************************
+ * choice trace replay
+ ******************************************************************************/
+
+bool arbiter_load_replay(struct arbiter_state *r, const char *filename)
+{
+	struct snapshot s;
+	uint32_t magic, num_choices;
+
+	assert(ARRAY_LIST_SIZE(&r->replay) == 0 && "already replaying a trace");
+	if ((s.file = fopen(filename, "r")) == NULL) {
+		lsprintf(ALWAYS, "warning: can't open choice trace %s; "
+			 "exploring normally\n", filename);
+		return false;
+	}
+	s.ok = true;
+
+	SNAPSHOT_READ(&s, magic);
+	SNAPSHOT_READ(&s, num_choices);
+	if (magic != CHOICE_TRACE_MAGIC) {
+		s.ok = false;
+	}
+	for (uint32_t i = 0; s.ok && i < num_choices; i++) {
+		struct replay_choice c;
+		SNAPSHOT_READ(&s, c);
+		ARRAY_LIST_APPEND(&r->replay, c);
+	}
+	fclose(s.file);
+
+	if (!s.ok) {
+		lsprintf(ALWAYS, "warning: choice trace %s is corrupt; "
+			 "exploring normally\n", filename);
+		ARRAY_LIST_FREE(&r->replay);
+		ARRAY_LIST_INIT(&r->replay, 16);
+		return false;
+	}
+	lsprintf(DEV, "replaying %u choices from %s\n", num_choices, filename);
+	return true;
+}
+
+static void stop_replay(struct arbiter_state *r, const char *why)
+{
+	lsprintf(ALWAYS, COLOUR_BOLD COLOUR_YELLOW "WARNING: abandoning "
+		 "choice trace replay after %u of %u choices: %s\n",
+		 r->replay_next, ARRAY_LIST_SIZE(&r->replay), why);
+	r->replay_next = ARRAY_LIST_SIZE(&r->replay);
+	r->replay_abandoned = true;
+}
+
+/* Whether a choice trace was loaded and every one of its choices was made. */
+bool arbiter_replay_completed(struct arbiter_state *r)
+{
+	return ARRAY_LIST_SIZE(&r->replay) > 0 && !r->replay_abandoned &&
+		r->replay_next == ARRAY_LIST_SIZE(&r->replay);
+}
+
+/* When replaying a choice trace, the arbiter's choices are overridden by the
+ * recorded ones, at the preemption points whose trigger counts they name. The
+ * trace only describes the first branch; if execution strays from it, or we
+ * time travel, exploration carries on as though there were no trace at all.
+ * Returns true if a recorded choice was made, with the same outputs as
+ * arbiter_choose, plus whether to inject a txn failure in the result. */
+bool arbiter_replay_choice(struct ls_state *ls, bool voluntary,
+			   struct agent **result, bool *our_choice, bool *txn,
+			   unsigned int *xabort_code)
+{
+	struct arbiter_state *r = &ls->arbiter;
+	struct sched_state *s = &ls->sched;
+
+	if (r->replay_next == ARRAY_LIST_SIZE(&r->replay)) {
+		return false;
+	} else if (ls->save.total_jumps > 0) {
+		stop_replay(r, "already time travelled");
+		return false;
+	}
+
+	struct replay_choice *c = ARRAY_LIST_GET(&r->replay, r->replay_next);
+	if (c->trigger_count > ls->trigger_count) {
+		/* Not there yet. */
+		return false;
+	} else if (c->trigger_count < ls->trigger_count) {
+		stop_replay(r, "missed a recorded preemption point");
+		return false;
+	}
+	r->replay_next++;
+
+	struct agent *a;
+	if (c->tid == s->cur_agent->tid) {
+		a = s->cur_agent;
+	} else if ((a = agent_by_tid_or_null(&s->rq, c->tid)) == NULL) {
+		a = agent_by_tid_or_null(&s->sq, c->tid);
+	}
+	if (a == NULL || (c->txn && a != s->cur_agent)) {
+		stop_replay(r, "recorded tid can't run here");
+		return false;
+	}
+
+	lsprintf(DEV, "replaying choice %u: TID %d%s\n", r->replay_next,
+		 a->tid, c->txn ? " (xbegin failure injection)" : "");
+	if (!NO_PREEMPTION_REQUIRED(s, voluntary, a)) {
+		s->icb_preemption_count++;
+	}
+	*result = a;
+	*our_choice = true;
+	*txn = c->txn != 0;
+	*xabort_code = c->xabort_code;
+	return true;
+}
+
 #define ASSERT_ONE_THREAD_PER_PP(ls) do {					\
 		assert((/* root pp not created yet */				\
 		        (ls)->save.next_tid == -1 ||				\
@@ -340,9 +453,7 @@ bool arbiter_choose(struct ls_state *ls, struct agent *current, bool voluntary,
 
 //#define CHOOSE_RANDOMLY
 #ifdef CHOOSE_RANDOMLY
-#ifdef ICB
-	STATIC_ASSERT(false && "ICB and CHOOSE_RANDOMLY are incompatible");
-#endif
+	assert(!ls->icb && "ICB and CHOOSE_RANDOMLY are incompatible");
 	// with given odds, will make the "forwards" choice.
 	const int numerator   = 19;
 	const int denominator = 20;
@@ -353,9 +464,7 @@ bool arbiter_choose(struct ls_state *ls, struct agent *current, bool voluntary,
 	if (EXPLORE_BACKWARDS == 0) {
 		count = 1;
 	} else {
-#ifdef ICB
-		assert(false && "For ICB, EXPLORE_BACKWARDS must be 0.");
-#endif
+		assert(!ls->icb && "For ICB, EXPLORE_BACKWARDS must be 0.");
 	}
 #endif
 
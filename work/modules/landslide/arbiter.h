@@ -7,6 +7,9 @@
 #ifndef __LS_ARBITER_H
 #define __LS_ARBITER_H
 
+#include <stdint.h>
+
+#include "array_list.h"
 #include "variable_queue.h"
 
 struct ls_state;
@@ -21,8 +24,27 @@ struct choice {
 
 Q_NEW_HEAD(struct choice_q, struct choice);
 
+/* A choice trace, as emitted by found_a_bug for the branch that found it, is
+ * this magic number followed by a count and that many of these records, one
+ * per preemption point from the root down. Replaying it makes the first branch
+ * of a later run make the same choices, to reproduce the bug straightaway. */
+#define CHOICE_TRACE_MAGIC 0x5ec0ffeeu
+/* appended to the html trace's name; quicksand relies on this too */
+#define CHOICE_TRACE_SUFFIX ".choices"
+
+struct replay_choice {
+	uint64_t trigger_count; /* of the preemption point */
+	int32_t tid; /* to run after it */
+	uint32_t txn; /* whether tid fails to transact (with xabort_code) */
+	uint32_t xabort_code;
+};
+
 struct arbiter_state {
 	struct choice_q choices;
+	/* choice trace being replayed, if any; next is the upcoming record */
+	ARRAY_LIST(struct replay_choice) replay;
+	unsigned int replay_next;
+	bool replay_abandoned;
 };
 
 /* maintenance interface */
@@ -31,6 +53,8 @@ void arbiter_append_choice(struct arbiter_state *, unsigned int tid, bool txn,
 			   unsigned int xabort_code);
 bool arbiter_pop_choice(struct arbiter_state *, unsigned int *tid, bool *txn,
 			unsigned int *xabort_code);
+bool arbiter_load_replay(struct arbiter_state *, const char *filename);
+bool arbiter_replay_completed(struct arbiter_state *);
 
 /* scheduling interface */
 bool arbiter_interested(struct ls_state *, bool just_finished_reschedule,
@@ -38,5 +62,8 @@ bool arbiter_interested(struct ls_state *, bool just_finished_reschedule,
 			bool *xbegin);
 bool arbiter_choose(struct ls_state *, struct agent *current, bool voluntary,
 		    struct agent **result, bool *our_choice);
+bool arbiter_replay_choice(struct ls_state *, bool voluntary,
+			   struct agent **result, bool *our_choice, bool *txn,
+			   unsigned int *xabort_code);
 
 #endif
@@ -0,0 +1,83 @@
+/**
+ * @file arena.c
+ * @brief bump allocator for data that all dies at the same time
+ * @author Ben Blum
+ */
+
+#include <simics/alloc.h>
+
+#define MODULE_NAME "ARENA"
+#define MODULE_COLOUR COLOUR_DARK COLOUR_WHITE
+
+#include "arena.h"
+#include "common.h"
+#include "compiler.h"
+
+/* Big enough that a transition's worth of shm tracking typically needs only a
+ * handful of blocks; requests bigger than this get a block of their own. */
+#define ARENA_BLOCK_SIZE ((size_t)(64 * 1024))
+#define ARENA_ALIGN sizeof(void *)
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+void arena_init(struct arena *a)
+{
+	a->blocks = NULL;
+	a->total_size = 0;
+}
+
+static struct arena_block *new_block(struct arena *a, size_t size)
+{
+	struct arena_block *b = (struct arena_block *)
+		MM_XMALLOC(sizeof(struct arena_block) + size, char);
+	b->size = size;
+	b->used = 0;
+	b->next = a->blocks;
+	a->blocks = b;
+	return b;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_block *b = a->blocks;
+
+	/* keep everything pointer-aligned */
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (size == 0) {
+		/* e.g. cloning an empty array list; must still be non-NULL */
+		size = ARENA_ALIGN;
+	}
+
+	if (b == NULL || b->size - b->used < size) {
+		b = new_block(a, MAX(size, ARENA_BLOCK_SIZE));
+	}
+
+	void *result = &b->data[b->used];
+	b->used += size;
+	a->total_size += size;
+	return result;
+}
+
+void arena_reset(struct arena *a)
+{
+	while (a->blocks != NULL) {
+		struct arena_block *b = a->blocks;
+		a->blocks = b->next;
+		MM_FREE(b);
+	}
+	a->total_size = 0;
+}
+
+void arena_move(struct arena *dest, struct arena *src)
+{
+	assert(dest->blocks == NULL && "arena_move would leak dest's blocks");
+	dest->blocks = src->blocks;
+	dest->total_size = src->total_size;
+	src->blocks = NULL;
+	src->total_size = 0;
+}
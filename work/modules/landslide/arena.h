@@ -0,0 +1,31 @@
+/**
+ * @file arena.h
+ * @brief bump allocator for data that all dies at the same time
+ * @author Ben Blum
+ */
+
+#ifndef __LS_ARENA_H
+#define __LS_ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+
+/* Allocation is a pointer increment into the most recent block; there is no
+ * way to free individual objects. Everything goes away at once with
+ * arena_reset(). An arena with no blocks is valid and owns nothing. */
+struct arena {
+	struct arena_block *blocks;
+	size_t total_size; /* bytes handed out (stats) */
+};
+
+void arena_init(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+/* steals src's blocks; src is left empty. dest must not own anything. */
+void arena_move(struct arena *dest, struct arena *src);
+
+/* like MM_XMALLOC, but from an arena */
+#define ARENA_XMALLOC(a, n, T) ((T *)arena_alloc((a), (n) * sizeof(T)))
+
+#endif
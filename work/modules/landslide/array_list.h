@@ -7,6 +7,7 @@
 #ifndef __LS_ARRAY_LIST_H
 #define __LS_ARRAY_LIST_H
 
+#include "arena.h"
 #include "common.h" /* MM_XMALLOC / MM_FREE */
 #include "compiler.h"
 
@@ -38,6 +39,33 @@
 		       __src->size * sizeof(*__src->array));			\
 	} while (0)
 
+/* as above, but the copy's storage belongs to an arena (see arena.h), so it
+ * must never be ARRAY_LIST_FREEd nor grown. */
+#define ARRAY_LIST_CLONE_ARENA(dest, src, arena) do {				\
+		STATIC_ASSERT(SAME_TYPE(*(dest)->array, *(src)->array));	\
+		typeof(dest) __dest = (dest);					\
+		typeof(src)  __src  = (src);					\
+		__dest->size = __src->size;					\
+		__dest->capacity = __src->size;					\
+		__dest->array = ARENA_XMALLOC((arena), __src->size,		\
+					      typeof(*__src->array));		\
+		memcpy(__dest->array, __src->array,				\
+		       __src->size * sizeof(*__src->array));			\
+	} while (0)
+
+/* steals src's storage; src is left as a valid empty list which owns nothing */
+#define ARRAY_LIST_MOVE(dest, src) do {					\
+		STATIC_ASSERT(SAME_TYPE(*(dest)->array, *(src)->array));	\
+		typeof(dest) __dest = (dest);					\
+		typeof(src)  __src  = (src);					\
+		__dest->size     = __src->size;					\
+		__dest->capacity = __src->capacity;				\
+		__dest->array    = __src->array;				\
+		__src->size      = 0;						\
+		__src->capacity  = 0;						\
+		__src->array     = NULL;					\
+	} while (0)
+
 #define ARRAY_LIST_FOREACH(a, i, p) \
 	/* cannot avoid side effects here :( */ \
 	for(i = 0, p = &(a)->array[i]; i < (a)->size; i++, p = &(a)->array[i])
@@ -0,0 +1,64 @@
+/**
+ * @file bitset.h
+ * @brief fixed-length bitsets packed into 64-bit words
+ * @author Ben Blum
+ */
+
+#ifndef __LS_BITSET_H
+#define __LS_BITSET_H
+
+#include <simics/api.h> /* for bool, uint64_t */
+#include <string.h> /* for memset */
+
+#include "common.h"
+
+/* A bitset of length n is an array of BITSET_WORDS(n) words, with bit i stored
+ * in word i/64 at position i%64. Bits past n in the last word are always 0, so
+ * whole-word operations never need to mask them off. */
+#define BITSET_WORD_BITS 64
+#define BITSET_WORDS(n) (((n) + BITSET_WORD_BITS - 1) / BITSET_WORD_BITS)
+
+#define BITSET_XMALLOC(n) ({						\
+		unsigned int __words = BITSET_WORDS(n);			\
+		uint64_t *__b = MM_XMALLOC(__words, uint64_t);		\
+		memset(__b, 0, __words * sizeof(uint64_t));		\
+		__b; })
+
+static inline bool bitset_get(const uint64_t *b, unsigned int i)
+{
+	return (b[i / BITSET_WORD_BITS] >> (i % BITSET_WORD_BITS)) & 1;
+}
+
+static inline void bitset_set(uint64_t *b, unsigned int i, bool value)
+{
+	uint64_t mask = (uint64_t)1 << (i % BITSET_WORD_BITS);
+	if (value) {
+		b[i / BITSET_WORD_BITS] |= mask;
+	} else {
+		b[i / BITSET_WORD_BITS] &= ~mask;
+	}
+}
+
+static inline void bitset_clear_all(uint64_t *b, unsigned int n)
+{
+	memset(b, 0, BITSET_WORDS(n) * sizeof(uint64_t));
+}
+
+/* dest |= src, where src is of length n (not longer than dest). */
+static inline void bitset_or(uint64_t *dest, const uint64_t *src, unsigned int n)
+{
+	for (unsigned int w = 0; w < BITSET_WORDS(n); w++) {
+		dest[w] |= src[w];
+	}
+}
+
+/* Iterates i over the indices of bits set in (a & ~b), both of length n, in
+ * increasing order. NB: "break" only skips to the next word. */
+#define BITSET_FOREACH_ANDNOT(a, b, n, i)					\
+	for (unsigned int __w = 0; __w < BITSET_WORDS(n); __w++)		\
+		for (uint64_t __bits = (a)[__w] & ~(b)[__w];			\
+		     __bits != 0 &&						\
+		     ((i) = __w * BITSET_WORD_BITS + __builtin_ctzll(__bits), true); \
+		     __bits &= __bits - 1)
+
+#endif
@@ -0,0 +1,617 @@
+/**
+ * @file elf_index.c
+ * @brief native symbol index, parsed from ELF images, to avoid asking simics
+ * @author Ben Blum
+ *
+ * Simics's symtable answers every query through a chain of attribute lookups,
+ * which is far too slow for the stack tracer, which needs function bounds for
+ * every frame. Instead, parse the ELF symbol table (and DWARF line table, if
+ * present) of each image once, into sorted arrays we can binary search. Names
+ * point directly into the (read-only, mmapped) image, which is never unmapped.
+ * Each image gets its own index, since user programs share addresses.
+ */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MODULE_NAME "ELF"
+#define MODULE_COLOUR COLOUR_DARK COLOUR_BLUE
+
+#include "array_list.h"
+#include "common.h"
+#include "elf_index.h"
+
+struct elf_symbol {
+	unsigned int start;
+	unsigned int end; /* exclusive */
+	bool sized;
+	const char *name;
+};
+
+struct elf_line {
+	unsigned int addr;
+	unsigned int order; /* to break ties between rows at the same addr */
+	const char *file;   /* NULL marks the end of a sequence */
+	int line;
+};
+
+typedef ARRAY_LIST(struct elf_symbol) symbol_list_t;
+
+struct elf_index {
+	symbol_list_t functions;
+	symbol_list_t data;
+	ARRAY_LIST(struct elf_line) lines;
+};
+
+/******************************************************************************
+ * DWARF line table
+ ******************************************************************************/
+
+/* line number program opcodes we care about (DWARF 2-4) */
+#define DW_LNS_copy			1
+#define DW_LNS_advance_pc		2
+#define DW_LNS_advance_line		3
+#define DW_LNS_set_file			4
+#define DW_LNS_const_add_pc		8
+#define DW_LNS_fixed_advance_pc		9
+#define DW_LNE_end_sequence		1
+#define DW_LNE_set_address		2
+#define DW_LNE_define_file		3
+
+/* bounds-checked reader; sets error and returns 0 instead of overrunning */
+struct cursor {
+	const uint8_t *p;
+	const uint8_t *end;
+	bool error;
+};
+
+static uint8_t read_u8(struct cursor *c)
+{
+	if (c->p + 1 > c->end) {
+		c->error = true;
+		return 0;
+	}
+	return *c->p++;
+}
+
+static uint16_t read_u16(struct cursor *c)
+{
+	uint16_t lo = read_u8(c);
+	return lo | (uint16_t)read_u8(c) << 8;
+}
+
+static uint32_t read_u32(struct cursor *c)
+{
+	uint32_t lo = read_u16(c);
+	return lo | (uint32_t)read_u16(c) << 16;
+}
+
+static uint32_t read_uleb(struct cursor *c)
+{
+	uint32_t result = 0;
+	unsigned int shift = 0;
+	uint8_t byte;
+	do {
+		byte = read_u8(c);
+		if (shift < 32) {
+			result |= (uint32_t)(byte & 0x7f) << shift;
+		}
+		shift += 7;
+	} while ((byte & 0x80) != 0 && !c->error);
+	return result;
+}
+
+static int32_t read_sleb(struct cursor *c)
+{
+	int32_t result = 0;
+	unsigned int shift = 0;
+	uint8_t byte;
+	do {
+		byte = read_u8(c);
+		if (shift < 32) {
+			result |= (int32_t)(byte & 0x7f) << shift;
+		}
+		shift += 7;
+	} while ((byte & 0x80) != 0 && !c->error);
+	if (shift < 32 && (byte & 0x40) != 0) {
+		result |= -(1 << shift);
+	}
+	return result;
+}
+
+static const char *read_string(struct cursor *c)
+{
+	const char *s = (const char *)c->p;
+	const uint8_t *nul = memchr(c->p, '\0', c->end - c->p);
+	if (nul == NULL) {
+		c->error = true;
+		return NULL;
+	}
+	c->p = nul + 1;
+	return s;
+}
+
+static void add_line(struct elf_index *index, unsigned int addr,
+		     const char *file, int line)
+{
+	struct elf_line row;
+	row.addr = addr;
+	row.order = ARRAY_LIST_SIZE(&index->lines);
+	row.file = file;
+	row.line = line;
+	ARRAY_LIST_APPEND(&index->lines, row);
+}
+
+/* Parses one line number program; returns false if it was malformed. */
+static bool parse_line_unit(struct elf_index *index, struct cursor *c)
+{
+	uint32_t unit_length = read_u32(c);
+	if (unit_length == 0xffffffff || c->error ||
+	    unit_length > (uint32_t)(c->end - c->p)) {
+		/* 64-bit DWARF, or garbage */
+		return false;
+	}
+	struct cursor unit = { .p = c->p, .end = c->p + unit_length };
+	c->p = unit.end;
+
+	uint16_t version = read_u16(&unit);
+	if (version < 2 || version > 4) {
+		/* DWARF 5 has a different header format; let simics have it */
+		return !unit.error;
+	}
+	uint32_t header_length = read_u32(&unit);
+	if (unit.error || header_length > (uint32_t)(unit.end - unit.p)) {
+		return false;
+	}
+	const uint8_t *program = unit.p + header_length;
+
+	unsigned int min_inst_length = read_u8(&unit);
+	if (version >= 4) {
+		read_u8(&unit); /* maximum_operations_per_instruction */
+	}
+	read_u8(&unit); /* default_is_stmt */
+	int line_base = (int8_t)read_u8(&unit);
+	unsigned int line_range = read_u8(&unit);
+	unsigned int opcode_base = read_u8(&unit);
+	const uint8_t *std_opcode_lengths = unit.p;
+	unit.p += opcode_base - 1;
+	if (unit.error || line_range == 0 || opcode_base == 0 ||
+	    unit.p > unit.end) {
+		return false;
+	}
+
+	ARRAY_LIST(const char *) dirs;
+	ARRAY_LIST(const char *) files;
+	ARRAY_LIST_INIT(&dirs, 16);
+	ARRAY_LIST_INIT(&files, 16);
+
+	while (unit.p < unit.end && *unit.p != '\0' && !unit.error) {
+		const char *dir = read_string(&unit);
+		if (dir != NULL) {
+			ARRAY_LIST_APPEND(&dirs, dir);
+		}
+	}
+	read_u8(&unit);
+
+	/* file entries are shared between the header and DW_LNE_define_file */
+	const char *read_file_entry(struct cursor *c)
+	{
+		const char *name = read_string(c);
+		unsigned int dir = read_uleb(c);
+		read_uleb(c); /* mtime */
+		read_uleb(c); /* length */
+		if (c->error) {
+			return NULL;
+		} else if (dir == 0 || dir > ARRAY_LIST_SIZE(&dirs) ||
+			   name[0] == '/') {
+			return name;
+		}
+		/* leaked on purpose; rows point to these forever */
+		const char *dirname = *ARRAY_LIST_GET(&dirs, dir - 1);
+		assert(dirname != NULL && "unterminated include directory");
+		unsigned int len = strlen(dirname) + 1 + strlen(name) + 1;
+		char *path = MM_XMALLOC(len, char);
+		scnprintf(path, len, "%s/%s", dirname, name);
+		return path;
+	}
+
+	while (unit.p < unit.end && *unit.p != '\0' && !unit.error) {
+		const char *file = read_file_entry(&unit);
+		ARRAY_LIST_APPEND(&files, file);
+	}
+
+	/* state machine registers; we ignore columns, stmts, blocks, etc. */
+	unsigned int addr = 0;
+	unsigned int file = 1;
+	int line = 1;
+
+	const char *file_name(unsigned int index)
+	{
+		if (index == 0 || index > ARRAY_LIST_SIZE(&files) ||
+		    *ARRAY_LIST_GET(&files, index - 1) == NULL) {
+			return "<unknown>";
+		}
+		return *ARRAY_LIST_GET(&files, index - 1);
+	}
+
+	unit.p = program;
+	while (unit.p < unit.end && !unit.error) {
+		unsigned int opcode = read_u8(&unit);
+
+		if (opcode >= opcode_base) {
+			/* special opcode */
+			unsigned int adjusted = opcode - opcode_base;
+			addr += (adjusted / line_range) * min_inst_length;
+			line += line_base + (int)(adjusted % line_range);
+			add_line(index, addr, file_name(file), line);
+		} else if (opcode == 0) {
+			/* extended opcode */
+			unsigned int len = read_uleb(&unit);
+			if (unit.error || len > (unsigned int)(unit.end - unit.p)) {
+				break;
+			}
+			const uint8_t *next = unit.p + len;
+			switch (read_u8(&unit)) {
+			case DW_LNE_end_sequence:
+				add_line(index, addr, NULL, 0);
+				addr = 0;
+				file = 1;
+				line = 1;
+				break;
+			case DW_LNE_set_address:
+				addr = read_u32(&unit);
+				break;
+			case DW_LNE_define_file:
+				ARRAY_LIST_APPEND(&files, read_file_entry(&unit));
+				break;
+			default:
+				break;
+			}
+			unit.p = next;
+		} else {
+			switch (opcode) {
+			case DW_LNS_copy:
+				add_line(index, addr, file_name(file), line);
+				break;
+			case DW_LNS_advance_pc:
+				addr += read_uleb(&unit) * min_inst_length;
+				break;
+			case DW_LNS_advance_line:
+				line += read_sleb(&unit);
+				break;
+			case DW_LNS_set_file:
+				file = read_uleb(&unit);
+				break;
+			case DW_LNS_const_add_pc:
+				addr += ((255 - opcode_base) / line_range) *
+					min_inst_length;
+				break;
+			case DW_LNS_fixed_advance_pc:
+				addr += read_u16(&unit);
+				break;
+			default:
+				/* skip operands of anything else (set_column,
+				 * set_isa, or unknown standard opcodes) */
+				for (unsigned int i = 0;
+				     i < std_opcode_lengths[opcode - 1]; i++) {
+					read_uleb(&unit);
+				}
+				break;
+			}
+		}
+	}
+
+	ARRAY_LIST_FREE(&dirs);
+	ARRAY_LIST_FREE(&files);
+	return !unit.error;
+}
+
+/******************************************************************************
+ * ELF symbol table
+ ******************************************************************************/
+
+static const Elf32_Shdr *get_section(const uint8_t *image, size_t size,
+				     const Elf32_Ehdr *ehdr, unsigned int i)
+{
+	if (i >= ehdr->e_shnum) {
+		return NULL;
+	}
+	size_t offset = ehdr->e_shoff + (size_t)i * sizeof(Elf32_Shdr);
+	if (offset + sizeof(Elf32_Shdr) > size) {
+		return NULL;
+	}
+	const Elf32_Shdr *shdr = (const Elf32_Shdr *)(image + offset);
+	if (shdr->sh_type != SHT_NOBITS &&
+	    (shdr->sh_offset > size || shdr->sh_size > size - shdr->sh_offset)) {
+		return NULL;
+	}
+	return shdr;
+}
+
+static const char *get_string(const uint8_t *image, const Elf32_Shdr *strtab,
+			      unsigned int index)
+{
+	if (strtab == NULL || index >= strtab->sh_size) {
+		return NULL;
+	}
+	const char *s = (const char *)image + strtab->sh_offset + index;
+	if (memchr(s, '\0', strtab->sh_size - index) == NULL) {
+		return NULL;
+	}
+	return s;
+}
+
+static void parse_symbols(struct elf_index *index,
+			  const uint8_t *image, size_t size,
+			  const Elf32_Ehdr *ehdr, const Elf32_Shdr *symtab)
+{
+	const Elf32_Shdr *strtab = get_section(image, size, ehdr, symtab->sh_link);
+	const Elf32_Sym *syms = (const Elf32_Sym *)(image + symtab->sh_offset);
+	unsigned int num_syms = symtab->sh_size / sizeof(Elf32_Sym);
+
+	for (unsigned int i = 0; i < num_syms; i++) {
+		const Elf32_Sym *sym = &syms[i];
+		unsigned int type = ELF32_ST_TYPE(sym->st_info);
+		unsigned int bind = ELF32_ST_BIND(sym->st_info);
+		const char *name = get_string(image, strtab, sym->st_name);
+		const Elf32_Shdr *section =
+			get_section(image, size, ehdr, sym->st_shndx);
+
+		if (name == NULL || name[0] == '\0' || section == NULL ||
+		    sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE) {
+			continue;
+		}
+
+		struct elf_symbol entry;
+		entry.start = sym->st_value;
+		entry.name = name;
+		if ((section->sh_flags & SHF_EXECINSTR) != 0 &&
+		    (type == STT_FUNC ||
+		     (type == STT_NOTYPE && bind != STB_LOCAL))) {
+			/* Hand-written assembly often doesn't size its
+			 * symbols; such ones extend until the next symbol,
+			 * or at most until the end of their section. */
+			entry.sized = sym->st_size != 0;
+			entry.end = entry.sized ? sym->st_value + sym->st_size :
+				section->sh_addr + section->sh_size;
+			ARRAY_LIST_APPEND(&index->functions, entry);
+		} else if (type == STT_OBJECT && sym->st_size != 0) {
+			entry.sized = true;
+			entry.end = sym->st_value + sym->st_size;
+			ARRAY_LIST_APPEND(&index->data, entry);
+		}
+	}
+}
+
+static bool parse_elf(struct elf_index *index, const uint8_t *image,
+		      size_t size)
+{
+	const Elf32_Ehdr *ehdr = (const Elf32_Ehdr *)image;
+
+	if (size < sizeof(Elf32_Ehdr) ||
+	    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+	    ehdr->e_machine != EM_386 ||
+	    ehdr->e_shentsize != sizeof(Elf32_Shdr)) {
+		return false;
+	}
+
+	const Elf32_Shdr *shstrtab =
+		get_section(image, size, ehdr, ehdr->e_shstrndx);
+	bool found_symtab = false;
+
+	for (unsigned int i = 0; i < ehdr->e_shnum; i++) {
+		const Elf32_Shdr *section = get_section(image, size, ehdr, i);
+		if (section == NULL) {
+			continue;
+		}
+		const char *name = get_string(image, shstrtab, section->sh_name);
+
+		if (section->sh_type == SHT_SYMTAB) {
+			parse_symbols(index, image, size, ehdr, section);
+			found_symtab = true;
+		} else if (name != NULL && strcmp(name, ".debug_line") == 0) {
+			struct cursor c = {
+				.p = image + section->sh_offset,
+				.end = image + section->sh_offset + section->sh_size,
+			};
+			while (c.p < c.end && parse_line_unit(index, &c))
+				continue;
+		}
+	}
+	return found_symtab;
+}
+
+/******************************************************************************
+ * sorting and searching
+ ******************************************************************************/
+
+static int compare_symbols(const void *a, const void *b)
+{
+	const struct elf_symbol *sym_a = a;
+	const struct elf_symbol *sym_b = b;
+	if (sym_a->start != sym_b->start) {
+		return sym_a->start < sym_b->start ? -1 : 1;
+	}
+	/* prefer properly sized symbols when several share an address */
+	return (int)sym_b->sized - (int)sym_a->sized;
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+	const struct elf_line *line_a = a;
+	const struct elf_line *line_b = b;
+	if (line_a->addr != line_b->addr) {
+		return line_a->addr < line_b->addr ? -1 : 1;
+	}
+	return line_a->order < line_b->order ? -1 : 1;
+}
+
+/* Sorts by address and drops symbols that alias one before them. Unsized
+ * symbols get truncated at the next symbol. */
+static void sort_symbols(symbol_list_t *list)
+{
+	unsigned int i;
+	unsigned int kept = 0;
+	struct elf_symbol *sym;
+
+	qsort(list->array, list->size, sizeof(struct elf_symbol), compare_symbols);
+	ARRAY_LIST_FOREACH(list, i, sym) {
+		if (kept > 0 && list->array[kept - 1].start == sym->start) {
+			continue;
+		}
+		list->array[kept++] = *sym;
+	}
+	list->size = kept;
+
+	for (i = 0; i + 1 < list->size; i++) {
+		sym = &list->array[i];
+		if (!sym->sized && sym->end > list->array[i + 1].start) {
+			sym->end = list->array[i + 1].start;
+		}
+	}
+}
+
+/* Returns the last entry whose start is <= addr, if addr is within it. */
+static struct elf_symbol *find_symbol(symbol_list_t *list,
+				      unsigned int addr)
+{
+	unsigned int lo = 0;
+	unsigned int hi = list->size;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (list->array[mid].start <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0 || addr >= list->array[lo - 1].end) {
+		return NULL;
+	}
+	return &list->array[lo - 1];
+}
+
+/******************************************************************************
+ * interface
+ ******************************************************************************/
+
+/* Indexes an image's symbols, or returns NULL if it can't. The image stays
+ * mapped forever. */
+struct elf_index *elf_index_load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		lsprintf(DEV, "can't open %s; symbols will come from simics\n",
+			 path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	const uint8_t *image =
+		mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) {
+		lsprintf(DEV, "can't mmap %s; symbols will come from simics\n",
+			 path);
+		return NULL;
+	}
+
+	struct elf_index *index = MM_XMALLOC(1, struct elf_index);
+	ARRAY_LIST_INIT(&index->functions, 1024);
+	ARRAY_LIST_INIT(&index->data, 1024);
+	ARRAY_LIST_INIT(&index->lines, 4096);
+
+	if (!parse_elf(index, image, st.st_size)) {
+		lsprintf(DEV, "%s isn't a 32-bit x86 ELF with a symtab; "
+			 "symbols will come from simics\n", path);
+		ARRAY_LIST_FREE(&index->functions);
+		ARRAY_LIST_FREE(&index->data);
+		ARRAY_LIST_FREE(&index->lines);
+		MM_FREE(index);
+		munmap((void *)image, st.st_size);
+		return NULL;
+	}
+
+	sort_symbols(&index->functions);
+	sort_symbols(&index->data);
+	qsort(index->lines.array, index->lines.size, sizeof(struct elf_line),
+	      compare_lines);
+
+	lsprintf(DEV, "indexed %s: %u functions, %u data symbols, %u lines\n",
+		 path, ARRAY_LIST_SIZE(&index->functions),
+		 ARRAY_LIST_SIZE(&index->data),
+		 ARRAY_LIST_SIZE(&index->lines));
+	return index;
+}
+
+bool elf_index_function(struct elf_index *index, unsigned int eip,
+			const char **name, unsigned int *start)
+{
+	if (index == NULL) {
+		return false;
+	}
+	struct elf_symbol *sym = find_symbol(&index->functions, eip);
+	if (sym == NULL) {
+		return false;
+	}
+	*name = sym->name;
+	*start = sym->start;
+	return true;
+}
+
+bool elf_index_line(struct elf_index *index, unsigned int eip,
+		    const char **file, int *line)
+{
+	if (index == NULL || ARRAY_LIST_SIZE(&index->lines) == 0) {
+		return false;
+	}
+
+	unsigned int lo = 0;
+	unsigned int hi = ARRAY_LIST_SIZE(&index->lines);
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (ARRAY_LIST_GET(&index->lines, mid)->addr <= eip) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo == 0) {
+		return false;
+	}
+	struct elf_line *row = ARRAY_LIST_GET(&index->lines, lo - 1);
+	if (row->file == NULL) {
+		/* past the end of a sequence */
+		return false;
+	}
+	*file = row->file;
+	*line = row->line;
+	return true;
+}
+
+bool elf_index_data(struct elf_index *index, unsigned int addr,
+		    const char **name, unsigned int *offset)
+{
+	if (index == NULL) {
+		return false;
+	}
+	struct elf_symbol *sym = find_symbol(&index->data, addr);
+	if (sym == NULL) {
+		return false;
+	}
+	*name = sym->name;
+	*offset = addr - sym->start;
+	return true;
+}
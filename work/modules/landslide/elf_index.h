@@ -0,0 +1,23 @@
+/**
+ * @file elf_index.h
+ * @brief native symbol index, parsed from ELF images, to avoid asking simics
+ * @author Ben Blum
+ */
+
+#ifndef __LS_ELF_INDEX_H
+#define __LS_ELF_INDEX_H
+
+#include <stdbool.h>
+
+struct elf_index;
+
+/* Lookups in a NULL index (one that failed to load) always fail. */
+struct elf_index *elf_index_load(const char *path);
+bool elf_index_function(struct elf_index *index, unsigned int eip,
+			const char **name, unsigned int *start);
+bool elf_index_line(struct elf_index *index, unsigned int eip,
+		    const char **file, int *line);
+bool elf_index_data(struct elf_index *index, unsigned int addr,
+		    const char **name, unsigned int *offset);
+
+#endif
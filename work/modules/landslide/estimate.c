@@ -50,19 +50,12 @@ static void fudge_time(struct timeval *tv, uint64_t time_asleep)
 
 static bool is_child_marked(struct hax *h, struct agent *a)
 {
-	struct hax *child;
-
 	/* A marked child is one that we have already explored, or one we wish
 	 * to explore. In short, one we know will be in the tree eventually. */
 	if (a->do_explore) {
 		return true;
 	}
-	Q_FOREACH(child, &h->children, sibling) {
-		if (child->chosen_thread == a->tid) {
-			return true;
-		}
-	}
-	return false;
+	return has_explored_child(h, a->tid, false);
 }
 
 /* returns old value */
@@ -190,7 +183,7 @@ static void _estimate(struct hax *root, struct hax *current)
 		/* Bonus Step -- Estimate subtree exploration time. */
 
 		bool child_was_new_subtree = false; /* only true once */
-		unsigned int num_explored_children = Q_GET_SIZE(&h->children);
+		unsigned int num_explored_children = num_children(h);
 		if (new_subtree && num_explored_children > 1) {
 			new_subtree = false;
 			child_was_new_subtree = true;
@@ -326,7 +319,7 @@ void untag_blocked_branch(struct hax *ancestor, struct hax *leaf, struct agent *
 			/* subtree delta gets factored into the parent's average.
 			 * unlike proportion, subtree delta changes at each level. */
 			subtree_delta *= h->marked_children;
-			subtree_delta /= Q_GET_SIZE(&h->children);
+			subtree_delta /= num_children(h);
 			h->subtree_usecs += subtree_delta;
 		}
 	}
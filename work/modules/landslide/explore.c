@@ -7,6 +7,7 @@
 #define MODULE_NAME "EXPLORE"
 #define MODULE_COLOUR COLOUR_BLUE
 
+#include "bitset.h"
 #include "common.h"
 #include "estimate.h"
 #include "landslide.h"
@@ -17,13 +18,7 @@
 #include "variable_queue.h"
 
 static bool is_child_searched(struct hax *h, unsigned int child_tid) {
-	struct hax *child;
-
-	Q_FOREACH(child, &h->children, sibling) {
-		if (child->chosen_thread == child_tid && child->all_explored)
-			return true;
-	}
-	return false;
+	return has_explored_child(h, child_tid, true);
 }
 
 static void branch_sanity(struct hax *root, struct hax *current)
@@ -49,11 +44,6 @@ static void branch_sanity(struct hax *root, struct hax *current)
 	}
 }
 
-static bool is_evil_ancestor(struct hax *h0, struct hax *h)
-{
-	return !h0->happens_before[h->depth] && h0->conflicts[h->depth];
-}
-
 /* Finds the nearest parent save point that's actually a preemption point.
  * This is how we skip over speculative data race save points when identifying
  * which "good sibling" transitions to tag (when to preempt to get to them?) */
@@ -167,7 +157,6 @@ static bool tag_sibling(struct hax *h0, struct hax *ancestor,
 	return need_bpor;
 }
 
-#ifdef ICB
 static bool stop_bpor_backtracking(struct hax *h0, struct hax *ancestor2)
 {
 	/* Don't BPOR-tag past the previous transition of same thread... */
@@ -227,7 +216,6 @@ static void tag_reachable_aunts(struct hax *h0, struct hax *ancestor,
 		tag_all_siblings(h0, ancestor2, icb_bound, NULL);
 	}
 }
-#endif
 
 static bool any_tagged_child(struct hax *h, unsigned int *new_tid, bool *txn,
 			     unsigned int *xabort_code)
@@ -281,6 +269,10 @@ struct hax *explore(struct ls_state *ls, unsigned int *new_tid, bool *txn,
 	struct save_state *ss = &ls->save;
 	struct hax *current = ss->current;
 
+	/* need the last transition's conflicts, and any PPs its data races
+	 * might have enabled, before looking at the branch */
+	save_finish_analysis(ss, ls);
+
 	current->all_explored = true;
 	branch_sanity(ss->root, ss->current);
 
@@ -289,14 +281,26 @@ struct hax *explore(struct ls_state *ls, unsigned int *new_tid, bool *txn,
 	 * against descendants in advance. */
 	update_user_yield_blocked_transitions(current);
 
+	/* Index the branch by depth, so the "evil" ancestors of each transition
+	 * can be looked up directly from its conflicts bitset. */
+	struct hax **branch = MM_XMALLOC(current->depth + 1, struct hax *);
+	for (struct hax *h = current; h != NULL; h = h->parent) {
+		branch[h->depth] = h;
+	}
+
 	/* Compare each transition along this branch against each of its
 	 * ancestors. */
 	for (struct hax *h = current; h != NULL; h = h->parent) {
 		/* In outer loop, we include user threads blocked in a yield
 		 * loop as the "descendant" for comparison, because we want
 		 * to reorder them before conflicting ancestors if needed... */
-		for (struct hax *ancestor = h->parent; ancestor != NULL;
-		     ancestor = ancestor->parent) {
+		unsigned int depth;
+		/* An ancestor is "evil" if it conflicts with h and could have
+		 * been reordered with it (i.e., doesn't happen-before it). */
+		BITSET_FOREACH_ANDNOT(h->conflicts, h->happens_before,
+				      h->depth, depth) {
+			struct hax *ancestor = branch[depth];
+			assert(ancestor->depth == depth);
 			// FIXME: see fixme in pp_parent
 			if (ancestor->parent == NULL) {
 				continue;
@@ -312,21 +316,16 @@ struct hax *explore(struct ls_state *ls, unsigned int *new_tid, bool *txn,
 						 ancestor->chosen_thread);
 				}
 				continue;
-			} else if (!is_evil_ancestor(h, ancestor)) {
-				continue;
 			}
 
 			/* The ancestor is "evil". Find which siblings need to
 			 * be explored. */
 			bool need_bpor = tag_sibling(h, ancestor, ls->icb_bound);
-#ifdef ICB
 			if (need_bpor) {
+				assert(ls->icb && "BPOR needed without ICB bound");
 				tag_reachable_aunts(h, ancestor, ls->icb_bound);
 				ls->icb_need_increment_bound = true;
 			}
-#else
-			assert(!need_bpor);
-#endif
 
 			/* In theory, stopping after the first baddie
 			 * is fine; the others would be handled "by
@@ -338,6 +337,8 @@ struct hax *explore(struct ls_state *ls, unsigned int *new_tid, bool *txn,
 		}
 	}
 
+	MM_FREE(branch);
+
 	/* We will choose a tagged sibling that's deepest, to maintain a
 	 * depth-first ordering. This allows us to avoid having tagged siblings
 	 * outside of the current branch of the tree. A trail of "all_explored"
@@ -367,3 +368,27 @@ struct hax *explore(struct ls_state *ls, unsigned int *new_tid, bool *txn,
 	lsprintf(ALWAYS, "found no tagged siblings on current branch!\n");
 	return NULL;
 }
+
+/* Will the given save point ever need to be longjmped to again, once we go
+ * there to explore new_tid? Tags only ever get set on runnable threads whose
+ * subtrees are not yet searched, so if every other runnable thread's subtree
+ * already is, nothing can ask to come back. (The root gets revisited when ICB
+ * resets the tree, and transactions can get failure injections queued later,
+ * so those are never the last visit.) If so, save.c may move the saved state
+ * out instead of copying it. */
+bool is_last_visit(struct hax *h, unsigned int new_tid)
+{
+	struct agent *a;
+
+	if (h->parent == NULL || h->xbegin) {
+		return false;
+	}
+
+	FOR_EACH_RUNNABLE_AGENT(a, h->oldsched,
+		if (a->tid != new_tid && !is_child_searched(h, a->tid)) {
+			return false;
+		}
+	);
+
+	return true;
+}
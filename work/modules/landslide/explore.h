@@ -12,5 +12,6 @@ struct hax;
 struct ls_state;
 
 struct hax *explore(struct ls_state *ls, unsigned int *new_tid, bool *txn, unsigned int *xabort_code);
+bool is_last_visit(struct hax *h, unsigned int new_tid);
 
 #endif
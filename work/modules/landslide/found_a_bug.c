@@ -5,6 +5,8 @@
  */
 
 #include <fcntl.h> /* for open */
+#include <string.h>
+#include <unistd.h> /* for unlink */
 
 #include <simics/api.h>
 
@@ -14,6 +16,7 @@
 #define INFO_NAME "INFO"
 #define INFO_COLOUR COLOUR_DARK COLOUR_GREEN
 
+#include "arbiter.h"
 #include "common.h"
 #include "explore.h"
 #include "found_a_bug.h"
@@ -22,6 +25,7 @@
 #include "landslide.h"
 #include "messaging.h"
 #include "schedule.h"
+#include "snapshot.h"
 #include "stack.h"
 #include "tree.h"
 
@@ -136,20 +140,19 @@ static void html_print_stack_trace_in_table(struct fab_html_env *env,
  * with tabs for alignment, rather than on one line with comma separators. */
 void print_stack_to_console(struct stack_trace *st, bool bug_found, const char *prefix)
 {
-	struct stack_frame *f;
-	bool first_frame = true;
+	unsigned int i;
+	unsigned int *eipp;
 
 	/* print TID prefix before first frame */
 	lsprintf(BUG, bug_found, "%sTID%d at ", prefix, st->tid);
 
 	/* print each frame */
-	Q_FOREACH(f, &st->frames, nobe) {
-		if (!first_frame) {
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		if (i > 0) {
 			printf(BUG, "\n");
 			lsprintf(BUG, bug_found, "%s\t", prefix);
 		}
-		first_frame = false;
-		print_stack_frame(BUG, f);
+		print_stack_eip(BUG, st, *eipp);
 	}
 
 	printf(BUG, "\n");
@@ -203,6 +206,66 @@ static unsigned int print_tree_from(struct hax *h, unsigned int choose_thread,
 	return num;
 }
 
+/* Records, root first, the choice made at each preemption point on the way to
+ * h, so quicksand can replay them to reproduce the bug (see arbiter.h). */
+static void write_choices_from(struct snapshot *s, const struct hax *h,
+			       int choose_thread, bool txn,
+			       unsigned int xabort_code)
+{
+	if (h == NULL) {
+		assert(choose_thread == -1);
+		return;
+	}
+
+	write_choices_from(s, h->parent, h->chosen_thread, h->chosen_txn,
+			   h->chosen_xabort_code);
+
+	if (choose_thread != -1) {
+		struct replay_choice c;
+		memset(&c, 0, sizeof(c)); /* no garbage in the padding */
+		c.trigger_count = h->trigger_count;
+		c.tid           = choose_thread;
+		c.txn           = txn;
+		c.xabort_code   = txn ? xabort_code : 0;
+		SNAPSHOT_WRITE(s, c);
+	}
+}
+
+static void write_choice_trace(struct ls_state *ls)
+{
+	struct save_state *ss = &ls->save;
+	unsigned int length =
+		strlen(ls->html_file) + strlen(CHOICE_TRACE_SUFFIX) + 1;
+	char *filename = MM_XMALLOC(length, char);
+	scnprintf(filename, length, "%s%s", ls->html_file, CHOICE_TRACE_SUFFIX);
+
+	struct snapshot s;
+	if ((s.file = fopen(filename, "w")) == NULL) {
+		lsprintf(DEV, true, "warning: can't write choice trace %s\n",
+			 filename);
+		MM_FREE(filename);
+		return;
+	}
+	s.ok = true;
+
+	/* Every nobe but the root was chosen to get to; only the last might
+	 * not have chosen anything to come after it. */
+	uint32_t magic = CHOICE_TRACE_MAGIC;
+	uint32_t num_choices = ss->current == NULL ? 0 :
+		ss->current->depth + (ss->next_tid == -1 ? 0 : 1);
+	SNAPSHOT_WRITE(&s, magic);
+	SNAPSHOT_WRITE(&s, num_choices);
+	write_choices_from(&s, ss->current, ss->next_tid, ss->next_txn,
+			   ss->next_xabort_code);
+
+	if (fclose(s.file) != 0 || !s.ok) {
+		lsprintf(DEV, true, "warning: failed write choice trace %s\n",
+			 filename);
+		unlink(filename);
+	}
+	MM_FREE(filename);
+}
+
 /* ensure that a state space estimate has been computed, if it has not already,
  * and adjust for whether we aborted this branch early because we found a bug. */
 // XXX: There's not really any one good place to put this function.
@@ -290,6 +353,8 @@ void _found_a_bug(struct ls_state *ls, bool bug_found, bool verbose,
 		  const char *reason, unsigned int reason_len, fab_cb_t callback)
 {
 	bool needed_compute_estimate; /* XXX hack */
+	/* data races found in the last transition could yet enable PPs */
+	save_finish_analysis(&ls->save, ls);
 	long double proportion = compute_state_space_size(ls, &needed_compute_estimate);
 
 	/* Should we emit a "tabular" preemption trace using html, or
@@ -417,8 +482,10 @@ void _found_a_bug(struct ls_state *ls, bool bug_found, bool verbose,
 			 "Tabular preemption trace output to %s\n." COLOUR_DEFAULT,
 			 ls->html_file);
 		if (bug_found) {
+			write_choice_trace(ls);
 			message_found_a_bug(&ls->mess, ls->html_file, trace_length,
-					    ls->sched.icb_preemption_count);
+					    ls->sched.icb_preemption_count,
+					    arbiter_replay_completed(&ls->arbiter));
 		}
 	}
 	MM_FREE(stack);
@@ -16,6 +16,7 @@
 
 #include "landslide.h"
 #include "stack.h"
+#include "x86.h"
 
 struct ls_state;
 
@@ -31,6 +32,22 @@ struct ls_state;
 		  "average branch depth %lu\n",				\
 		  ls->save.total_triggers / (1+ls->save.total_choices),	\
 		  ls->save.depth_total / (1+ls->save.total_jumps));	\
+	_lsprintf(v, mn, mc, "Restores by move %" PRIu64 ", "		\
+		  "restores by copy %" PRIu64 "\n",			\
+		  ls->save.total_restore_moves,				\
+		  ls->save.total_restore_copies);			\
+	_lsprintf(v, mn, mc, "Shm intersections skipped %" PRIu64 ", "	\
+		  "performed %" PRIu64 "\n",				\
+		  ls->save.total_intersects_skipped,			\
+		  ls->save.total_intersects_performed);			\
+	_lsprintf(v, mn, mc, "Explored tree uses %" PRIu64 " bytes, "	\
+		  "compacted %" PRIu64 " times\n",			\
+		  ls->save.tree_bytes, ls->save.total_compactions);	\
+	uint64_t __tlb_hits, __tlb_misses, __tlb_flushes;		\
+	mem_translate_stats(&__tlb_hits, &__tlb_misses, &__tlb_flushes); \
+	_lsprintf(v, mn, mc, "Translation cache hits %" PRIu64 ", "	\
+		  "misses %" PRIu64 ", flushes %" PRIu64 "\n",		\
+		  __tlb_hits, __tlb_misses, __tlb_flushes);		\
 	} while (0)
 
 #define PRINT_TREE_INFO(v, ls) \
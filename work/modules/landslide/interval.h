@@ -0,0 +1,42 @@
+/**
+ * @file interval.h
+ * @brief lookups in sorted tables of address ranges
+ * @author Ben Blum
+ */
+
+#ifndef __LS_INTERVAL_H
+#define __LS_INTERVAL_H
+
+#include <simics/api.h> /* for bool */
+
+#include "compiler.h"
+
+/* An interval table is a 2D array of unsigned ints, one row per range, whose
+ * first two columns are the start and (inclusive) end of the range. Rows must
+ * be sorted by start and must not overlap; definegen.sh emits the tables from
+ * the config in this form. Further columns, if any, are ignored here. */
+#define IN_INTERVAL_TABLE(table, addr)					\
+	in_interval_table(&(table)[0][0], ARRAY_SIZE(table),		\
+			  ARRAY_SIZE((table)[0]), (addr))
+
+/* Binary search for the last row starting at or before addr. The loop body
+ * compiles to a conditional move rather than a branch, and the number of
+ * iterations depends only on the table size. */
+static inline bool in_interval_table(const unsigned int *table,
+				     unsigned int rows, unsigned int columns,
+				     unsigned int addr)
+{
+	const unsigned int *row = table;
+
+	if (rows == 0) {
+		return false;
+	}
+	while (rows > 1) {
+		unsigned int half = rows / 2;
+		row = row[half * columns] <= addr ? row + half * columns : row;
+		rows -= half;
+	}
+	return addr >= row[0] && addr <= row[1];
+}
+
+#endif
@@ -9,6 +9,7 @@
 #define MODULE_NAME "kernel glue"
 
 #include "common.h"
+#include "interval.h"
 #include "kernel_specifics.h"
 #include "kspec.h"
 #include "stack.h"
@@ -76,17 +77,12 @@ bool kern_sched_init_done(unsigned int eip)
 
 bool kern_in_scheduler(conf_object_t *cpu, unsigned int eip)
 {
+	/* Sorted and merged by definegen.sh. This is checked on every shared
+	 * memory access, so it's a binary search rather than a scan. */
 	static const unsigned int sched_funx[][2] = GUEST_SCHEDULER_FUNCTIONS;
 
-	for (int i = 0; i < ARRAY_SIZE(sched_funx); i++) {
-		/* The get_func_end returns the last instr, so be inclusive */
-		/* Don't use within_function here - huge performance regression.
-		 * if (within_function(cpu, eip, sched_funx[i][0], sched_funx[i][1])) */
-		if (eip >= sched_funx[i][0] && eip <= sched_funx[i][1])
-			return true;
-	}
-
-	return false;
+	/* Don't use within_function here - huge performance regression. */
+	return IN_INTERVAL_TABLE(sched_funx, eip);
 }
 
 bool kern_access_in_scheduler(unsigned int addr)
@@ -34,6 +34,7 @@
 #define MODULE_NAME "LANDSLIDE"
 #define MODULE_COLOUR COLOUR_DARK COLOUR_MAGENTA
 
+#include "bitset.h"
 #include "common.h"
 #include "explore.h"
 #include "estimate.h"
@@ -46,6 +47,7 @@
 #include "messaging.h"
 #include "rand.h"
 #include "save.h"
+#include "symtable.h"
 #include "test.h"
 #include "tree.h"
 #include "user_specifics.h"
@@ -76,13 +78,17 @@ struct ls_state *new_landslide()
 	rand_init(&ls->rand);
 	messaging_init(&ls->mess);
 	pps_init(&ls->pps);
+	symtable_init();
 
+	/* may be overridden per job by quicksand; see load_dynamic_pps() */
 #ifdef ICB
+	ls->icb = true;
 	ls->icb_bound = ICB_START_BOUND;
 #else
-	/* garbage value; may be sent to QS in a message (WTB option types :\),
-	 * but should not get printed to the user */
-	ls->icb_bound = 31337;
+	/* may be sent to QS in a message (WTB option types :\), but should not
+	 * get printed to the user */
+	ls->icb = false;
+	ls->icb_bound = ICB_UNBOUNDED;
 #endif
 	ls->icb_need_increment_bound = false;
 
@@ -90,6 +96,8 @@ struct ls_state *new_landslide()
 	ls->html_file = NULL;
 	ls->just_jumped = false;
 	ls->end_branch_early = false;
+	ls->interesting_eips = NULL;
+	ls->interesting_data_races = -1;
 
 	lsprintf(ALWAYS, "welcome to landslide.\n");
 
@@ -320,11 +328,43 @@ static bool check_infinite_loop(struct ls_state *ls, char *message, unsigned int
 	return false;
 }
 
+/* Returns false if a bug was found. */
+static bool check_progress(struct ls_state *ls)
+{
+	char message[BUF_SIZE];
+
+	if (!check_infinite_loop(ls, message, BUF_SIZE)) {
+		return true;
+	}
+
+	const char *headline = "NO PROGRESS (infinite loop?)";
+	lsprintf(BUG, COLOUR_BOLD COLOUR_RED "%s\n", message);
+	FOUND_A_BUG_HTML_INFO(ls, headline, strlen(headline), html_env,
+		HTML_PRINTF(html_env, "%s" HTML_NEWLINE, message);
+		if (IN_USER_SYNC_PRIMITIVES(ls->sched.cur_agent)) {
+			HTML_PRINTF(html_env, HTML_NEWLINE HTML_BOX_BEGIN);
+			HTML_PRINTF(html_env, "<b>NOTE: I have run a loop "
+				    "in %s() an alarming number of times."
+				    HTML_NEWLINE,
+				    USER_SYNC_ACTION_STR(ls->sched.cur_agent));
+			HTML_PRINTF(html_env, "This version of "
+				    "Landslide cannot distinguish "
+				    "between this loop " HTML_NEWLINE);
+			HTML_PRINTF(html_env, "being infinite versus "
+				    "merely undesirable." HTML_NEWLINE);
+			HTML_PRINTF(html_env, "Please refer to the "
+				    "\"Synchronization (2)\" lecture."
+				    HTML_NEWLINE);
+			HTML_PRINTF(html_env, HTML_BOX_END HTML_NEWLINE);
+		}
+	);
+	return false;
+}
+
 static bool ensure_progress(struct ls_state *ls)
 {
 	char *buf;
 	unsigned int tid = ls->sched.cur_agent->tid;
-	char message[BUF_SIZE];
 
 	if (kern_panicked(ls->cpu0, ls->eip, &buf)) {
 		if (testing_userspace()) {
@@ -428,28 +468,7 @@ static bool ensure_progress(struct ls_state *ls)
 				 ls->sched.cur_agent->tid);
 			return true;
 		}
-	} else if (check_infinite_loop(ls, message, BUF_SIZE)) {
-		const char *headline = "NO PROGRESS (infinite loop?)";
-		lsprintf(BUG, COLOUR_BOLD COLOUR_RED "%s\n", message);
-		FOUND_A_BUG_HTML_INFO(ls, headline, strlen(headline), html_env,
-			HTML_PRINTF(html_env, "%s" HTML_NEWLINE, message);
-			if (IN_USER_SYNC_PRIMITIVES(ls->sched.cur_agent)) {
-				HTML_PRINTF(html_env, HTML_NEWLINE HTML_BOX_BEGIN);
-				HTML_PRINTF(html_env, "<b>NOTE: I have run a loop "
-					    "in %s() an alarming number of times."
-					    HTML_NEWLINE,
-					    USER_SYNC_ACTION_STR(ls->sched.cur_agent));
-				HTML_PRINTF(html_env, "This version of "
-					    "Landslide cannot distinguish "
-					    "between this loop " HTML_NEWLINE);
-				HTML_PRINTF(html_env, "being infinite versus "
-					    "merely undesirable." HTML_NEWLINE);
-				HTML_PRINTF(html_env, "Please refer to the "
-					    "\"Synchronization (2)\" lecture."
-					    HTML_NEWLINE);
-				HTML_PRINTF(html_env, HTML_BOX_END HTML_NEWLINE);
-			}
-		);
+	} else if (!check_progress(ls)) {
 		return false;
 #ifdef PINTOS_KERNEL
 	} else if (ls->eip == GUEST_PRINTF) {
@@ -568,7 +587,7 @@ static bool time_travel(struct ls_state *ls)
 	if (h != NULL) {
 		assert(!h->all_explored);
 		arbiter_append_choice(&ls->arbiter, tid, txn, xabort_code);
-		save_longjmp(&ls->save, ls, h);
+		save_longjmp(&ls->save, ls, h, is_last_visit(h, tid));
 		return true;
 	} else if (ls->icb_need_increment_bound) {
 		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_YELLOW "ICB bound %u "
@@ -611,6 +630,85 @@ static void check_test_state(struct ls_state *ls)
 	}
 }
 
+/******************************************************************************
+ * uninteresting instruction fast path
+ ******************************************************************************/
+
+/* Most instructions aren't at any eip that landslide was told about, and the
+ * per-instruction updates have nothing to do there but check for progress.
+ * This bitmap, indexed by the low bits of the eip, marks every eip that might
+ * be interesting. Eips far apart can share a bit, which just costs a trip
+ * through the slow path. */
+#define INTEREST_MAP_BITS (1 << 20)
+
+static void mark_interesting(struct ls_state *ls, unsigned int eip)
+{
+	bitset_set(ls->interesting_eips, eip % INTEREST_MAP_BITS, true);
+}
+
+static void build_interest_map(struct ls_state *ls)
+{
+#ifdef INTERESTING_EIPS
+	/* Everything the config annotates; see build.sh. */
+	static const unsigned int annotated_eips[] = INTERESTING_EIPS;
+	static const unsigned int disk_io_fns[][2] = DISK_IO_FNS;
+	struct pp_data_race *pp;
+	unsigned int i;
+
+	if (ls->interesting_eips == NULL) {
+		ls->interesting_eips = BITSET_XMALLOC(INTEREST_MAP_BITS);
+	} else {
+		bitset_clear_all(ls->interesting_eips, INTEREST_MAP_BITS);
+	}
+
+	/* int, not unsigned, lest an empty array's loop warn (cf. DISK_IO_FNS
+	 * in kernel_specifics.c) */
+	for (int j = 0; j < ARRAY_SIZE(annotated_eips); j++) {
+		mark_interesting(ls, annotated_eips[j]);
+	}
+	for (int j = 0; j < ARRAY_SIZE(disk_io_fns); j++) {
+		mark_interesting(ls, disk_io_fns[j][0]);
+		mark_interesting(ls, disk_io_fns[j][1]);
+	}
+	ARRAY_LIST_FOREACH(&ls->pps.data_races, i, pp) {
+		mark_interesting(ls, pp->addr);
+	}
+#if defined(PURE_HAPPENS_BEFORE) && !defined(PINTOS_KERNEL)
+	/* hardcoded in sched_update_user_state_machine (#220) */
+	mark_interesting(ls, 0x1029b6);
+#endif
+#endif
+	/* If the header predates INTERESTING_EIPS, the map stays NULL, and
+	 * every instruction takes the slow path. */
+	ls->interesting_data_races = ARRAY_LIST_SIZE(&ls->pps.data_races);
+}
+
+static bool uninteresting_instruction(struct ls_state *ls)
+{
+	uint8_t *text = ls->instruction_text;
+
+	if (ls->interesting_data_races != ARRAY_LIST_SIZE(&ls->pps.data_races)) {
+		/* first time, or dynamic PPs were loaded since last time */
+		build_interest_map(ls);
+	}
+
+	if (ls->interesting_eips == NULL ||
+	    bitset_get(ls->interesting_eips, ls->eip % INTEREST_MAP_BITS)) {
+		return false;
+	}
+
+	/* Opcodes the state machines look for, wherever they are. */
+	if (OPCODE_IS_CALL(text) || OPCODE_IS_RET(text) ||
+	    text[0] == OPCODE_IRET || text[0] == OPCODE_INT ||
+	    text[0] == OPCODE_HLT || text[0] == OPCODE_CLI ||
+	    text[0] == OPCODE_STI || opcodes_are_atomic_swap(text)) {
+		return false;
+	}
+
+	return !ls->end_branch_early && mem_can_skip_update(ls) &&
+		sched_can_skip_update(ls) && test_can_skip_update(ls);
+}
+
 /* Main entry point. Called every instruction, data access, and extensible. */
 void landslide_entrypoint(conf_object_t *obj, void *trace_entry)
 {
@@ -619,6 +717,11 @@ void landslide_entrypoint(conf_object_t *obj, void *trace_entry)
 
 	ls->eip = GET_CPU_ATTR(ls->cpu0, eip);
 
+	if (ls->just_jumped) {
+		/* simics rewound the guest's memory, page tables included */
+		mem_translate_flush();
+	}
+
 	if (entry->trace_type == TR_Data) {
 		if (ls->just_jumped) {
 			/* stray access associated with the last instruction
@@ -627,6 +730,10 @@ void landslide_entrypoint(conf_object_t *obj, void *trace_entry)
 			 * record the access where/when it belongs. */
 			return;
 		}
+		if (entry->read_or_write == Sim_RW_Write) {
+			/* might be to a page table */
+			mem_translate_observe_write(entry->pa, entry->size);
+		}
 		/* mem access - do heap checks, whether user or kernel */
 		mem_check_shared_access(ls, entry->pa, entry->va,
 					(entry->read_or_write == Sim_RW_Write));
@@ -648,6 +755,11 @@ void landslide_entrypoint(conf_object_t *obj, void *trace_entry)
 			ls->just_jumped = false;
 		}
 
+		if (uninteresting_instruction(ls)) {
+			check_progress(ls);
+			return;
+		}
+
 		/* NB. mem update must come first because sched update contains
 		 * the logic to create PPs, and snapshots must include state
 		 * machine changes from mem update (tracking malloc/free). */
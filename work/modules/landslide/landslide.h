@@ -45,7 +45,8 @@ struct ls_state {
 	struct messaging_state mess;
 	struct pp_config pps;
 
-	/* used iff ICB is set */
+	/* iterative context bounding; chosen at startup, not at build time */
+	bool icb;
 	unsigned int icb_bound;
 	bool icb_need_increment_bound;
 
@@ -54,6 +55,9 @@ struct ls_state {
 
 	bool just_jumped;
 	bool end_branch_early;
+	/* see "uninteresting instruction fast path" in landslide.c */
+	uint64_t *interesting_eips;
+	int interesting_data_races;
 };
 
 /* process exit codes */
@@ -30,7 +30,12 @@ void lockset_clone(struct lockset *dest, const struct lockset *src)
 	ARRAY_LIST_CLONE(&dest->list, &src->list);
 }
 
-void lockset_print(verbosity v, struct lockset *l)
+void lockset_move(struct lockset *dest, struct lockset *src)
+{
+	ARRAY_LIST_MOVE(&dest->list, &src->list);
+}
+
+static void print_locks(verbosity v, struct lockset *l)
 {
 	unsigned int i;
 	struct lock *lock;
@@ -76,7 +81,7 @@ static bool lockset_contains(struct lockset *set, unsigned int lock_addr, enum l
 	return false;
 }
 
-bool lockset_intersect(struct lockset *l0, struct lockset *l1)
+static bool intersect_locks(struct lockset *l0, struct lockset *l1)
 {
 	// Bad runtime. Oh well.
 	// TODO: can exploit the fact that both are sorted for O(n+m) time
@@ -112,7 +117,234 @@ static void _lockset_add(struct lockset *l, unsigned int lock_addr, enum lock_ty
 	}
 }
 
-void lockset_add(struct sched_state *s, struct lockset *l,
+static enum lockset_cmp_result compare_locks(struct lockset *l0,
+					     struct lockset *l1)
+{
+	enum lockset_cmp_result result = LOCKSETS_EQ;
+	int i = 0, j = 0;
+
+	while (i < ARRAY_LIST_SIZE(&l0->list) || j < ARRAY_LIST_SIZE(&l1->list)) {
+		/* check termination condition */
+		if (i == ARRAY_LIST_SIZE(&l0->list)) {
+			/* j's set has extra elements */
+			if (result == LOCKSETS_SUPSET) {
+				return LOCKSETS_DIFF;
+			} else {
+				return LOCKSETS_SUBSET;
+			}
+		} else if (j == ARRAY_LIST_SIZE(&l1->list)) {
+			/* i's set has extra elements */
+			if (result == LOCKSETS_SUBSET) {
+				return LOCKSETS_DIFF;
+			} else {
+				return LOCKSETS_SUPSET;
+			}
+		}
+
+		/* check elements */
+		int cmp = lock_cmp(ARRAY_LIST_GET(&l0->list, i),
+				   ARRAY_LIST_GET(&l1->list, j));
+		if (cmp < 0) {
+			/* this lock is missing in j's set */
+			if (result == LOCKSETS_SUBSET) {
+				return LOCKSETS_DIFF;
+			} else {
+				result = LOCKSETS_SUPSET;
+				i++;
+			}
+		} else if (cmp > 0) {
+			/* this lock is missing in i's set */
+			if (result == LOCKSETS_SUPSET) {
+				return LOCKSETS_DIFF;
+			} else {
+				result = LOCKSETS_SUBSET;
+				j++;
+			}
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	return result;
+}
+
+/******************************************************************************
+ * Interning
+ ******************************************************************************/
+
+#define LOCKSET_TABLE_INIT_CAPACITY 64
+#define LOCKSET_MEMO_SIZE 4096
+
+/* results of comparing two distinct nonempty locksets, direct-mapped */
+struct lockset_memo {
+	lockset_id_t l0;
+	lockset_id_t l1;
+	enum lockset_cmp_result cmp;
+	bool intersect;
+};
+
+static struct {
+	/* indexed by id; id 0 is always the empty set */
+	ARRAY_LIST(struct lockset) sets;
+	/* open addressing on the sets' contents; holds ids plus one, so that 0
+	 * marks an empty slot. the empty set itself is never looked up. */
+	lockset_id_t *table;
+	unsigned int capacity; /* power of 2 */
+	struct lockset_memo memo[LOCKSET_MEMO_SIZE];
+} interned;
+
+/* The empty set gets its id before anything else is ever interned. */
+static void interned_init(void)
+{
+	if (interned.sets.array == NULL) {
+		struct lockset empty;
+		lockset_init(&empty);
+		ARRAY_LIST_INIT(&interned.sets, LOCKSET_TABLE_INIT_CAPACITY);
+		ARRAY_LIST_APPEND(&interned.sets, empty);
+	}
+}
+
+static struct lockset *lockset_of(lockset_id_t id)
+{
+	interned_init();
+	return ARRAY_LIST_GET(&interned.sets, id);
+}
+
+static unsigned int hash_locks(struct lockset *l)
+{
+	unsigned int hash = 2166136261u; /* FNV-1a */
+	unsigned int i;
+	struct lock *lock;
+	ARRAY_LIST_FOREACH(&l->list, i, lock) {
+		hash = (hash ^ lock->addr) * 16777619u;
+		hash = (hash ^ lock->type) * 16777619u;
+	}
+	return hash;
+}
+
+static bool equal_locks(struct lockset *l0, struct lockset *l1)
+{
+	unsigned int i;
+	struct lock *lock;
+	if (ARRAY_LIST_SIZE(&l0->list) != ARRAY_LIST_SIZE(&l1->list)) {
+		return false;
+	}
+	ARRAY_LIST_FOREACH(&l0->list, i, lock) {
+		if (lock_cmp(lock, ARRAY_LIST_GET(&l1->list, i)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Returns the slot where a set with this hash either is or would go. */
+static lockset_id_t *lockset_table_slot(struct lockset *l, unsigned int hash)
+{
+	unsigned int mask = interned.capacity - 1;
+	for (unsigned int i = hash & mask; ; i = (i + 1) & mask) {
+		lockset_id_t *slot = &interned.table[i];
+		if (*slot == 0 || equal_locks(lockset_of(*slot - 1), l)) {
+			return slot;
+		}
+	}
+}
+
+static void lockset_table_grow(void)
+{
+	lockset_id_t *old_table = interned.table;
+	unsigned int old_capacity = interned.capacity;
+
+	interned.capacity = old_capacity == 0 ?
+		LOCKSET_TABLE_INIT_CAPACITY : old_capacity * 2;
+	interned.table = MM_XMALLOC(interned.capacity, lockset_id_t);
+	memset(interned.table, 0, interned.capacity * sizeof(lockset_id_t));
+
+	for (unsigned int i = 0; i < old_capacity; i++) {
+		if (old_table[i] != 0) {
+			struct lockset *l = lockset_of(old_table[i] - 1);
+			*lockset_table_slot(l, hash_locks(l)) = old_table[i];
+		}
+	}
+	MM_FREE(old_table);
+}
+
+/* Returns the id of the set of locks in l, which is consumed. */
+static lockset_id_t lockset_intern(struct lockset *l)
+{
+	if (ARRAY_LIST_SIZE(&l->list) == 0) {
+		lockset_free(l);
+		return LOCKSET_EMPTY;
+	}
+
+	/* keep the load factor at most 1/2 (counting the unhashed empty set) */
+	interned_init();
+	if (ARRAY_LIST_SIZE(&interned.sets) * 2 > interned.capacity) {
+		lockset_table_grow();
+	}
+
+	lockset_id_t *slot = lockset_table_slot(l, hash_locks(l));
+	if (*slot != 0) {
+		lockset_free(l);
+		return *slot - 1;
+	}
+
+	lockset_id_t id = ARRAY_LIST_SIZE(&interned.sets);
+	assert(id != UINT_MAX - 1 && "need a wider type");
+	ARRAY_LIST_APPEND(&interned.sets, *l);
+	*slot = id + 1;
+	return id;
+}
+
+static struct lockset_memo *lockset_memo(lockset_id_t l0, lockset_id_t l1)
+{
+	assert(l0 != l1 && "memoizing comparison of identical locksets");
+	struct lockset_memo *memo =
+		&interned.memo[((l0 * 2654435761u) ^ l1) % LOCKSET_MEMO_SIZE];
+	if (memo->l0 != l0 || memo->l1 != l1) {
+		memo->l0 = l0;
+		memo->l1 = l1;
+		memo->cmp = compare_locks(lockset_of(l0), lockset_of(l1));
+		memo->intersect = intersect_locks(lockset_of(l0), lockset_of(l1));
+	}
+	return memo;
+}
+
+/******************************************************************************
+ * Interface for locks held by threads
+ ******************************************************************************/
+
+void lockset_print(verbosity v, lockset_id_t l)
+{
+	print_locks(v, lockset_of(l));
+}
+
+bool lockset_intersect(lockset_id_t l0, lockset_id_t l1)
+{
+	if (l0 == LOCKSET_EMPTY || l1 == LOCKSET_EMPTY) {
+		return false;
+	} else if (l0 == l1) {
+		return true;
+	} else {
+		return lockset_memo(l0, l1)->intersect;
+	}
+}
+
+enum lockset_cmp_result lockset_compare(lockset_id_t l0, lockset_id_t l1)
+{
+	/* interned, so same locks iff same id */
+	if (l0 == l1) {
+		return LOCKSETS_EQ;
+	} else if (l0 == LOCKSET_EMPTY) {
+		return LOCKSETS_SUBSET;
+	} else if (l1 == LOCKSET_EMPTY) {
+		return LOCKSETS_SUPSET;
+	} else {
+		return lockset_memo(l0, l1)->cmp;
+	}
+}
+
+void lockset_add(struct sched_state *s, lockset_id_t *l,
 		 unsigned int lock_addr, enum lock_type type)
 {
 	assert(lock_addr != 0);
@@ -128,13 +360,13 @@ void lockset_add(struct sched_state *s, struct lockset *l,
 	}
 
 	lsprintf(INFO, "Adding 0x%x to lockset: ", lock_addr);
-	lockset_print(INFO, l);
+	lockset_print(INFO, *l);
 	printf(INFO, "\n");
 
 	/* Check that the lock is not already held. Make an exception for
 	 * e.g. mutexes and things that can contain them having the same
 	 * address. */
-	if (lockset_contains(l, lock_addr, type)) {
+	if (lockset_contains(lockset_of(*l), lock_addr, type)) {
 #if ALLOW_LOCK_HANDOFF != 0
 		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_YELLOW
 			 "WARNING: Recursively locking lock 0x%x (type %d) -- "
@@ -146,7 +378,10 @@ void lockset_add(struct sched_state *s, struct lockset *l,
 #endif
 	}
 
-	_lockset_add(l, lock_addr, type);
+	struct lockset held;
+	lockset_clone(&held, lockset_of(*l));
+	_lockset_add(&held, lock_addr, type);
+	*l = lockset_intern(&held);
 }
 
 static bool _lockset_remove(struct lockset *l, unsigned int lock_addr, enum lock_type type)
@@ -154,7 +389,7 @@ static bool _lockset_remove(struct lockset *l, unsigned int lock_addr, enum lock
 	assert(type != LOCK_RWLOCK_READ && "use LOCK_RWLOCK for unlocking");
 
 	lsprintf(INFO, "Removing 0x%x from lockset: ", lock_addr);
-	lockset_print(INFO, l);
+	print_locks(INFO, l);
 	printf(INFO, "\n");
 
 	int i;
@@ -168,6 +403,16 @@ static bool _lockset_remove(struct lockset *l, unsigned int lock_addr, enum lock
 	return false;
 }
 
+static bool _lockset_remove_held(lockset_id_t *l, unsigned int lock_addr,
+				 enum lock_type type)
+{
+	struct lockset held;
+	lockset_clone(&held, lockset_of(*l));
+	bool removed = _lockset_remove(&held, lock_addr, type);
+	*l = lockset_intern(&held);
+	return removed;
+}
+
 #define LOCKSET_OF(a, in_kernel) \
 	((in_kernel) ? &(a)->kern_locks_held : &(a)->user_locks_held)
 void lockset_remove(struct sched_state *s, unsigned int lock_addr,
@@ -180,7 +425,7 @@ void lockset_remove(struct sched_state *s, unsigned int lock_addr,
 		return;
 	}
 
-	if (_lockset_remove(LOCKSET_OF(s->cur_agent, in_kernel), lock_addr, type))
+	if (_lockset_remove_held(LOCKSET_OF(s->cur_agent, in_kernel), lock_addr, type))
 		return;
 
 	char lock_name[BUF_SIZE];
@@ -192,13 +437,13 @@ void lockset_remove(struct sched_state *s, unsigned int lock_addr,
 #if ALLOW_LOCK_HANDOFF != 0
 	struct agent *a;
 	Q_FOREACH(a, &s->rq, nobe) {
-		if (_lockset_remove(LOCKSET_OF(a, in_kernel), lock_addr, type)) return;
+		if (_lockset_remove_held(LOCKSET_OF(a, in_kernel), lock_addr, type)) return;
 	}
 	Q_FOREACH(a, &s->sq, nobe) {
-		if (_lockset_remove(LOCKSET_OF(a, in_kernel), lock_addr, type)) return;
+		if (_lockset_remove_held(LOCKSET_OF(a, in_kernel), lock_addr, type)) return;
 	}
 	Q_FOREACH(a, &s->rq, nobe) {
-		if (_lockset_remove(LOCKSET_OF(a, in_kernel), lock_addr, type)) return;
+		if (_lockset_remove_held(LOCKSET_OF(a, in_kernel), lock_addr, type)) return;
 	}
 #endif
 
@@ -248,54 +493,3 @@ void lockset_record_semaphore(struct lockset *semaphores, unsigned int lock_addr
 		}
 	}
 }
-
-enum lockset_cmp_result lockset_compare(struct lockset *l0, struct lockset *l1)
-{
-	enum lockset_cmp_result result = LOCKSETS_EQ;
-	int i = 0, j = 0;
-
-	while (i < ARRAY_LIST_SIZE(&l0->list) || j < ARRAY_LIST_SIZE(&l1->list)) {
-		/* check termination condition */
-		if (i == ARRAY_LIST_SIZE(&l0->list)) {
-			/* j's set has extra elements */
-			if (result == LOCKSETS_SUPSET) {
-				return LOCKSETS_DIFF;
-			} else {
-				return LOCKSETS_SUBSET;
-			}
-		} else if (j == ARRAY_LIST_SIZE(&l1->list)) {
-			/* i's set has extra elements */
-			if (result == LOCKSETS_SUBSET) {
-				return LOCKSETS_DIFF;
-			} else {
-				return LOCKSETS_SUPSET;
-			}
-		}
-
-		/* check elements */
-		int cmp = lock_cmp(ARRAY_LIST_GET(&l0->list, i),
-				   ARRAY_LIST_GET(&l1->list, j));
-		if (cmp < 0) {
-			/* this lock is missing in j's set */
-			if (result == LOCKSETS_SUBSET) {
-				return LOCKSETS_DIFF;
-			} else {
-				result = LOCKSETS_SUPSET;
-				i++;
-			}
-		} else if (cmp > 0) {
-			/* this lock is missing in i's set */
-			if (result == LOCKSETS_SUPSET) {
-				return LOCKSETS_DIFF;
-			} else {
-				result = LOCKSETS_SUBSET;
-				j++;
-			}
-		} else {
-			i++;
-			j++;
-		}
-	}
-
-	return result;
-}
@@ -29,11 +29,19 @@ struct lock {
 	enum lock_type type;
 };
 
-/* Tracks the locks held by a given thread, for data race detection. */
+/* A sorted set of locks. Used directly only for the scheduler's set of known
+ * semaphores; the locks held by threads are stored as lockset_ids below. */
 struct lockset {
 	ARRAY_LIST(struct lock) list;
 };
 
+/* Tracks the locks held by a given thread, for data race detection. The same
+ * few sets recur over and over, so each distinct one is interned, once, as a
+ * small integer which stays valid forever (across branches too). Copying one
+ * is free, equality is integer equality, and comparisons are memoized. */
+typedef unsigned int lockset_id_t;
+#define LOCKSET_EMPTY 0
+
 /* For efficient storage of locksets on memory accesses. */
 enum lockset_cmp_result {
 	LOCKSETS_EQ,     /* locksets contain all same elements */
@@ -44,15 +52,17 @@ enum lockset_cmp_result {
 
 void lockset_init(struct lockset *l);
 void lockset_free(struct lockset *l);
-void lockset_print(verbosity v, struct lockset *l);
 void lockset_clone(struct lockset *dest, const struct lockset *src);
+void lockset_move(struct lockset *dest, struct lockset *src);
 void lockset_record_semaphore(struct lockset *semaphores, unsigned int lock_addr,
 			      bool is_semaphore);
-void lockset_add(struct sched_state *s, struct lockset *l,
+
+void lockset_print(verbosity v, lockset_id_t l);
+void lockset_add(struct sched_state *s, lockset_id_t *l,
 		 unsigned int lock_addr, enum lock_type type);
 void lockset_remove(struct sched_state *s, unsigned int lock_addr,
 		    enum lock_type type, bool in_kernel);
-bool lockset_intersect(struct lockset *l0, struct lockset *l1);
-enum lockset_cmp_result lockset_compare(struct lockset *l0, struct lockset *l1);
+bool lockset_intersect(lockset_id_t l0, lockset_id_t l1);
+enum lockset_cmp_result lockset_compare(lockset_id_t l0, lockset_id_t l1);
 
 #endif
@@ -5,10 +5,13 @@
  */
 
 #include <simics/api.h>
+#include <stdlib.h> /* for qsort */
+#include <string.h> /* for memset */
 
 #define MODULE_NAME "MEMORY"
 #define MODULE_COLOUR COLOUR_DARK COLOUR_YELLOW
 
+#include "bitset.h"
 #include "common.h"
 #include "compiler.h"
 #include "found_a_bug.h"
@@ -19,6 +22,7 @@
 #include "memory.h"
 #include "messaging.h"
 #include "rbtree.h"
+#include "snapshot.h"
 #include "stack.h"
 #include "symtable.h"
 #include "tree.h"
@@ -57,14 +61,32 @@ void init_malloc_actions(struct malloc_actions *flags)
 	flags->palloc_request_size = 0x2badd00d;
 }
 
+/* Never 0, so a zeroed chunk_cache matches no heap. */
+static unsigned int next_heap_generation(void)
+{
+	static unsigned int generation = 0;
+	assert(generation != UINT_MAX && "need a wider type");
+	return ++generation;
+}
+
+static struct shared_heap *shared_heap_new(void)
+{
+	struct shared_heap *sh = MM_XMALLOC(1, struct shared_heap);
+	sh->refcount = 1;
+	sh->root.rb_node = NULL;
+	sh->generation = next_heap_generation();
+	sh->index = NULL;
+	return sh;
+}
+
 static void mem_heap_init(struct mem_state *m)
 {
-	m->malloc_heap.rb_node = NULL;
+	m->malloc_heap = shared_heap_new();
 	m->heap_size = 0;
 	m->heap_next_id = 0;
 	m->guest_init_done = false;
 	m->in_mm_init = false;
-	m->palloc_heap.rb_node = NULL;
+	m->palloc_heap = shared_heap_new();
 #ifndef ALLOW_REENTRANT_MALLOC_FREE
 	init_malloc_actions(&m->flags);
 #endif
@@ -72,8 +94,13 @@ static void mem_heap_init(struct mem_state *m)
 	m->cr3_tid = 0;
 	m->user_mutex_size = 0;
 	m->during_xchg = false;
-	m->shm.rb_node = NULL;
+	shm_set_init(&m->shm);
+	arena_init(&m->shm_arena);
+#ifdef PURE_HAPPENS_BEFORE
+	m->last_arena_clock.s = NULL;
+#endif
 	m->freed.rb_node = NULL;
+	m->freed_index = NULL;
 	m->data_races.rb_node = NULL;
 	m->data_races_suspected = 0;
 	m->data_races_confirmed = 0;
@@ -194,9 +221,9 @@ static struct chunk *find_containing_chunk(struct rb_root *root, unsigned int ad
 /* As above, but searches both the malloc and palloc heap (if it exists). */
 static struct chunk *find_alloced_chunk(struct mem_state *m, unsigned int addr)
 {
-	struct chunk *c = find_containing_chunk(&m->malloc_heap, addr);
+	struct chunk *c = find_containing_chunk(&m->malloc_heap->root, addr);
 	if (c == NULL) {
-		c = find_containing_chunk(&m->palloc_heap, addr);
+		c = find_containing_chunk(&m->palloc_heap->root, addr);
 		/* Pages used to back malloc are still illegal. */
 		if (c != NULL && c->pages_reserved_for_malloc) {
 			c = NULL;
@@ -206,7 +233,10 @@ static struct chunk *find_alloced_chunk(struct mem_state *m, unsigned int addr)
 }
 
 
-static void insert_chunk(struct rb_root *root, struct chunk *c, bool coalesce)
+/* Returns the chunk that now covers c's range, which, if coalescing, might be
+ * an existing one, in which case c itself is freed. */
+static struct chunk *insert_chunk(struct rb_root *root, struct chunk *c,
+				  bool coalesce)
 {
 	struct chunk *parent = NULL;
 	struct rb_node **p = find_insert_location(root, c->base, &parent);
@@ -218,7 +248,7 @@ static void insert_chunk(struct rb_root *root, struct chunk *c, bool coalesce)
 		assert(parent != NULL);
 		parent->len = MAX(parent->len, c->len + c->base - parent->base);
 		MM_FREE(c);
-		return;
+		return parent;
 	}
 
 	assert(p != NULL && "allocated a block already contained in the heap?");
@@ -226,6 +256,7 @@ static void insert_chunk(struct rb_root *root, struct chunk *c, bool coalesce)
 	rb_init_node(&c->nobe);
 	rb_link_node(&c->nobe, parent != NULL ? &parent->nobe : NULL, p);
 	rb_insert_color(&c->nobe, root);
+	return c;
 }
 
 static struct chunk *remove_chunk(struct rb_root *root, unsigned int addr)
@@ -243,6 +274,278 @@ static struct chunk *remove_chunk(struct rb_root *root, unsigned int addr)
 	}
 }
 
+static struct rb_node *dup_chunk(const struct rb_node *nobe,
+				 const struct rb_node *parent)
+{
+	if (nobe == NULL)
+		return NULL;
+
+	struct chunk *src = rb_entry(nobe, struct chunk, nobe);
+	struct chunk *dest = MM_XMALLOC(1, struct chunk);
+
+	/* dup rb node contents */
+	int colour_flag = src->nobe.rb_parent_color & 1;
+
+	assert(((unsigned long)parent & 1) == 0);
+	dest->nobe.rb_parent_color = (unsigned long)parent | colour_flag;
+	dest->nobe.rb_right = dup_chunk(src->nobe.rb_right, &dest->nobe);
+	dest->nobe.rb_left  = dup_chunk(src->nobe.rb_left, &dest->nobe);
+
+	dest->base = src->base;
+	dest->len  = src->len;
+	dest->id   = src->id;
+
+	if (src->malloc_trace == NULL) {
+		dest->malloc_trace = NULL;
+	} else {
+		dest->malloc_trace = stack_trace_ref(src->malloc_trace);
+	}
+	if (src->free_trace == NULL) {
+		dest->free_trace = NULL;
+	} else {
+		dest->free_trace = stack_trace_ref(src->free_trace);
+	}
+
+	dest->pages_reserved_for_malloc = src->pages_reserved_for_malloc;
+
+	return &dest->nobe;
+}
+
+void free_heap(struct rb_node *nobe)
+{
+	if (nobe == NULL)
+		return;
+	free_heap(nobe->rb_left);
+	free_heap(nobe->rb_right);
+
+	struct chunk *c = rb_entry(nobe, struct chunk, nobe);
+	if (c->malloc_trace != NULL) stack_trace_unref(c->malloc_trace);
+	if (c->free_trace   != NULL) stack_trace_unref(c->free_trace);
+	MM_FREE(c);
+}
+
+/******************************************************************************
+ * Heap page index
+ ******************************************************************************/
+
+/* Pages map to buckets directly by page number, so any run of consecutive
+ * pages up to a bucket array's length lands in distinct buckets. */
+#define HEAP_INDEX_BUCKETS 1024
+#define FREED_INDEX_BUCKETS 256
+
+typedef ARRAY_LIST(struct chunk *) chunk_list_t;
+
+/* Each bucket holds every chunk that overlaps any page mapping to it, sorted
+ * by base. Chunks in one heap never overlap, so the chunk containing an addr,
+ * if any, is the last one in addr's bucket with base at or below addr. */
+struct heap_index {
+	chunk_list_t buckets[HEAP_INDEX_BUCKETS];
+};
+
+/* How many of num_buckets buckets [base, base+len) covers. Empty chunks can't
+ * contain anything, so they go in none. */
+static unsigned int chunk_num_buckets(unsigned int base, unsigned int len,
+				      unsigned int num_buckets)
+{
+	if (len == 0) {
+		return 0;
+	}
+	unsigned int num_pages =
+		(PAGE_ALIGN(base + len - 1) - PAGE_ALIGN(base)) / PAGE_SIZE + 1;
+	return MIN(num_pages, num_buckets);
+}
+
+#define CHUNK_BUCKET(base, i, num_buckets) \
+	(((base) / PAGE_SIZE + (i)) % (num_buckets))
+
+/* Returns the position of the first chunk in the list based above addr. */
+static unsigned int chunk_list_upper_bound(chunk_list_t *list, unsigned int addr)
+{
+	unsigned int lo = 0;
+	unsigned int hi = ARRAY_LIST_SIZE(list);
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (list->array[mid]->base <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void heap_index_insert(struct heap_index *index, struct chunk *c)
+{
+	unsigned int num = chunk_num_buckets(c->base, c->len, HEAP_INDEX_BUCKETS);
+
+	for (unsigned int i = 0; i < num; i++) {
+		chunk_list_t *bucket =
+			&index->buckets[CHUNK_BUCKET(c->base, i, HEAP_INDEX_BUCKETS)];
+		unsigned int pos = chunk_list_upper_bound(bucket, c->base);
+		ARRAY_LIST_APPEND(bucket, c);
+		memmove(&bucket->array[pos + 1], &bucket->array[pos],
+			(bucket->size - 1 - pos) * sizeof(struct chunk *));
+		bucket->array[pos] = c;
+	}
+}
+
+static void heap_index_remove(struct heap_index *index, struct chunk *c)
+{
+	unsigned int num = chunk_num_buckets(c->base, c->len, HEAP_INDEX_BUCKETS);
+
+	for (unsigned int i = 0; i < num; i++) {
+		chunk_list_t *bucket =
+			&index->buckets[CHUNK_BUCKET(c->base, i, HEAP_INDEX_BUCKETS)];
+		unsigned int pos = chunk_list_upper_bound(bucket, c->base);
+		assert(pos > 0 && bucket->array[pos - 1] == c &&
+		       "chunk missing from heap index");
+		memmove(&bucket->array[pos - 1], &bucket->array[pos],
+			(bucket->size - pos) * sizeof(struct chunk *));
+		bucket->size--;
+	}
+}
+
+static struct heap_index *heap_index_build(struct rb_root *root)
+{
+	struct heap_index *index = MM_XMALLOC(1, struct heap_index);
+	/* all-zero array lists are empty ones */
+	memset(index, 0, sizeof(struct heap_index));
+
+	/* in order, so every insertion is an append */
+	for (struct rb_node *nobe = rb_first(root); nobe != NULL;
+	     nobe = rb_next(nobe)) {
+		heap_index_insert(index, rb_entry(nobe, struct chunk, nobe));
+	}
+	return index;
+}
+
+static void heap_index_free(struct shared_heap *sh)
+{
+	if (sh->index != NULL) {
+		for (unsigned int i = 0; i < HEAP_INDEX_BUCKETS; i++) {
+			ARRAY_LIST_FREE(&sh->index->buckets[i]);
+		}
+		MM_FREE(sh->index);
+		sh->index = NULL;
+	}
+}
+
+/* As find_containing_chunk, but with the page index, built on first use. A
+ * shared heap never changes, so building one for it is fine too. */
+static struct chunk *heap_index_lookup(struct shared_heap *sh, unsigned int addr)
+{
+	if (sh->root.rb_node == NULL) {
+		return NULL;
+	} else if (sh->index == NULL) {
+		sh->index = heap_index_build(&sh->root);
+	}
+
+	chunk_list_t *bucket =
+		&sh->index->buckets[CHUNK_BUCKET(addr, 0, HEAP_INDEX_BUCKETS)];
+	unsigned int pos = chunk_list_upper_bound(bucket, addr);
+	if (pos == 0) {
+		return NULL;
+	}
+	struct chunk *c = bucket->array[pos - 1];
+	return addr - c->base < c->len ? c : NULL;
+}
+
+void chunk_cache_init(struct chunk_cache *cache)
+{
+	cache->malloc_generation = 0;
+	cache->palloc_generation = 0;
+	cache->chunk = NULL;
+}
+
+/* As find_alloced_chunk, for the per-access check. Threads tend to access the
+ * same chunk many times in a row, so first try the one the current thread's
+ * last access found; failing that, use the heaps' page indices. */
+static struct chunk *find_alloced_chunk_cached(struct ls_state *ls,
+					       struct mem_state *m,
+					       unsigned int addr, bool in_kernel)
+{
+	struct chunk_cache *cache = in_kernel ?
+		&ls->sched.cur_agent->kern_chunk_cache :
+		&ls->sched.cur_agent->user_chunk_cache;
+
+	if (cache->malloc_generation == m->malloc_heap->generation &&
+	    cache->palloc_generation == m->palloc_heap->generation &&
+	    addr - cache->chunk->base < cache->chunk->len) {
+		return cache->chunk;
+	}
+
+	struct chunk *c = heap_index_lookup(m->malloc_heap, addr);
+	if (c == NULL) {
+		c = heap_index_lookup(m->palloc_heap, addr);
+		/* Pages used to back malloc are still illegal. */
+		if (c != NULL && c->pages_reserved_for_malloc) {
+			c = NULL;
+		}
+	}
+	if (c != NULL) {
+		cache->malloc_generation = m->malloc_heap->generation;
+		cache->palloc_generation = m->palloc_heap->generation;
+		cache->chunk = c;
+	}
+	return c;
+}
+
+/******************************************************************************
+ * Shared heaps
+ ******************************************************************************/
+
+struct shared_heap *shared_heap_ref(struct shared_heap *sh)
+{
+	assert(sh->refcount > 0 && "ref of a dead heap");
+	sh->refcount++;
+	return sh;
+}
+
+void shared_heap_unref(struct shared_heap *sh)
+{
+	assert(sh->refcount > 0 && "double unref of a heap");
+	if (--sh->refcount == 0) {
+		free_heap(sh->root.rb_node);
+		heap_index_free(sh);
+		MM_FREE(sh);
+	}
+}
+
+/* Gets the tree of a heap that's about to be modified, first breaking sharing
+ * with any saved states in the choice tree if necessary. */
+static struct rb_root *heap_for_write(struct shared_heap **shp)
+{
+	struct shared_heap *sh = *shp;
+	if (sh->refcount > 1) {
+		*shp = shared_heap_new();
+		(*shp)->root.rb_node = dup_chunk(sh->root.rb_node, NULL);
+		/* only the choice tree has it now, which needs no index */
+		heap_index_free(sh);
+		shared_heap_unref(sh);
+	} else {
+		sh->generation = next_heap_generation();
+	}
+	return &(*shp)->root;
+}
+
+static void heap_insert(struct shared_heap **shp, struct chunk *c)
+{
+	insert_chunk(heap_for_write(shp), c, false);
+	if ((*shp)->index != NULL) {
+		heap_index_insert((*shp)->index, c);
+	}
+}
+
+static struct chunk *heap_remove(struct shared_heap **shp, unsigned int addr)
+{
+	struct chunk *c = remove_chunk(heap_for_write(shp), addr);
+	if (c != NULL && (*shp)->index != NULL) {
+		heap_index_remove((*shp)->index, c);
+	}
+	return c;
+}
+
 static void print_heap(verbosity v, struct rb_node *nobe, bool rightmost)
 {
 	if (nobe == NULL) {
@@ -259,32 +562,116 @@ static void print_heap(verbosity v, struct rb_node *nobe, bool rightmost)
 	print_heap(v, c->nobe.rb_right, rightmost);
 }
 
-/* Attempt to find a freed chunk among all transitions */
+/******************************************************************************
+ * Freed chunk index
+ ******************************************************************************/
+
+struct freed_record {
+	unsigned int base;
+	unsigned int len;
+	/* of the save point whose freed tree has (or, once it's made, will
+	 * have) the chunk, i.e., the one ending the transition that freed it */
+	int depth;
+	struct chunk *chunk;
+};
+
+/* Records are in the order the frees happened, hence ascending by depth. Each
+ * bucket holds the positions of the records overlapping any page that maps to
+ * it, also ascending, so scanning one backwards finds the latest free of an
+ * address, and forgetting the latest frees just pops off the ends. */
+struct freed_index {
+	ARRAY_LIST(struct freed_record) records;
+	ARRAY_LIST(unsigned int) buckets[FREED_INDEX_BUCKETS];
+};
+
+static void freed_index_add(struct ls_state *ls, struct mem_state *m,
+			    struct chunk *c)
+{
+	struct freed_index *fi = m->freed_index;
+	if (fi == NULL) {
+		fi = m->freed_index = MM_XMALLOC(1, struct freed_index);
+		memset(fi, 0, sizeof(struct freed_index));
+	}
+
+	struct freed_record r;
+	r.base = c->base;
+	r.len = c->len;
+	r.depth = ls->save.current == NULL ? 0 : ls->save.current->depth + 1;
+	r.chunk = c;
+	assert((fi->records.size == 0 ||
+		fi->records.array[fi->records.size - 1].depth <= r.depth) &&
+	       "frees out of order along the branch");
+
+	unsigned int pos = ARRAY_LIST_SIZE(&fi->records);
+	ARRAY_LIST_APPEND(&fi->records, r);
+	unsigned int num = chunk_num_buckets(r.base, r.len, FREED_INDEX_BUCKETS);
+	for (unsigned int i = 0; i < num; i++) {
+		ARRAY_LIST_APPEND(&fi->buckets[CHUNK_BUCKET(r.base, i,
+							    FREED_INDEX_BUCKETS)],
+				  pos);
+	}
+}
+
+/* Forgets all frees from deeper than the given save point's depth, whose
+ * freed trees are about to be (or have been) destroyed by a longjmp. */
+void mem_forget_frees_after(struct mem_state *m, int depth)
+{
+	struct freed_index *fi = m->freed_index;
+	if (fi == NULL) {
+		return;
+	}
+
+	while (fi->records.size > 0 &&
+	       fi->records.array[fi->records.size - 1].depth > depth) {
+		unsigned int pos = fi->records.size - 1;
+		struct freed_record *r = &fi->records.array[pos];
+		unsigned int num =
+			chunk_num_buckets(r->base, r->len, FREED_INDEX_BUCKETS);
+		for (unsigned int i = 0; i < num; i++) {
+			typeof(fi->buckets[0]) *bucket = &fi->buckets[
+				CHUNK_BUCKET(r->base, i, FREED_INDEX_BUCKETS)];
+			assert(bucket->size > 0 &&
+			       bucket->array[bucket->size - 1] == pos &&
+			       "freed index bucket out of sync");
+			bucket->size--;
+		}
+		fi->records.size--;
+	}
+}
+
+/* Attempt to find a freed chunk among all transitions on the current branch.
+ * If found, before and after are set to the save points around the transition
+ * which freed it (NULL meaning the current one, or the root, respectively). */
 static struct chunk *find_freed_chunk(struct ls_state *ls, unsigned int addr,
 				      bool in_kernel,
 				      struct hax **before, struct hax **after)
 {
 	struct mem_state *m = in_kernel ? &ls->kern_mem : &ls->user_mem;
+	struct freed_index *fi = m->freed_index;
 
 	*before = NULL;
 	*after = ls->save.current;
 
-	do {
-		struct chunk *c = find_containing_chunk(&m->freed, addr);
-		if (c != NULL) {
-			assert(c->malloc_trace != NULL);
-			assert(c->free_trace != NULL);
-			return c;
-		}
+	if (fi == NULL) {
+		return NULL;
+	}
 
-		/* Walk up the choice tree branch */
-		*before = *after;
-		if (*after != NULL) {
-			*after = (*after)->parent;
-			m = in_kernel ? (*before)->old_kern_mem :
-			                (*before)->old_user_mem;
+	typeof(fi->buckets[0]) *bucket =
+		&fi->buckets[CHUNK_BUCKET(addr, 0, FREED_INDEX_BUCKETS)];
+	for (unsigned int i = bucket->size; i > 0; i--) {
+		struct freed_record *r =
+			ARRAY_LIST_GET(&fi->records, bucket->array[i - 1]);
+		if (addr - r->base < r->len) {
+			/* Walk up the choice tree branch to where it was freed */
+			while (*after != NULL && (*after)->depth >= r->depth) {
+				*before = *after;
+				*after = (*after)->parent;
+			}
+			assert(r->chunk->malloc_trace != NULL);
+			assert(r->chunk->free_trace != NULL);
+			return r->chunk;
 		}
-	} while (*before != NULL);
+	}
 
 	return NULL;
 }
@@ -337,6 +724,108 @@ static void print_freed_chunk_info(struct chunk *c,
 	}
 }
 
+/******************************************************************************
+ * Boot snapshots
+ ******************************************************************************/
+
+static void write_chunks(struct snapshot *s, const struct rb_root *root)
+{
+	unsigned int num_chunks = 0;
+	struct rb_node *nobe;
+
+	for (nobe = rb_first(root); nobe != NULL; nobe = rb_next(nobe)) {
+		num_chunks++;
+	}
+	SNAPSHOT_WRITE(s, num_chunks);
+
+	for (nobe = rb_first(root); nobe != NULL; nobe = rb_next(nobe)) {
+		struct chunk *c = rb_entry(nobe, struct chunk, nobe);
+		SNAPSHOT_WRITE(s, c->base);
+		SNAPSHOT_WRITE(s, c->len);
+		SNAPSHOT_WRITE(s, c->id);
+		SNAPSHOT_WRITE(s, c->pages_reserved_for_malloc);
+		snapshot_write_trace(s, c->malloc_trace);
+		snapshot_write_trace(s, c->free_trace);
+	}
+}
+
+/* Chunks come back in ascending order; for a freed tree, they're also indexed
+ * as freed before the root save point, which is when boot-time frees were. */
+static void read_chunks(struct snapshot *s, struct ls_state *ls,
+			struct mem_state *m, struct rb_root *root, bool freed)
+{
+	unsigned int num_chunks = 0;
+	SNAPSHOT_READ(s, num_chunks);
+
+	for (unsigned int i = 0; i < num_chunks && s->ok; i++) {
+		struct chunk *c = MM_XMALLOC(1, struct chunk);
+		SNAPSHOT_READ(s, c->base);
+		SNAPSHOT_READ(s, c->len);
+		SNAPSHOT_READ(s, c->id);
+		SNAPSHOT_READ(s, c->pages_reserved_for_malloc);
+		c->malloc_trace = snapshot_read_trace(s);
+		c->free_trace = snapshot_read_trace(s);
+		if (freed) {
+			c = insert_chunk(root, c, true);
+			freed_index_add(ls, m, c);
+		} else {
+			insert_chunk(root, c, false);
+		}
+	}
+}
+
+/* The shm set is left out: accesses so far belong to the transition before
+ * the root, which is never checked for conflicts (see shimsham_shm). Nor are
+ * there data races yet, as there's no tree to have found any in. */
+void mem_write_snapshot(struct snapshot *s, const struct mem_state *m)
+{
+	assert(m->data_races.rb_node == NULL && "data races before the test?");
+
+	write_chunks(s, &m->malloc_heap->root);
+	write_chunks(s, &m->palloc_heap->root);
+	write_chunks(s, &m->freed);
+	SNAPSHOT_WRITE(s, m->heap_size);
+	SNAPSHOT_WRITE(s, m->heap_next_id);
+	SNAPSHOT_WRITE(s, m->guest_init_done);
+	SNAPSHOT_WRITE(s, m->in_mm_init);
+#ifndef ALLOW_REENTRANT_MALLOC_FREE
+	SNAPSHOT_WRITE(s, m->flags);
+#endif
+	SNAPSHOT_WRITE(s, m->cr3);
+	SNAPSHOT_WRITE(s, m->cr3_tid);
+	SNAPSHOT_WRITE(s, m->user_mutex_size);
+	SNAPSHOT_WRITE(s, m->during_xchg);
+	SNAPSHOT_WRITE(s, m->last_xchg_read);
+}
+
+/* m must be freshly initialized, as by mem_init. */
+void mem_read_snapshot(struct snapshot *s, struct ls_state *ls,
+		       struct mem_state *m)
+{
+	assert(m->malloc_heap->refcount == 1 &&
+	       m->malloc_heap->root.rb_node == NULL &&
+	       m->palloc_heap->refcount == 1 &&
+	       m->palloc_heap->root.rb_node == NULL &&
+	       m->freed.rb_node == NULL && m->freed_index == NULL &&
+	       "reading a snapshot into an already-used mem state");
+
+	read_chunks(s, ls, m, &m->malloc_heap->root, false);
+	read_chunks(s, ls, m, &m->palloc_heap->root, false);
+	read_chunks(s, ls, m, &m->freed, true);
+	SNAPSHOT_READ(s, m->heap_size);
+	SNAPSHOT_READ(s, m->heap_next_id);
+	SNAPSHOT_READ(s, m->guest_init_done);
+	SNAPSHOT_READ(s, m->in_mm_init);
+#ifndef ALLOW_REENTRANT_MALLOC_FREE
+	SNAPSHOT_READ(s, m->flags);
+#endif
+	SNAPSHOT_READ(s, m->cr3);
+	SNAPSHOT_READ(s, m->cr3_tid);
+	SNAPSHOT_READ(s, m->user_mutex_size);
+	SNAPSHOT_READ(s, m->during_xchg);
+	SNAPSHOT_READ(s, m->last_xchg_read);
+}
+
 /******************************************************************************
  * heap state tracking
  ******************************************************************************/
@@ -347,7 +836,7 @@ static void print_freed_chunk_info(struct chunk *c,
  * and flags depending on which heap (kmalloc, kpalloc, umalloc) is used. */
 #define INIT_PTRS(m, heap, init, alloc, free, reqsize)				\
 	struct mem_state *m = in_kernel ? &ls->kern_mem : &ls->user_mem;	\
-	MAYBE_UNUSED struct rb_root *heap =					\
+	MAYBE_UNUSED struct shared_heap **heap =				\
 		is_palloc ? &m->palloc_heap : &m->malloc_heap;			\
 	MAYBE_UNUSED bool *init  = &m->in_mm_init; /* gross, but harmless. */	\
 	MAYBE_UNUSED bool *alloc = is_palloc ?					\
@@ -416,7 +905,7 @@ static void mem_exit_bad_place(struct ls_state *ls, bool in_kernel, bool is_pall
 		m->heap_size += *request_size;
 		assert(m->heap_next_id != INT_MAX && "need a wider type");
 		m->heap_next_id++;
-		insert_chunk(heap, chunk, false);
+		heap_insert(heap, chunk);
 	}
 
 	*in_alloc = false;
@@ -434,7 +923,8 @@ static void mem_enter_free(struct ls_state *ls, bool in_kernel, bool is_palloc,
 			    *in_alloc ? "Malloc" : "Free");
 	}
 
-	chunk = remove_chunk(heap, base);
+	/* don't break heap sharing for free(NULL) */
+	chunk = base == 0 ? NULL : heap_remove(heap, base);
 
 	if (base == 0) {
 		assert(chunk == NULL);
@@ -470,7 +960,8 @@ static void mem_enter_free(struct ls_state *ls, bool in_kernel, bool is_palloc,
 		m->heap_size -= chunk->len;
 		assert(chunk->free_trace == NULL);
 		chunk->free_trace = stack_trace(ls);
-		insert_chunk(&m->freed, chunk, true);
+		chunk = insert_chunk(&m->freed, chunk, true);
+		freed_index_add(ls, m, chunk);
 	}
 
 	*in_free = true;
@@ -585,6 +1076,22 @@ void mem_update(struct ls_state *ls)
 	}
 }
 
+/* Whether mem_update() would do nothing at the current instruction, assuming
+ * it's not at any annotated eip. */
+bool mem_can_skip_update(struct ls_state *ls)
+{
+	if (!ls->kern_mem.guest_init_done) {
+		return false;
+	} else if (KERNEL_MEMORY(ls->eip)) {
+		return true;
+	} else {
+		/* ignore_user_access() advances the cr3 state machine at any
+		 * user instruction in these states. */
+		return ls->user_mem.cr3 != USER_CR3_WAITING_FOR_THUNDERBIRDS &&
+			ls->user_mem.cr3 != USER_CR3_EXEC_HAPPENED;
+	}
+}
+
 /******************************************************************************
  * recording shm accesses (per-instruction)
  ******************************************************************************/
@@ -614,12 +1121,13 @@ static bool was_freed_remalloced(struct mem_lockset *l0, struct mem_lockset *l1)
 
 /* Actually looking for data races cannot happen until we know the
  * happens-before relationship to previous transitions, in save.c. */
-static void add_lockset_to_shm(struct ls_state *ls, struct mem_access *ma,
-			       struct chunk *c, bool write, bool in_kernel)
+static void add_lockset_to_shm(struct ls_state *ls, struct mem_state *m,
+			       struct mem_access *ma, struct chunk *c,
+			       bool write, bool in_kernel)
 {
-	struct lockset *current_locks =
-		in_kernel ? &ls->sched.cur_agent->kern_locks_held :
-		            &ls->sched.cur_agent->user_locks_held;
+	lockset_id_t current_locks =
+		in_kernel ? ls->sched.cur_agent->kern_locks_held :
+		            ls->sched.cur_agent->user_locks_held;
 	struct mem_lockset *l_old;
 	unsigned int current_syscall = ls->sched.cur_agent->most_recent_syscall;
 	unsigned int called_from     = ls->sched.cur_agent->last_call;
@@ -647,11 +1155,7 @@ static void add_lockset_to_shm(struct ls_state *ls, struct mem_access *ma,
 			/* union ITS old chunk id info into OUR current one */
 			merge_chunk_id_info(&any_cids, &cid, l_prev->any_chunk_ids,
 					    l_prev->chunk_id);
-			lockset_free(&l_prev->locks_held);
-#ifdef PURE_HAPPENS_BEFORE
-			vc_destroy(&l_prev->clock);
-#endif
-			MM_FREE(l_prev);
+			/* its memory is reclaimed with the rest of m's arena */
 			remove_prev = false;
 		}
 
@@ -692,7 +1196,7 @@ static void add_lockset_to_shm(struct ls_state *ls, struct mem_access *ma,
 #endif
 
 		enum lockset_cmp_result r =
-			lockset_compare(current_locks, &l_old->locks_held);
+			lockset_compare(current_locks, l_old->locks_held);
 		if (r == LOCKSETS_SUPSET && write && !l_old->write) {
 			/* e.g. current = L1 + L2; past = L2... BUT, current
 			 * access is a write. while the old one with fewer locks
@@ -728,15 +1232,11 @@ static void add_lockset_to_shm(struct ls_state *ls, struct mem_access *ma,
 		assert(need_add);
 		l_old = Q_GET_TAIL(&ma->locksets);
 		Q_REMOVE(&ma->locksets, l_old, nobe);
-		lockset_free(&l_old->locks_held);
-#ifdef PURE_HAPPENS_BEFORE
-		vc_destroy(&l_old->clock);
-#endif
-		MM_FREE(l_old);
 	}
 
 	if (need_add) {
-		struct mem_lockset *l_new = MM_XMALLOC(1, struct mem_lockset);
+		struct mem_lockset *l_new =
+			ARENA_XMALLOC(&m->shm_arena, 1, struct mem_lockset);
 		l_new->eip = ls->eip;
 		l_new->write = write;
 		l_new->during_init = during_init;
@@ -747,53 +1247,255 @@ static void add_lockset_to_shm(struct ls_state *ls, struct mem_access *ma,
 		l_new->most_recent_syscall = current_syscall;
 		l_new->any_chunk_ids = any_cids;
 		l_new->chunk_id = cid;
-		lockset_clone(&l_new->locks_held, current_locks);
+		l_new->locks_held = current_locks;
 #ifdef PURE_HAPPENS_BEFORE
-		vc_copy(&l_new->clock, &ls->sched.cur_agent->clock);
+		struct agent *a = ls->sched.cur_agent;
+		if (m->last_arena_clock.s == NULL ||
+		    !vc_eq(&m->last_arena_clock, &a->clock)) {
+			vc_copy_arena(&m->last_arena_clock, &a->clock,
+				      &m->shm_arena);
+		}
+		l_new->clock = m->last_arena_clock;
+		l_new->epoch = vc_epoch(&a->clock, a->tid);
 #endif
 		Q_INSERT_FRONT(&ma->locksets, l_new, nobe);
 	}
 }
 
-#define MEM_ENTRY(rb) \
-	((rb) == NULL ? NULL : rb_entry(rb, struct mem_access, nobe))
+/******************************************************************************
+ * shm sets
+ ******************************************************************************/
 
-static void add_shm(struct ls_state *ls, struct mem_state *m, struct chunk *c,
-		    unsigned int addr, bool write, bool in_kernel)
+#define SHM_SET_INIT_CAPACITY 64
+
+void shm_set_init(struct shm_set *s)
 {
-	struct rb_node **p = &m->shm.rb_node;
-	struct rb_node *parent = NULL;
-	struct mem_access *ma;
+	s->table = NULL;
+	s->capacity = 0;
+	s->size = 0;
+	s->sorted = NULL;
+	s->num_ranges = 0;
+	s->sorted_capacity = 0;
+	s->frozen = true; /* trivially */
+	s->any_other_tid = false;
+}
 
-	while (*p != NULL) {
-		parent = *p;
-		ma = MEM_ENTRY(parent);
+/* The mem_accesses themselves live in the mem_state's arena. */
+void shm_set_free(struct shm_set *s)
+{
+	MM_FREE(s->table);
+	MM_FREE(s->sorted);
+	shm_set_init(s);
+}
 
-		if (addr < ma->addr) {
-			p = &(*p)->rb_left;
-		} else if (addr > ma->addr) {
-			p = &(*p)->rb_right;
+static unsigned int shm_hash(unsigned int addr, unsigned int capacity)
+{
+	/* word-aligned accesses are the norm; scramble the low bits. */
+	addr ^= addr >> 16;
+	addr *= 0x45d9f3b;
+	addr ^= addr >> 16;
+	return addr & (capacity - 1);
+}
+
+static struct mem_access **shm_set_slot(struct shm_set *s, unsigned int addr)
+{
+	unsigned int i = shm_hash(addr, s->capacity);
+
+	assert(s->capacity > 0);
+	/* the table is never more than half full, so this terminates */
+	while (s->table[i] != NULL && s->table[i]->addr != addr) {
+		i = (i + 1) & (s->capacity - 1);
+	}
+	return &s->table[i];
+}
+
+static struct mem_access *shm_set_lookup(struct shm_set *s, unsigned int addr)
+{
+	return s->size == 0 ? NULL : *shm_set_slot(s, addr);
+}
+
+static void shm_set_insert(struct shm_set *s, struct mem_access *ma)
+{
+	if (2 * (s->size + 1) > s->capacity) {
+		struct mem_access **old_table = s->table;
+		unsigned int old_capacity = s->capacity;
+
+		s->capacity = old_capacity == 0 ?
+			SHM_SET_INIT_CAPACITY : 2 * old_capacity;
+		assert(s->capacity > old_capacity && "shm set too big");
+		s->table = MM_XMALLOC(s->capacity, struct mem_access *);
+		memset(s->table, 0, s->capacity * sizeof(struct mem_access *));
+		for (unsigned int i = 0; i < old_capacity; i++) {
+			if (old_table[i] != NULL) {
+				*shm_set_slot(s, old_table[i]->addr) = old_table[i];
+			}
+		}
+		MM_FREE(old_table);
+	}
+
+	struct mem_access **slot = shm_set_slot(s, ma->addr);
+	assert(*slot == NULL && "double insert into shm set");
+	*slot = ma;
+	s->size++;
+	s->frozen = false;
+}
+
+static unsigned int shm_summary_bit(unsigned int addr)
+{
+	return shm_hash(addr >> SHM_SUMMARY_GRANULE_SHIFT, SHM_SUMMARY_BITS);
+}
+
+static unsigned int shm_entry_last(const struct shm_entry *e)
+{
+	return e->addr + (e->len - 1); /* inclusive, lest it overflow */
+}
+
+/* expects s->sorted to be populated, sorted, and coalesced already */
+static void compute_shm_summary(struct shm_set *s)
+{
+	struct shm_summary *sum = &s->summary;
+	unsigned int n = s->num_ranges;
+
+	sum->min_addr = n == 0 ? 0 : s->sorted[0].addr;
+	sum->max_addr = n == 0 ? 0 : shm_entry_last(&s->sorted[n - 1]);
+	bitset_clear_all(sum->accessed, SHM_SUMMARY_BITS);
+	bitset_clear_all(sum->written, SHM_SUMMARY_BITS);
+	for (unsigned int i = 0; i < n; i++) {
+		const struct shm_entry *e = &s->sorted[i];
+		unsigned int first = e->addr >> SHM_SUMMARY_GRANULE_SHIFT;
+		unsigned int last = shm_entry_last(e) >> SHM_SUMMARY_GRANULE_SHIFT;
+		for (unsigned int g = first; g - first <= last - first; g++) {
+			unsigned int bit = shm_hash(g, SHM_SUMMARY_BITS);
+			bitset_set(sum->accessed, bit, true);
+			if (e->any_writes) {
+				bitset_set(sum->written, bit, true);
+			}
+		}
+	}
+}
+
+static int shm_entry_cmp(const void *a, const void *b)
+{
+	unsigned int addr_a = ((const struct shm_entry *)a)->addr;
+	unsigned int addr_b = ((const struct shm_entry *)b)->addr;
+	return addr_a < addr_b ? -1 : addr_a > addr_b ? 1 : 0;
+}
+
+static bool mem_lockset_eq(struct mem_lockset *l0, struct mem_lockset *l1)
+{
+	return l0->eip == l1->eip && l0->last_call == l1->last_call &&
+		l0->most_recent_syscall == l1->most_recent_syscall &&
+		l0->write == l1->write && l0->during_init == l1->during_init &&
+		l0->during_destroy == l1->during_destroy &&
+		l0->interrupce_enabled == l1->interrupce_enabled &&
+		l0->during_txn == l1->during_txn &&
+		l0->any_chunk_ids == l1->any_chunk_ids &&
+		l0->chunk_id == l1->chunk_id &&
+		l0->locks_held == l1->locks_held
+#ifdef PURE_HAPPENS_BEFORE
+		&& l0->epoch.index == l1->epoch.index
+		&& l0->epoch.timestamp == l1->epoch.timestamp
+		&& vc_eq(&l0->clock, &l1->clock)
+#endif
+		;
+}
+
+/* Would conflict and data race detection treat accesses to these two addresses
+ * exactly alike? (If so, they can share a range in the frozen set.) */
+static bool mem_access_eq(struct mem_access *ma0, struct mem_access *ma1)
+{
+	struct mem_lockset *l0 = Q_GET_HEAD(&ma0->locksets);
+	struct mem_lockset *l1 = Q_GET_HEAD(&ma1->locksets);
+
+	if (ma0->any_writes != ma1->any_writes ||
+	    ma0->other_tid != ma1->other_tid) {
+		return false;
+	}
+	while (l0 != NULL && l1 != NULL) {
+		if (!mem_lockset_eq(l0, l1)) {
+			return false;
+		}
+		l0 = Q_GET_NEXT(l0, nobe);
+		l1 = Q_GET_NEXT(l1, nobe);
+	}
+	return l0 == NULL && l1 == NULL;
+}
+
+void shm_set_freeze(struct shm_set *s)
+{
+	unsigned int n = 0;
+
+	if (s->frozen) {
+		return;
+	}
+
+	if (s->sorted_capacity < s->size) {
+		MM_FREE(s->sorted);
+		s->sorted = MM_XMALLOC(s->size, struct shm_entry);
+		s->sorted_capacity = s->size;
+	}
+
+	s->any_other_tid = false;
+	for (unsigned int i = 0; i < s->capacity; i++) {
+		struct mem_access *ma = s->table[i];
+		if (ma != NULL) {
+			s->sorted[n].addr       = ma->addr;
+			s->sorted[n].len        = 1;
+			s->sorted[n].any_writes = ma->any_writes;
+			s->sorted[n].other_tid  = ma->other_tid;
+			s->sorted[n].ma         = ma;
+			s->any_other_tid = s->any_other_tid || ma->other_tid != 0;
+			n++;
+		}
+	}
+	assert(n == s->size);
+
+	qsort(s->sorted, n, sizeof(struct shm_entry), shm_entry_cmp);
+
+	/* coalesce runs of adjacent, indistinguishable accesses */
+	s->num_ranges = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		struct shm_entry *last = s->num_ranges == 0 ? NULL :
+			&s->sorted[s->num_ranges - 1];
+		if (last != NULL &&
+		    shm_entry_last(last) + 1 == s->sorted[i].addr &&
+		    mem_access_eq(last->ma, s->sorted[i].ma)) {
+			last->len++;
 		} else {
-			/* access already exists */
-			ma->count++;
-			ma->any_writes = ma->any_writes || write;
-			add_lockset_to_shm(ls, ma, c, write, in_kernel);
-			return;
+			s->sorted[s->num_ranges++] = s->sorted[i];
 		}
 	}
 
+	compute_shm_summary(s);
+	s->frozen = true;
+}
+
+static void add_shm(struct ls_state *ls, struct mem_state *m, struct chunk *c,
+		    unsigned int addr, bool write, bool in_kernel)
+{
+	struct mem_access *ma = shm_set_lookup(&m->shm, addr);
+
+	if (ma != NULL) {
+		/* access already exists */
+		ma->count++;
+		ma->any_writes = ma->any_writes || write;
+		add_lockset_to_shm(ls, m, ma, c, write, in_kernel);
+		/* in case this is a saved one (see mem_check_shared_access) */
+		m->shm.frozen = false;
+		return;
+	}
+
 	/* doesn't exist; create a new one */
-	ma = MM_XMALLOC(1, struct mem_access);
+	ma = ARENA_XMALLOC(&m->shm_arena, 1, struct mem_access);
 	ma->addr       = addr;
 	ma->any_writes = write;
 	ma->count      = 1;
 	ma->conflict   = false;
 	ma->other_tid  = 0;
 	Q_INIT_HEAD(&ma->locksets);
-	add_lockset_to_shm(ls, ma, c, write, in_kernel);
+	add_lockset_to_shm(ls, m, ma, c, write, in_kernel);
 
-	rb_link_node(&ma->nobe, parent, p);
-	rb_insert_color(&ma->nobe, &m->shm);
+	shm_set_insert(&m->shm, ma);
 }
 
 static void use_after_free(struct ls_state *ls, unsigned int addr,
@@ -813,11 +1515,11 @@ static void use_after_free(struct ls_state *ls, unsigned int addr,
 
 	// TODO: do something analogous to a wrong_panic() assert here
 	lsprintf(BUG, "Malloc() heap contents: {");
-	print_heap(BUG, m->malloc_heap.rb_node, true);
+	print_heap(BUG, m->malloc_heap->root.rb_node, true);
 	printf(BUG, "}\n");
-	if (m->palloc_heap.rb_node != NULL) {
+	if (m->palloc_heap->root.rb_node != NULL) {
 		lsprintf(BUG, "Palloc() heap contents: {");
-		print_heap(BUG, m->palloc_heap.rb_node, true);
+		print_heap(BUG, m->palloc_heap->root.rb_node, true);
 		printf(BUG, "}\n");
 	}
 
@@ -975,7 +1677,11 @@ void mem_check_shared_access(struct ls_state *ls, unsigned int phys_addr,
 			 * "intermediate" thread during a schedule-in-flight,
 			 * i.e., this thread wasn't the one that ran last. */
 			return;
-		} else if (in_kernel) {
+		}
+		/* The last transition's shm set is being intersected with
+		 * its ancestors' in the background; let that finish first. */
+		save_finish_analysis(&ls->save, ls);
+		if (in_kernel) {
 			m = ls->save.current->old_kern_mem;
 		} else {
 			m = ls->save.current->old_user_mem;
@@ -1020,7 +1726,7 @@ void mem_check_shared_access(struct ls_state *ls, unsigned int phys_addr,
 
 	if ((in_kernel && kern_address_in_heap(addr)) ||
 	    (!in_kernel && user_address_in_heap(addr))) {
-		struct chunk *c = find_alloced_chunk(m, addr);
+		struct chunk *c = find_alloced_chunk_cached(ls, m, addr, in_kernel);
 		if (c == NULL) {
 			use_after_free(ls, addr, write, KERNEL_MEMORY(addr));
 		} else if (do_add_shm) {
@@ -1049,18 +1755,7 @@ void mem_check_shared_access(struct ls_state *ls, unsigned int phys_addr,
 
 bool shm_contains_addr(struct mem_state *m, unsigned int addr)
 {
-	struct mem_access *ma = MEM_ENTRY(m->shm.rb_node);
-
-	while (ma != NULL) {
-		if (addr == ma->addr) {
-			return true;
-		} else if (addr < ma->addr) {
-			ma = MEM_ENTRY(ma->nobe.rb_left);
-		} else {
-			ma = MEM_ENTRY(ma->nobe.rb_right);
-		}
-	}
-	return false;
+	return shm_set_lookup(&m->shm, addr) != NULL;
 }
 
 /******************************************************************************
@@ -1111,49 +1806,104 @@ static void print_shm_conflict(verbosity v, struct mem_state *m0, struct mem_sta
 
 #define MAX_CONFLICTS 10
 
-static void check_stack_conflict(struct mem_access *ma, unsigned int other_tid,
-				 unsigned int *conflicts)
+static void add_conflict(shm_conflict_list_t *conflicts, int type,
+			 struct mem_access *ma0, struct mem_access *ma1,
+			 struct chunk *c0, struct chunk *c1,
+			 unsigned int other_tid, unsigned int addr,
+			 unsigned int last)
+{
+	struct shm_conflict conflict;
+	conflict.type = type;
+	conflict.ma0 = ma0;
+	conflict.ma1 = ma1;
+	conflict.c0 = c0;
+	conflict.c1 = c1;
+	conflict.other_tid = other_tid;
+	conflict.addr = addr;
+	conflict.len = last - addr + 1;
+	ARRAY_LIST_APPEND(conflicts, conflict);
+}
+
+/* The access recorded for a byte within one of a frozen set's ranges. */
+static struct mem_access *shm_access_at(struct shm_set *s,
+					const struct shm_entry *e,
+					unsigned int addr)
 {
-	/* The motivation for this function is that, as an optimisation, we
+	if (addr == e->addr) {
+		return e->ma;
+	}
+	struct mem_access *ma = shm_set_lookup(s, addr);
+	assert(ma != NULL && "shm range has a hole in it");
+	return ma;
+}
+
+/* Returns the lowest chunk overlapping [addr, last], if any. */
+static struct chunk *find_first_chunk_within(struct rb_root *root,
+					     unsigned int addr,
+					     unsigned int last)
+{
+	struct rb_node *p = root->rb_node;
+	struct chunk *first = NULL;
+
+	while (p != NULL) {
+		struct chunk *c = rb_entry(p, struct chunk, nobe);
+		if (c->base + c->len <= addr) {
+			p = p->rb_right;
+		} else {
+			first = c;
+			p = p->rb_left;
+		}
+	}
+	return first != NULL && first->base <= last ? first : NULL;
+}
+
+/* Checks the bytes [addr, last] of e, accessed by one transition (in m) but not
+ * by the other (in m_other, by other_tid), for conflicts nonetheless. */
+static void check_unmatched(struct mem_state *m, const struct shm_entry *e,
+			    unsigned int addr, unsigned int last,
+			    struct mem_state *m_other, unsigned int other_tid,
+			    shm_conflict_list_t *conflicts)
+{
+	/* The motivation for this check is that, as an optimisation, we
 	 * don't record shm accesses to a thread's own stack. The flip-side of
 	 * this is that if another thread accesses your stack, it is guaranteed
 	 * to be a conflict, and also won't be recorded in your transitions. So
 	 * we have to check every recorded access that doesn't match. */
-	if (ma->other_tid == other_tid) {
-		if (*conflicts < MAX_CONFLICTS) {
-			if (*conflicts > 0) {
-				printf(DEV, ", ");
-			}
-			struct mem_lockset *l = Q_GET_HEAD(&ma->locksets);
-			assert(l != NULL);
-			printf(DEV, "[tid%d stack %c%d 0x%x]", other_tid,
-			       ma->any_writes ? 'w' : 'r', ma->count, l->eip);
-		}
-		ma->conflict = true;
-		(*conflicts)++;
+	if (e->other_tid == other_tid) {
+		add_conflict(conflicts, SHM_CONFLICT_STACK,
+			     shm_access_at(&m->shm, e, addr), NULL, NULL, NULL,
+			     other_tid, addr, last);
+	}
+
+	// FIXME: Unimplemented for the palloc heap. What are the consequences?
+	struct chunk *c = find_first_chunk_within(&m_other->freed, addr, last);
+	if (c != NULL) {
+		unsigned int first = MAX(addr, c->base);
+		unsigned int c_last = c->base + (c->len - 1);
+		add_conflict(conflicts, SHM_CONFLICT_FREED,
+			     shm_access_at(&m->shm, e, first), NULL, NULL, c,
+			     other_tid, first, MIN(last, c_last));
 	}
 }
 
-static void check_freed_conflict(struct mem_access *ma0, struct mem_state *m1,
-				 unsigned int other_tid, unsigned int *conflicts)
+static void print_stack_conflict(struct shm_conflict *conflict)
 {
-	// FIXME: Unimplemented for the palloc heap. What are the consequences?
-	struct chunk *c = find_containing_chunk(&m1->freed, ma0->addr);
+	struct mem_access *ma = conflict->ma0;
+	struct mem_lockset *l = Q_GET_HEAD(&ma->locksets);
+	assert(l != NULL);
+	printf(DEV, "[tid%d stack %c%d 0x%x]", conflict->other_tid,
+	       ma->any_writes ? 'w' : 'r', ma->count, l->eip);
+}
 
-	if (c != NULL) {
-		char buf[BUF_SIZE];
-		print_heap_address(buf, BUF_SIZE, ma0->addr, c->base, c->len);
+static void print_freed_conflict(struct shm_conflict *conflict)
+{
+	struct mem_access *ma0 = conflict->ma0;
+	struct chunk *c = conflict->c1;
+	char buf[BUF_SIZE];
 
-		if (*conflicts < MAX_CONFLICTS) {
-			if (*conflicts > 0) {
-				printf(DEV, ", ");
-			}
-			printf(DEV, "[%s %c%d (tid%d freed)]", buf,
-			       ma0->any_writes ? 'w' : 'r', ma0->count, other_tid);
-		}
-		ma0->conflict = true;
-		(*conflicts)++;
-	}
+	print_heap_address(buf, BUF_SIZE, ma0->addr, c->base, c->len);
+	printf(DEV, "[%s %c%d (tid%d freed)]", buf,
+	       ma0->any_writes ? 'w' : 'r', ma0->count, conflict->other_tid);
 }
 
 static void print_data_race(struct ls_state *ls, struct hax *h0, struct hax *h1,
@@ -1194,14 +1944,14 @@ static void print_data_race(struct ls_state *ls, struct hax *h0, struct hax *h1,
 	print_eip(v, l0->eip);
 
 	printf(v, " [locks: ");
-	lockset_print(v, &l0->locks_held);
+	lockset_print(v, l0->locks_held);
 	printf(v, "]%s and \n", l0->interrupce_enabled ? "" : " (cli'd)");
 
 	lsprintf(v, "%s", colour);
 	printf(v, "#%d/tid%d at ", h1->depth, h1->chosen_thread);
 	print_eip(v, l1->eip);
 	printf(v, " [locks: ");
-	lockset_print(v, &l1->locks_held);
+	lockset_print(v, l1->locks_held);
 	printf(v, "]%s\n", l1->interrupce_enabled ? "" : " (cli'd)");
 
 	lsprintf(DEV, "Num data races suspected: %d; confirmed: %d\n",
@@ -1362,10 +2112,10 @@ static void check_locksets(struct ls_state *ls, struct hax *h0, struct hax *h1,
 			if ((l0->write || l1->write)
 #ifdef PURE_HAPPENS_BEFORE
 			    /* l1 is the older transition */
-			    && !vc_happens_before(&l1->clock, &l0->clock)
+			    && !vc_epoch_happens_before(l1->epoch, &l0->clock)
 #endif
 			    /* with pure HB, the above check subsumes this one */
-			    && !lockset_intersect(&l0->locks_held, &l1->locks_held)
+			    && !lockset_intersect(l0->locks_held, l1->locks_held)
 			    && (l0->interrupce_enabled || l1->interrupce_enabled)
 			    && !(l0->during_txn && l1->during_txn)
 			    && !ignore_dr_function(l0->eip)
@@ -1383,83 +2133,259 @@ static void check_locksets(struct ls_state *ls, struct hax *h0, struct hax *h1,
 	}
 }
 
-/* Compute the intersection of two transitions' shm accesses */
-bool mem_shm_intersect(struct ls_state *ls, struct hax *h0, struct hax *h1,
-		       bool in_kernel)
+/* Can accesses in m's shm set that have no counterpart in m_other's be skipped
+ * over without looking at each one? (i.e., would check_unmatched be a no-op
+ * for all of them?) */
+static bool can_skip_unmatched(struct mem_state *m, struct mem_state *m_other,
+			       unsigned int other_tid)
+{
+	return m_other->freed.rb_node == NULL &&
+		!m->shm.any_other_tid && other_tid != 0;
+}
+
+/* Returns the index of the first entry, at or after i, whose range ends at or
+ * after addr. Gallops, so that skipping a long run in a big set when the other
+ * set is small is logarithmic in the run length rather than linear. */
+static unsigned int shm_gallop(const struct shm_entry *e, unsigned int i,
+			       unsigned int n, unsigned int addr)
+{
+	unsigned int lo = i;
+	unsigned int hi = i;
+	unsigned int step = 1;
+
+	/* find a range [lo, hi) in which the answer lies */
+	while (hi < n && shm_entry_last(&e[hi]) < addr) {
+		lo = hi + 1;
+		hi += step;
+		step *= 2;
+	}
+	if (hi > n) {
+		hi = n;
+	}
+	/* then binary search it */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (shm_entry_last(&e[mid]) < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Conservatively, could mem_shm_intersect find any conflicts between these two
+ * transitions? If not, it needn't be called at all. This is exact about the
+ * stack and freed-chunk checks, and uses the sets' summaries for the rest: a
+ * conflict needs some address written by one and accessed by the other. */
+bool mem_shm_may_conflict(struct hax *h0, struct hax *h1, bool in_kernel)
+{
+	struct mem_state *m0 = in_kernel ? h0->old_kern_mem : h0->old_user_mem;
+	struct mem_state *m1 = in_kernel ? h1->old_kern_mem : h1->old_user_mem;
+
+	shm_set_freeze(&m0->shm);
+	shm_set_freeze(&m1->shm);
+	if (!can_skip_unmatched(m0, m1, h1->chosen_thread) ||
+	    !can_skip_unmatched(m1, m0, h0->chosen_thread)) {
+		return true;
+	}
+
+	struct shm_summary *s0 = &m0->shm.summary;
+	struct shm_summary *s1 = &m1->shm.summary;
+
+	if (m0->shm.num_ranges == 0 || m1->shm.num_ranges == 0 ||
+	    s0->max_addr < s1->min_addr || s1->max_addr < s0->min_addr) {
+		return false;
+	}
+
+	for (unsigned int w = 0; w < SHM_SUMMARY_WORDS; w++) {
+		if ((s0->written[w] & s1->accessed[w]) != 0 ||
+		    (s0->accessed[w] & s1->written[w]) != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Compute the intersection of two transitions' shm accesses, appending each
+ * conflict found to the given list. This reads only the two transitions' saved
+ * state, which nothing else changes once they are in the tree, so it is safe
+ * to call off the main thread; see mem_shm_report_conflicts for the rest.
+ * Works on the sets' ranges, not individual bytes; each conflict found covers
+ * the bytes of the overlap (or the unmatched part) of one or two ranges. */
+bool mem_shm_intersect(struct hax *h0, struct hax *h1, bool in_kernel,
+		       shm_conflict_list_t *conflicts)
 {
 	struct mem_state *m0 = in_kernel ? h0->old_kern_mem : h0->old_user_mem;
 	struct mem_state *m1 = in_kernel ? h1->old_kern_mem : h1->old_user_mem;
 	unsigned int tid0 = h0->chosen_thread;
 	unsigned int tid1 = h1->chosen_thread;
 
-	struct mem_access *ma0 = MEM_ENTRY(rb_first(&m0->shm));
-	struct mem_access *ma1 = MEM_ENTRY(rb_first(&m1->shm));
-	unsigned int conflicts = 0;
+	shm_set_freeze(&m0->shm);
+	shm_set_freeze(&m1->shm);
+	const struct shm_entry *e0 = m0->shm.sorted;
+	const struct shm_entry *e1 = m1->shm.sorted;
+	unsigned int n0 = m0->shm.num_ranges;
+	unsigned int n1 = m1->shm.num_ranges;
+	unsigned int i0 = 0;
+	unsigned int i1 = 0;
+	/* the first byte of e0[i0] (resp. e1[i1]) not yet looked at */
+	unsigned int pos0 = n0 == 0 ? 0 : e0[0].addr;
+	unsigned int pos1 = n1 == 0 ? 0 : e1[0].addr;
+	bool skip0 = can_skip_unmatched(m0, m1, tid1);
+	bool skip1 = can_skip_unmatched(m1, m0, tid0);
+	unsigned int old_size = ARRAY_LIST_SIZE(conflicts);
 
 	assert(h0->depth > h1->depth);
-	assert(!h0->happens_before[h1->depth]);
+	assert(!bitset_get(h0->happens_before, h1->depth));
 	assert(h0->chosen_thread != h1->chosen_thread);
 
 	/* Should not even be called for the -space not being tested. */
 	assert(in_kernel != testing_userspace());
 
-	lsprintf(DEV, "Intersecting transition %d (TID %d) with %d (TID %d): {",
-		 h0->depth, tid0, h1->depth, tid1);
-
-	while (ma0 != NULL && ma1 != NULL) {
-		if (ma0->addr < ma1->addr) {
-			check_stack_conflict(ma0, tid1, &conflicts);
-			check_freed_conflict(ma0, m1, tid1, &conflicts);
-			/* advance ma0 */
-			ma0 = MEM_ENTRY(rb_next(&ma0->nobe));
-		} else if (ma0->addr > ma1->addr) {
-			check_stack_conflict(ma1, tid0, &conflicts);
-			check_freed_conflict(ma1, m0, tid0, &conflicts);
-			/* advance ma1 */
-			ma1 = MEM_ENTRY(rb_next(&ma1->nobe));
+	void next0(unsigned int i)
+	{
+		i0 = i;
+		if (i0 < n0) {
+			pos0 = e0[i0].addr;
+		}
+	}
+	void next1(unsigned int i)
+	{
+		i1 = i;
+		if (i1 < n1) {
+			pos1 = e1[i1].addr;
+		}
+	}
+
+	while (i0 < n0 && i1 < n1) {
+		unsigned int last0 = shm_entry_last(&e0[i0]);
+		unsigned int last1 = shm_entry_last(&e1[i1]);
+
+		if (last0 < pos1) {
+			/* the rest of ma0's range has no match */
+			if (skip0) {
+				next0(shm_gallop(e0, i0, n0, pos1));
+				continue;
+			}
+			check_unmatched(m0, &e0[i0], pos0, last0, m1, tid1,
+					conflicts);
+			next0(i0 + 1);
+		} else if (last1 < pos0) {
+			/* the rest of ma1's range has no match */
+			if (skip1) {
+				next1(shm_gallop(e1, i1, n1, pos0));
+				continue;
+			}
+			check_unmatched(m1, &e1[i1], pos1, last1, m0, tid0,
+					conflicts);
+			next1(i1 + 1);
 		} else {
-			/* found a match; advance both */
-			if (ma0->any_writes || ma1->any_writes) {
-				struct chunk *c0 = find_alloced_chunk(m0, ma0->addr);
-				struct chunk *c1 = find_alloced_chunk(m1, ma1->addr);
-				if (conflicts < MAX_CONFLICTS) {
-					if (conflicts > 0) {
-						printf(DEV, ", ");
-					}
-					/* the match is also a conflict */
-					print_shm_conflict(DEV, m0, m1,
-							   ma0, ma1, c0, c1);
+			/* the ranges overlap; first dispose of the part of
+			 * whichever starts earlier that has no match */
+			if (pos0 < pos1) {
+				if (!skip0) {
+					check_unmatched(m0, &e0[i0], pos0,
+							pos1 - 1, m1, tid1,
+							conflicts);
 				}
-				conflicts++;
-				ma0->conflict = true;
-				ma1->conflict = true;
-#ifndef PREEMPT_EVERYWHERE
-				// FIXME: make this not interleave horribly with conflicts
-				check_locksets(ls, h0, h1, ma0, ma1, c0, c1, in_kernel);
-#endif
+				pos0 = pos1;
+			} else if (pos1 < pos0) {
+				if (!skip1) {
+					check_unmatched(m1, &e1[i1], pos1,
+							pos0 - 1, m0, tid0,
+							conflicts);
+				}
+				pos1 = pos0;
+			}
+
+			/* found a match, [pos0, last]; advance past it */
+			unsigned int last = MIN(last0, last1);
+			if (e0[i0].any_writes || e1[i1].any_writes) {
+				/* the match is also a conflict */
+				struct mem_access *ma0 =
+					shm_access_at(&m0->shm, &e0[i0], pos0);
+				struct mem_access *ma1 =
+					shm_access_at(&m1->shm, &e1[i1], pos1);
+				add_conflict(conflicts, SHM_CONFLICT_MATCH,
+					     ma0, ma1,
+					     find_alloced_chunk(m0, pos0),
+					     find_alloced_chunk(m1, pos1),
+					     0, pos0, last);
+			}
+			if (last0 == last) {
+				next0(i0 + 1);
+			} else {
+				pos0 = last + 1;
+			}
+			if (last1 == last) {
+				next1(i1 + 1);
+			} else {
+				pos1 = last + 1;
 			}
-			ma0 = MEM_ENTRY(rb_next(&ma0->nobe));
-			ma1 = MEM_ENTRY(rb_next(&ma1->nobe));
 		}
 	}
 
 	/* even if one transition runs out of recorded accesses, we still need
 	 * to check the other one's remaining accesses for the one's stack. */
-	while (ma0 != NULL) {
-		check_stack_conflict(ma0, tid1, &conflicts);
-		check_freed_conflict(ma0, m1, tid1, &conflicts);
-		ma0 = MEM_ENTRY(rb_next(&ma0->nobe));
+	for (; i0 < n0 && !skip0; next0(i0 + 1)) {
+		check_unmatched(m0, &e0[i0], pos0, shm_entry_last(&e0[i0]),
+				m1, tid1, conflicts);
+	}
+	for (; i1 < n1 && !skip1; next1(i1 + 1)) {
+		check_unmatched(m1, &e1[i1], pos1, shm_entry_last(&e1[i1]),
+				m0, tid0, conflicts);
 	}
-	while (ma1 != NULL) {
-		check_stack_conflict(ma1, tid0, &conflicts);
-		check_freed_conflict(ma1, m0, tid0, &conflicts);
-		ma1 = MEM_ENTRY(rb_next(&ma1->nobe));
+
+	return ARRAY_LIST_SIZE(conflicts) > old_size;
+}
+
+/* Prints the conflicts mem_shm_intersect found between two transitions, and
+ * checks the matching accesses among them for data races. Must be called on
+ * the main thread, in the same order the intersections were made in. */
+void mem_shm_report_conflicts(struct ls_state *ls, struct hax *h0,
+			      struct hax *h1, bool in_kernel,
+			      struct shm_conflict *conflicts,
+			      unsigned int num_conflicts)
+{
+	struct mem_state *m0 = in_kernel ? h0->old_kern_mem : h0->old_user_mem;
+	struct mem_state *m1 = in_kernel ? h1->old_kern_mem : h1->old_user_mem;
+
+	lsprintf(DEV, "Intersecting transition %d (TID %d) with %d (TID %d): {",
+		 h0->depth, h0->chosen_thread, h1->depth, h1->chosen_thread);
+
+	for (unsigned int i = 0; i < num_conflicts; i++) {
+		struct shm_conflict *conflict = &conflicts[i];
+		if (i < MAX_CONFLICTS) {
+			if (i > 0) {
+				printf(DEV, ", ");
+			}
+			if (conflict->type == SHM_CONFLICT_MATCH) {
+				print_shm_conflict(DEV, m0, m1, conflict->ma0,
+						   conflict->ma1, conflict->c0,
+						   conflict->c1);
+			} else if (conflict->type == SHM_CONFLICT_STACK) {
+				print_stack_conflict(conflict);
+			} else {
+				print_freed_conflict(conflict);
+			}
+			if (conflict->len > 1) {
+				printf(DEV, "x%u", conflict->len);
+			}
+		}
+		conflict->ma0->conflict = true;
+		if (conflict->type == SHM_CONFLICT_MATCH) {
+			conflict->ma1->conflict = true;
+#ifndef PREEMPT_EVERYWHERE
+			// FIXME: make this not interleave horribly with conflicts
+			check_locksets(ls, h0, h1, conflict->ma0, conflict->ma1,
+				       conflict->c0, conflict->c1, in_kernel);
+#endif
+		}
 	}
 
-	if (conflicts > MAX_CONFLICTS) {
-		printf(DEV, ", and %d more", conflicts - MAX_CONFLICTS);
+	if (num_conflicts > MAX_CONFLICTS) {
+		printf(DEV, ", and %d more", num_conflicts - MAX_CONFLICTS);
 	}
 	printf(DEV, "}\n");
-
-	return conflicts > 0;
 }
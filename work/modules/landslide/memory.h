@@ -9,12 +9,17 @@
 
 #include <simics/api.h> /* for bool, of all things... */
 
+#include "arena.h"
+#include "array_list.h"
 #include "lockset.h"
 #include "rbtree.h"
 #include "vector_clock.h"
 #include "variable_queue.h"
 
+struct freed_index;
 struct hax;
+struct heap_index;
+struct snapshot;
 struct stack_trace;
 
 /******************************************************************************
@@ -39,9 +44,10 @@ struct mem_lockset {
 	 * ids may appear; if so, we fall back to false-positiving. */
 	enum chunk_id_info any_chunk_ids;
 	unsigned int chunk_id;
-	struct lockset locks_held;
+	lockset_id_t locks_held;
 #ifdef PURE_HAPPENS_BEFORE
 	struct vector_clock clock;
+	struct epoch epoch; /* of the accessing thread, in the above */
 #endif
 	Q_NEW_LINK(struct mem_lockset) nobe;
 };
@@ -60,7 +66,49 @@ struct mem_access {
 	int count;         /* how many times accessed? (stats) */
 	bool conflict;     /* does this conflict with another transition? (stats) */
 	struct mem_locksets locksets; /* distinct locksets used while accessing */
-	struct rb_node nobe;
+};
+
+/* The per-transition set of mem_accesses. It's write-only while the transition
+ * runs, so accesses are found by hashing their addresses (open addressing, no
+ * ordering). Afterwards it's read-only (almost -- see mem_check_shared_access),
+ * and gets intersected with every ancestor's, so it's frozen into an array of
+ * compact entries sorted by address, which the intersection walks linearly.
+ * Any later insertion unfreezes it, and the array is rebuilt on demand.
+ * Runs of adjacent bytes whose accesses are indistinguishable to conflict and
+ * data race detection (as after a memset or a copy to/from userspace) are
+ * frozen into a single entry, covering [addr, addr + len). */
+struct shm_entry {
+	unsigned int addr;
+	unsigned int len;
+	bool any_writes;
+	int other_tid;
+	struct mem_access *ma; /* of the first byte */
+};
+
+/* Summary of which addresses a frozen shm set touches, for ruling out
+ * conflicts with another set without walking either. Each bloom filter bit
+ * stands for every SHM_SUMMARY_GRANULE-byte block that hashes to it. */
+#define SHM_SUMMARY_GRANULE_SHIFT 6
+#define SHM_SUMMARY_BITS 1024
+#define SHM_SUMMARY_WORDS (SHM_SUMMARY_BITS / 64)
+
+struct shm_summary {
+	unsigned int min_addr;
+	unsigned int max_addr;
+	uint64_t accessed[SHM_SUMMARY_WORDS];
+	uint64_t written[SHM_SUMMARY_WORDS];
+};
+
+struct shm_set {
+	struct mem_access **table; /* NULL slots are empty */
+	unsigned int capacity;     /* power of 2, or 0 if nothing allocated */
+	unsigned int size;
+	struct shm_entry *sorted;  /* of length num_ranges, when frozen */
+	unsigned int num_ranges;
+	unsigned int sorted_capacity;
+	bool frozen;
+	bool any_other_tid;        /* whether any entry's other_tid is nonzero */
+	struct shm_summary summary; /* valid when frozen */
 };
 
 /* represents two instructions by different threads which accessed the same
@@ -109,6 +157,29 @@ struct chunk {
 	bool pages_reserved_for_malloc;
 };
 
+/* a heap's tree of chunks, shared copy-on-write between the live mem_state and
+ * every saved one in the choice tree that hasn't changed it since. consecutive
+ * preemption points usually have identical heaps, so a save point costs just a
+ * reference, and the tree only gets duplicated on the first malloc or free
+ * after being shared. chunks in a shared heap must never be modified. */
+struct shared_heap {
+	unsigned int refcount;
+	struct rb_root root;
+	/* changes whenever the tree does; unique across all heaps ever made */
+	unsigned int generation;
+	/* page-granular index of the tree's chunks, for the per-access check;
+	 * built on demand, so only the live heaps bother to have one. */
+	struct heap_index *index;
+};
+
+/* the chunk a thread's last heap access landed in, which usually contains the
+ * next one too. valid iff both heaps still have the recorded generations. */
+struct chunk_cache {
+	unsigned int malloc_generation;
+	unsigned int palloc_generation;
+	struct chunk *chunk;
+};
+
 struct malloc_actions {
 	bool in_alloc;
 	bool in_realloc;
@@ -121,7 +192,7 @@ struct malloc_actions {
 
 struct mem_state {
 	/**** heap state tracking ****/
-	struct rb_root malloc_heap;
+	struct shared_heap *malloc_heap;
 	unsigned int heap_size;
 	unsigned int heap_next_id; /* generation counter for chunks */
 
@@ -130,7 +201,7 @@ struct mem_state {
 	 * The above fields for size and generation counter are shared for
 	 * simplicity of code, but others need to be duplicated. In pebbles
 	 * this is deadcode. */
-	struct rb_root palloc_heap;
+	struct shared_heap *palloc_heap;
 
 	/* dynamic allocation request state */
 	bool guest_init_done;
@@ -151,16 +222,54 @@ struct mem_state {
 	/**** shared memory conflict detection ****/
 	/* set of all shared accesses that happened during this transition;
 	 * cleared after each save point - done in save.c */
-	struct rb_root shm;
+	struct shm_set shm;
+	/* backing storage for everything in the shm set (the mem_accesses, their
+	 * mem_locksets, and those's clocks); moves along with it,
+	 * and gets reset all at once instead of freeing node by node. */
+	struct arena shm_arena;
+#ifdef PURE_HAPPENS_BEFORE
+	/* the clock most recently copied into the above, which later accesses
+	 * share until their thread's clock changes; NULL storage if none. */
+	struct vector_clock last_arena_clock;
+#endif
 	/* set of all chunks that were freed during this transition; cleared
 	 * after each save point just like the shared memory one above */
 	struct rb_root freed;
+	/* all chunks freed along the current branch, i.e. in the above tree
+	 * and those of every ancestor, for finding use-after-frees without
+	 * walking up the choice tree. maintained cross-branch like the data
+	 * races below; entries from abandoned branches are dropped on each
+	 * longjmp. NULL in saved mem_states, and until the first free. */
+	struct freed_index *freed_index;
 	/* set of candidate data races, maintained cross-branch */
 	struct rb_root data_races;
 	unsigned int data_races_suspected;
 	unsigned int data_races_confirmed;
 };
 
+/* A conflict found by mem_shm_intersect between two transitions' accesses.
+ * Finding them only reads the (frozen) saved state, so it may happen off the
+ * main thread; reporting them, which prints and updates the data race tree,
+ * is left to mem_shm_report_conflicts. */
+struct shm_conflict {
+	enum { SHM_CONFLICT_MATCH, SHM_CONFLICT_STACK, SHM_CONFLICT_FREED } type;
+	/* For matches, ma0 belongs to the later transition and ma1 to the
+	 * earlier. Otherwise, ma0 is the access made to the stack of, or to a
+	 * chunk freed by, other_tid. */
+	struct mem_access *ma0;
+	struct mem_access *ma1;
+	/* The chunks containing the matching accesses, or the freed chunk. */
+	struct chunk *c0;
+	struct chunk *c1;
+	unsigned int other_tid;
+	/* The conflicting bytes are [addr, addr + len); the accesses above are
+	 * those to the first of them. */
+	unsigned int addr;
+	unsigned int len;
+};
+
+typedef ARRAY_LIST(struct shm_conflict) shm_conflict_list_t;
+
 /******************************************************************************
  * Interface
  ******************************************************************************/
@@ -169,12 +278,30 @@ void mem_init(struct ls_state *);
 void init_malloc_actions(struct malloc_actions *);
 
 void mem_update(struct ls_state *);
+bool mem_can_skip_update(struct ls_state *);
+
+struct shared_heap *shared_heap_ref(struct shared_heap *sh);
+void shared_heap_unref(struct shared_heap *sh);
+void free_heap(struct rb_node *nobe);
+void chunk_cache_init(struct chunk_cache *cache);
+void mem_forget_frees_after(struct mem_state *m, int depth);
+void mem_write_snapshot(struct snapshot *s, const struct mem_state *m);
+void mem_read_snapshot(struct snapshot *s, struct ls_state *ls,
+		       struct mem_state *m);
 
 void mem_check_shared_access(struct ls_state *, unsigned int phys_addr,
 							 unsigned int virt_addr, bool write);
-bool mem_shm_intersect(struct ls_state *ls, struct hax *h0, struct hax *h2,
-                       bool in_kernel);
+bool mem_shm_may_conflict(struct hax *h0, struct hax *h1, bool in_kernel);
+bool mem_shm_intersect(struct hax *h0, struct hax *h1, bool in_kernel,
+		       shm_conflict_list_t *conflicts);
+void mem_shm_report_conflicts(struct ls_state *ls, struct hax *h0,
+			      struct hax *h1, bool in_kernel,
+			      struct shm_conflict *conflicts,
+			      unsigned int num_conflicts);
 
+void shm_set_init(struct shm_set *s);
+void shm_set_free(struct shm_set *s);
+void shm_set_freeze(struct shm_set *s);
 bool shm_contains_addr(struct mem_state *m, unsigned int addr);
 
 bool check_user_address_space(struct ls_state *ls);
@@ -7,6 +7,7 @@
 #define MODULE_NAME "MESSAGING"
 
 #include <inttypes.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -59,6 +60,7 @@ struct output_message {
 			char trace_filename[MESSAGE_BUF_SIZE];
 			unsigned int trace_length;
 			unsigned int icb_preemption_count;
+			bool replayed;
 		} bug;
 
 		struct {
@@ -77,18 +79,50 @@ struct input_message {
 	bool value;
 };
 
+/* Published by the master process in a file we map shared. Rather than asking
+ * at the end of every branch whether to abort or suspend, and blocking on the
+ * reply, we poll these. Each suspend is followed by a RESUME_TIME message on
+ * the input pipe once the master reschedules us. */
+struct control_block {
+	unsigned int magic;
+	volatile bool should_abort;
+	volatile unsigned int suspends;
+};
+
+/* Outgoing messages are written in batches, flushed at the end of each branch
+ * (with the estimate) or when a bug is reported, whichever comes first. */
+#define MESSAGE_BATCH_SIZE 16
+
+/* Most data races are re-reported identically on many branches; the master
+ * would ignore the repeats anyway, so skip symbolizing and sending them. */
+#define SENT_DR_CACHE_SIZE 64
+
+struct sent_data_race {
+	bool valid;
+	unsigned int eip;
+	unsigned int tid;
+	unsigned int last_call;
+	unsigned int most_recent_syscall;
+	bool confirmed;
+	bool deterministic;
+	bool free_re_malloc;
+};
+
 /******************************************************************************
  * glue
  ******************************************************************************/
 
 #ifdef ID_WRAPPER_MAGIC
 
-static void send(struct messaging_state *state, struct output_message *m)
+static void write_messages(struct messaging_state *state,
+			   struct output_message *m, unsigned int num)
 {
 	assert(state->pipes_opened);
-	m->magic = ID_WRAPPER_MAGIC;
-	int ret = write(state->output_fd, m, sizeof(struct output_message));
-	assert(ret == sizeof(struct output_message) && "write failed");
+	/* May exceed PIPE_BUF, but we are the only writer; id's recv() will
+	 * reassemble any message split across pipe buffers. */
+	unsigned int size = num * sizeof(struct output_message);
+	int ret = write(state->output_fd, m, size);
+	assert(ret == (int)size && "write failed");
 }
 
 static void recv(struct messaging_state *state, struct input_message *m)
@@ -108,7 +142,8 @@ static void recv(struct messaging_state *state, struct input_message *m)
 
 #else /* !defined ID_WRAPPER_MAGIC */
 
-static void send(struct messaging_state *state, struct output_message *m) { }
+static void write_messages(struct messaging_state *state,
+			   struct output_message *m, unsigned int num) { }
 
 static void recv(struct messaging_state *state, struct input_message *m) {
 	m->tag = SHOULD_CONTINUE_REPLY;
@@ -117,6 +152,26 @@ static void recv(struct messaging_state *state, struct input_message *m) {
 
 #endif
 
+void messaging_flush(struct messaging_state *state)
+{
+	if (state->batch_size > 0) {
+		write_messages(state, state->batch, state->batch_size);
+		state->batch_size = 0;
+	}
+}
+
+/* Queues a message to be sent at the next flush. */
+static void send(struct messaging_state *state, struct output_message *m)
+{
+#ifdef ID_WRAPPER_MAGIC
+	m->magic = ID_WRAPPER_MAGIC;
+#endif
+	if (state->batch_size == MESSAGE_BATCH_SIZE) {
+		messaging_flush(state);
+	}
+	state->batch[state->batch_size++] = *m;
+}
+
 /******************************************************************************
  * messaging logic
  ******************************************************************************/
@@ -124,10 +179,18 @@ static void recv(struct messaging_state *state, struct input_message *m) {
 void messaging_init(struct messaging_state *state)
 {
 	state->pipes_opened = false;
+	state->control = NULL;
+	state->suspends_seen = 0;
+	state->batch = MM_XMALLOC(MESSAGE_BATCH_SIZE, struct output_message);
+	state->batch_size = 0;
+	state->sent_drs = MM_XMALLOC(SENT_DR_CACHE_SIZE, struct sent_data_race);
+	for (unsigned int i = 0; i < SENT_DR_CACHE_SIZE; i++) {
+		state->sent_drs[i].valid = false;
+	}
 }
 
-void messaging_open_pipes(struct messaging_state *state,
-			  const char *input_name, const char *output_name)
+void messaging_open_pipes(struct messaging_state *state, const char *input_name,
+			  const char *output_name, const char *control_name)
 {
 #ifdef ID_WRAPPER_MAGIC
 	assert(!state->pipes_opened && "double call of messaging open pipes");
@@ -135,6 +198,7 @@ void messaging_open_pipes(struct messaging_state *state,
 
 	assert(input_name != NULL && output_name != NULL &&
 	       "have magic quicksand cookie but how do i get to warp zone?");
+	assert(control_name != NULL && "have pipes but no control file");
 
 	/* See run_job() in id/job.c for the protocol. Order is important. */
 	lsprintf(INFO, "opening output pipe %s\n", output_name);
@@ -145,30 +209,75 @@ void messaging_open_pipes(struct messaging_state *state,
 	struct output_message m;
 	m.tag = THUNDERBIRDS_ARE_GO;
 	send(state, &m);
+	messaging_flush(state);
 
 	lsprintf(INFO, "opening input pipe %s\n", input_name);
 	state->input_fd = open(input_name, O_RDONLY);
 	lsprintf(INFO, "aim for the open spot\n");
 	assert(state->input_fd >= 0 && "opening input pipe failed");
+
+	/* The master created the control file before forking us. */
+	int control_fd = open(control_name, O_RDONLY);
+	assert(control_fd >= 0 && "opening control file failed");
+	void *map = mmap(NULL, sizeof(struct control_block), PROT_READ,
+			 MAP_SHARED, control_fd, 0);
+	assert(map != MAP_FAILED && "mapping control file failed");
+	close(control_fd);
+	state->control = map;
+	assert(state->control->magic == ID_WRAPPER_MAGIC && "wrong magic");
 #else
-	assert(input_name == NULL && output_name == NULL &&
+	assert(input_name == NULL && output_name == NULL && control_name == NULL &&
 	       "can't use messaging pipes without the magic quicksand cookie!");
 #endif
 }
 
+/* Returns true if this exact report was already sent, and remembers it if
+ * not. Collisions just evict, so at worst we send a repeat. */
+static bool already_sent_data_race(struct messaging_state *state,
+				   struct sent_data_race *dr)
+{
+	unsigned int hash = dr->eip ^ (dr->last_call * 31) ^
+		(dr->most_recent_syscall * 17) ^ dr->tid;
+	struct sent_data_race *slot =
+		&state->sent_drs[hash % SENT_DR_CACHE_SIZE];
+	if (slot->valid && slot->eip == dr->eip && slot->tid == dr->tid &&
+	    slot->last_call == dr->last_call &&
+	    slot->most_recent_syscall == dr->most_recent_syscall &&
+	    slot->confirmed == dr->confirmed &&
+	    slot->deterministic == dr->deterministic &&
+	    slot->free_re_malloc == dr->free_re_malloc) {
+		return true;
+	}
+	*slot = *dr;
+	return false;
+}
+
 void message_data_race(struct messaging_state *state, unsigned int eip,
 		       unsigned int tid, unsigned int last_call,
 		       unsigned int most_recent_syscall, bool confirmed,
 		       bool deterministic, bool free_re_malloc)
 {
-	struct output_message m;
-	m.tag = DATA_RACE;
-	m.content.dr.eip = eip;
+	struct sent_data_race dr;
+	dr.valid = true;
+	dr.eip = eip;
 #ifdef FILTER_DRS_BY_TID
-	m.content.dr.tid = tid;
+	dr.tid = tid;
 #else
-	m.content.dr.tid = DR_TID_WILDCARD;
+	dr.tid = DR_TID_WILDCARD;
 #endif
+	dr.last_call = last_call;
+	dr.most_recent_syscall = most_recent_syscall;
+	dr.confirmed = confirmed;
+	dr.deterministic = deterministic;
+	dr.free_re_malloc = free_re_malloc;
+	if (already_sent_data_race(state, &dr)) {
+		return;
+	}
+
+	struct output_message m;
+	m.tag = DATA_RACE;
+	m.content.dr.eip = dr.eip;
+	m.content.dr.tid = dr.tid;
 	m.content.dr.last_call = last_call;
 	m.content.dr.most_recent_syscall = most_recent_syscall;
 	m.content.dr.confirmed = confirmed;
@@ -208,35 +317,42 @@ uint64_t message_estimate(struct messaging_state *state, long double proportion,
 	//m.content.estimate.icb_preemption_count = icb_preemptions; // not needed
 	m.content.estimate.icb_cur_bound = icb_bound;
 	send(state, &m);
+	messaging_flush(state);
 
-	/* Ask whether or not our execution is being suspended. If so we must
-	 * record the pause and resume times to not screw up ETA estimates. */
+	/* Check whether the master has suspended our execution, in response to
+	 * this or (more likely, since we don't wait for it) a previous estimate.
+	 * If so we must record the pause and resume times to not screw up ETA
+	 * estimates. */
 	uint64_t time_asleep = 0;
-	struct input_message result;
-	recv(state, &result);
-	if (result.tag == SUSPEND_TIME) {
-		if (result.value == true) {
-			/* YOU ARE BOTH SUSPENDED. */
-			struct timeval tv;
-			update_time(&tv);
-			lsprintf(DEV, "suspending time\n");
-			recv(state, &result);
-			assert(result.tag == RESUME_TIME ||
-			       result.tag == SHOULD_CONTINUE_REPLY);
-			time_asleep = update_time(&tv);
-			lsprintf(DEV, "resuming time (time asleep: %" PRIu64 ")\n",
-				 time_asleep);
+	if (state->control == NULL) {
+		/* running in standalone mode */
+		return 0;
+	}
+	while (state->suspends_seen != state->control->suspends) {
+		/* YOU ARE BOTH SUSPENDED. */
+		struct timeval tv;
+		struct input_message result;
+		update_time(&tv);
+		lsprintf(DEV, "suspending time\n");
+		recv(state, &result);
+		assert(result.tag == RESUME_TIME ||
+		       result.tag == SHOULD_CONTINUE_REPLY);
+		time_asleep += update_time(&tv);
+		lsprintf(DEV, "resuming time (time asleep: %" PRIu64 ")\n",
+			 time_asleep);
+		state->suspends_seen++;
+		if (result.tag == SHOULD_CONTINUE_REPLY) {
+			/* pipe closed; no more resumes are coming */
+			state->suspends_seen = state->control->suspends;
 		}
-	} else {
-		/* pipe closed (or running in standalone mode) */
-		assert(result.tag == SHOULD_CONTINUE_REPLY);
 	}
 
 	return time_asleep;
 }
 
 void message_found_a_bug(struct messaging_state *state, const char *trace_filename,
-			 unsigned int trace_length, unsigned int icb_preemptions)
+			 unsigned int trace_length, unsigned int icb_preemptions,
+			 bool replayed)
 {
 	struct output_message m;
 	m.tag = FOUND_A_BUG;
@@ -244,19 +360,15 @@ void message_found_a_bug(struct messaging_state *state, const char *trace_filena
 	strcpy(m.content.bug.trace_filename, trace_filename);
 	m.content.bug.trace_length = trace_length;
 	m.content.bug.icb_preemption_count = icb_preemptions;
+	m.content.bug.replayed = replayed;
 	send(state, &m);
+	messaging_flush(state);
 }
 
 bool should_abort(struct messaging_state *state)
 {
-	struct output_message m;
-	m.tag = SHOULD_CONTINUE;
-	send(state, &m);
-
-	struct input_message result;
-	recv(state, &result);
-	assert(result.tag == SHOULD_CONTINUE_REPLY);
-	return result.value;
+	/* Reflects the master's verdict as of our last estimate or so. */
+	return state->control != NULL && state->control->should_abort;
 }
 
 void message_assert_fail(struct messaging_state *state, const char *message,
@@ -267,4 +379,5 @@ void message_assert_fail(struct messaging_state *state, const char *message,
 	scnprintf(m.content.crash_report.assert_message, MESSAGE_BUF_SIZE,
 		  "%s:%u: %s(): %s", file, line, function, message);
 	send(state, &m);
+	messaging_flush(state);
 }
@@ -7,14 +7,28 @@
 #ifndef __LS_MESSAGING_H
 #define __LS_MESSAGING_H
 
+struct output_message;
+struct control_block;
+struct sent_data_race;
+
 struct messaging_state {
 	bool pipes_opened;
 	int input_fd;
 	int output_fd;
+	/* abort/suspend flags, mapped shared from the master (see messaging.c) */
+	volatile struct control_block *control;
+	unsigned int suspends_seen;
+	/* messages waiting to be written all at once */
+	struct output_message *batch;
+	unsigned int batch_size;
+	/* direct-mapped cache of recently reported data races */
+	struct sent_data_race *sent_drs;
 };
 
 void messaging_init(struct messaging_state *m);
-void messaging_open_pipes(struct messaging_state *m, const char *i, const char *o);
+void messaging_open_pipes(struct messaging_state *m, const char *i,
+			  const char *o, const char *control);
+void messaging_flush(struct messaging_state *m);
 
 #define DR_TID_WILDCARD 0x15410de0u /* 0 could be a valid tid */
 void message_data_race(struct messaging_state *m, unsigned int eip,
@@ -29,7 +43,8 @@ uint64_t message_estimate(struct messaging_state *m, long double proportion,
 			  unsigned int icb_preemptions, unsigned int icb_bound);
 
 void message_found_a_bug(struct messaging_state *m, const char *trace_filename,
-			 unsigned int trace_length, unsigned int icb_preemptions);
+			 unsigned int trace_length, unsigned int icb_preemptions,
+			 bool replayed);
 
 bool should_abort(struct messaging_state *m);
 
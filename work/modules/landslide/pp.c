@@ -5,13 +5,16 @@
  */
 
 #include <stdio.h>  /* file io */
+#include <stdlib.h> /* qsort */
 #include <unistd.h> /* unlink */
 
 #include <simics/api.h>
 
 #define MODULE_NAME "PP"
 
+#include "arbiter.h"
 #include "common.h"
+#include "kernel_specifics.h"
 #include "kspec.h"
 #include "landslide.h"
 #include "pp.h"
@@ -19,32 +22,126 @@
 #include "student_specifics.h"
 #include "x86.h"
 
+/******************************************************************************
+ * within function index
+ ******************************************************************************/
+
+static void withins_init(struct pp_withins *w)
+{
+	ARRAY_LIST_INIT(&w->list,     16);
+	ARRAY_LIST_INIT(&w->segments, 16);
+	ARRAY_LIST_INIT(&w->members,  16);
+}
+
+static int compare_bounds(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void index_withins(struct pp_withins *w)
+{
+	ARRAY_LIST(unsigned int) bounds;
+	unsigned int i, j, *bound;
+	struct pp_within *pp;
+
+	/* Every segment starts at some directive's start or just past some
+	 * directive's end, so each directive covers a segment either entirely
+	 * or not at all. */
+	ARRAY_LIST_INIT(&bounds, 2 * ARRAY_LIST_SIZE(&w->list) + 1);
+	ARRAY_LIST_FOREACH(&w->list, i, pp) {
+		assert(pp->func_start <= pp->func_end && "backwards within PP");
+		ARRAY_LIST_APPEND(&bounds, pp->func_start);
+		if (pp->func_end != (unsigned int)-1) {
+			ARRAY_LIST_APPEND(&bounds, pp->func_end + 1);
+		}
+	}
+	qsort(bounds.array, bounds.size, sizeof(unsigned int), compare_bounds);
+
+	w->segments.size = 0;
+	w->members.size = 0;
+	ARRAY_LIST_FOREACH(&bounds, i, bound) {
+		if (i + 1 < ARRAY_LIST_SIZE(&bounds) && bound[1] == bound[0]) {
+			continue; /* duplicate; the next one will do */
+		}
+		struct pp_within_segment segment = {
+			.start = bound[0],
+			.end   = i + 1 < ARRAY_LIST_SIZE(&bounds) ?
+			         bound[1] - 1 : (unsigned int)-1,
+			.first = ARRAY_LIST_SIZE(&w->members),
+			.count = 0,
+		};
+		ARRAY_LIST_FOREACH(&w->list, j, pp) {
+			if (pp->func_start <= segment.start &&
+			    segment.end <= pp->func_end) {
+				ARRAY_LIST_APPEND(&w->members, j);
+				segment.count++;
+			}
+		}
+		if (segment.count > 0) {
+			ARRAY_LIST_APPEND(&w->segments, segment);
+		}
+	}
+	ARRAY_LIST_FREE(&bounds);
+}
+
+/* Returns the segment containing eip, or NULL if no directive covers it. */
+static struct pp_within_segment *find_withins(struct pp_withins *w,
+					      unsigned int eip)
+{
+	struct pp_within_segment *segment = w->segments.array;
+	unsigned int n = ARRAY_LIST_SIZE(&w->segments);
+
+	if (n == 0) {
+		return NULL;
+	}
+	while (n > 1) {
+		unsigned int half = n / 2;
+		segment = segment[half].start <= eip ? segment + half : segment;
+		n -= half;
+	}
+	return eip >= segment->start && eip <= segment->end ? segment : NULL;
+}
+
+static void add_within(struct pp_withins *w, unsigned int func_start,
+		       unsigned int func_end, bool within)
+{
+	struct pp_within pp = { .func_start = func_start,
+	                        .func_end   = func_end,
+	                        .within     = within };
+	ARRAY_LIST_APPEND(&w->list, pp);
+}
+
+/******************************************************************************
+ * config loading
+ ******************************************************************************/
+
 void pps_init(struct pp_config *p)
 {
 	p->dynamic_pps_loaded = false;
-	ARRAY_LIST_INIT(&p->kern_withins, 16);
-	ARRAY_LIST_INIT(&p->user_withins, 16);
+	withins_init(&p->kern_withins);
+	withins_init(&p->user_withins);
 	ARRAY_LIST_INIT(&p->data_races,   16);
 	p->output_pipe_filename = NULL;
 	p->input_pipe_filename  = NULL;
+	p->control_filename     = NULL;
 
 	/* Load PPs from static config (e.g. if not running under quicksand) */
 
 	static const unsigned int kfuncs[][3] = KERN_WITHIN_FUNCTIONS;
 	for (int i = 0; i < ARRAY_SIZE(kfuncs); i++) {
-		struct pp_within pp = { .func_start = kfuncs[i][0],
-		                        .func_end   = kfuncs[i][1],
-		                        .within     = (kfuncs[i][2] != 0) };
-		ARRAY_LIST_APPEND(&p->kern_withins, pp);
+		add_within(&p->kern_withins, kfuncs[i][0], kfuncs[i][1],
+			   kfuncs[i][2] != 0);
 	}
+	index_withins(&p->kern_withins);
 
 	static const unsigned int ufuncs[][3] = USER_WITHIN_FUNCTIONS;
 	for (int i = 0; i < ARRAY_SIZE(ufuncs); i++) {
-		struct pp_within pp = { .func_start = ufuncs[i][0],
-		                        .func_end   = ufuncs[i][1],
-		                        .within     = (ufuncs[i][2] != 0) };
-		ARRAY_LIST_APPEND(&p->user_withins, pp);
+		add_within(&p->user_withins, ufuncs[i][0], ufuncs[i][1],
+			   ufuncs[i][2] != 0);
 	}
+	index_withins(&p->user_withins);
 
 	/* [i][0] is instruction pointer of the data race;
 	 * [i][1] is the current TID when the race was observed;
@@ -94,20 +191,42 @@ bool load_dynamic_pps(struct ls_state *ls, const char *filename)
 			assert(p->input_pipe_filename == NULL);
 			p->input_pipe_filename = MM_XSTRDUP(buf + 2);
 			lsprintf(DEV, "input %s\n", p->input_pipe_filename);
+		} else if (buf[0] == 'C') {
+			/* expect filename to start immediately after a space */
+			assert(buf[1] == ' ');
+			assert(buf[2] != ' ' && buf[2] != '\0');
+			assert(p->control_filename == NULL);
+			p->control_filename = MM_XSTRDUP(buf + 2);
+			lsprintf(DEV, "control %s\n", p->control_filename);
+		} else if (buf[0] == 'R') {
+			/* option chosen per job, instead of at build time, so one
+			 * build of landslide can serve every job */
+			char name[32];
+			ret = sscanf(buf, "R %31s %u", name, &x);
+			assert(ret == 2 && "invalid runtime option");
+			lsprintf(DEV, "runtime option %s = %u\n", name, x);
+			if (strcmp(name, "ICB") == 0) {
+				ls->icb = x != 0;
+				ls->icb_bound = ls->icb ? ICB_START_BOUND : ICB_UNBOUNDED;
+			} else {
+				lsprintf(DEV, "warning: unrecognized runtime option "
+					 "'%s'\n", name);
+			}
+		} else if (buf[0] == 'P') {
+			/* choice trace of a known bug, to be reproduced */
+			assert(buf[1] == ' ');
+			assert(buf[2] != ' ' && buf[2] != '\0');
+			arbiter_load_replay(&ls->arbiter, buf + 2);
 		} else if ((ret = sscanf(buf, "K %x %x %i", &x, &y, &z)) != 0) {
 			/* kernel within function directive */
 			assert(ret == 3 && "invalid kernel within PP");
 			lsprintf(DEV, "new PP: kernel %x %x %x\n", x, y, z);
-			struct pp_within pp = { .func_start = x, .func_end = y,
-			                        .within = (z != 0) };
-			ARRAY_LIST_APPEND(&p->kern_withins, pp);
+			add_within(&p->kern_withins, x, y, z != 0);
 		} else if ((ret = sscanf(buf, "U %x %x %i", &x, &y, &z)) != 0) {
 			/* user within function directive */
 			assert(ret == 3 && "invalid user within PP");
 			lsprintf(DEV, "new PP: user %x %x %x\n", x, y, z);
-			struct pp_within pp = { .func_start = x, .func_end = y,
-			                        .within = (z != 0) };
-			ARRAY_LIST_APPEND(&p->user_withins, pp);
+			add_within(&p->user_withins, x, y, z != 0);
 		} else if ((ret = sscanf(buf, "DR %x %i %i %i", &x, &y, &z, &w)) != 0) {
 			/* data race preemption poince */
 			assert(ret == 4 && "invalid data race PP");
@@ -127,6 +246,10 @@ bool load_dynamic_pps(struct ls_state *ls, const char *filename)
 	}
 	fclose(pp_file);
 
+	/* Dynamic directives come after (so, override) the static ones. */
+	index_withins(&p->kern_withins);
+	index_withins(&p->user_withins);
+
 	if (unlink(filename) < 0) {
 		lsprintf(DEV, "warning: failed rm temp PP file %s\n", filename);
 	}
@@ -134,11 +257,183 @@ bool load_dynamic_pps(struct ls_state *ls, const char *filename)
 	p->dynamic_pps_loaded = true;
 
 	messaging_open_pipes(&ls->mess, p->input_pipe_filename,
-			     p->output_pipe_filename);
+			     p->output_pipe_filename, p->control_filename);
 	return true;
 }
 
-static bool check_withins(struct ls_state *ls, pp_within_list_t *pps)
+/******************************************************************************
+ * within functions
+ ******************************************************************************/
+
+/* Rather than walking the stack for every query, each agent has a shadow call
+ * stack per address space, updated as calls and returns execute. Each one
+ * counts how many of its frames are within each within-function directive, so
+ * queries need only check which counts are nonzero. */
+
+#define MAX_SHADOW_FRAMES 4096
+
+static void add_frame_counts(struct shadow_stack *shadow, struct pp_withins *pps,
+			     unsigned int eip, int delta)
+{
+	struct pp_within_segment *segment = find_withins(pps, eip);
+	if (segment != NULL) {
+		for (unsigned int i = 0; i < segment->count; i++) {
+			unsigned int pp_index =
+				pps->members.array[segment->first + i];
+			*ARRAY_LIST_GET(&shadow->within_counts, pp_index) += delta;
+		}
+	}
+}
+
+static void recount_withins(struct shadow_stack *shadow, struct pp_withins *pps)
+{
+	unsigned int i;
+	struct shadow_frame *frame;
+
+	shadow->within_counts.size = 0;
+	for (i = 0; i < ARRAY_LIST_SIZE(&pps->list); i++) {
+		ARRAY_LIST_APPEND(&shadow->within_counts, 0);
+	}
+	ARRAY_LIST_FOREACH(&shadow->frames, i, frame) {
+		add_frame_counts(shadow, pps, frame->eip, 1);
+	}
+}
+
+static void count_frame(struct shadow_stack *shadow, struct pp_withins *pps,
+			struct shadow_frame *frame, int delta)
+{
+	if (ARRAY_LIST_SIZE(&shadow->within_counts) !=
+	    ARRAY_LIST_SIZE(&pps->list)) {
+		/* new PPs got loaded; count this frame along with the rest */
+		recount_withins(shadow, pps);
+		return;
+	}
+	add_frame_counts(shadow, pps, frame->eip, delta);
+}
+
+static void pop_frame(struct shadow_stack *shadow, struct pp_withins *pps)
+{
+	assert(ARRAY_LIST_SIZE(&shadow->frames) > 0);
+	shadow->frames.size--;
+	count_frame(shadow, pps, &shadow->frames.array[shadow->frames.size], -1);
+}
+
+static void clear_frames(struct shadow_stack *shadow, struct pp_withins *pps,
+			 bool synced)
+{
+	shadow->frames.size = 0;
+	recount_withins(shadow, pps);
+	shadow->synced = synced;
+}
+
+static void push_frame(struct shadow_stack *shadow, struct pp_withins *pps,
+		       unsigned int eip, unsigned int slot)
+{
+	/* The stack grows down, so anything at or below the new slot must have
+	 * been unwound without our noticing (e.g. by longjmp). */
+	while (ARRAY_LIST_SIZE(&shadow->frames) > 0 &&
+	       shadow->frames.array[shadow->frames.size - 1].slot <= slot) {
+		pop_frame(shadow, pps);
+	}
+	if (ARRAY_LIST_SIZE(&shadow->frames) == MAX_SHADOW_FRAMES) {
+		/* runaway recursion, or lost track of returns somehow */
+		clear_frames(shadow, pps, false);
+	}
+	struct shadow_frame frame = { .eip = eip, .slot = slot };
+	ARRAY_LIST_APPEND(&shadow->frames, frame);
+	count_frame(shadow, pps, &frame, 1);
+}
+
+/* Pops the frame whose return address is in the given slot, and any above it.
+ * If there isn't one, we must have missed its call; the stack is out of sync
+ * unless the caller says that's to be expected. */
+static void return_to(struct shadow_stack *shadow, struct pp_withins *pps,
+		      unsigned int slot, bool expect_missing)
+{
+	unsigned int i = ARRAY_LIST_SIZE(&shadow->frames);
+	while (i > 0 && shadow->frames.array[i - 1].slot != slot) {
+		i--;
+	}
+	if (i == 0) {
+		if (!expect_missing) {
+			shadow->synced = false;
+		}
+		return;
+	}
+	while (ARRAY_LIST_SIZE(&shadow->frames) >= i) {
+		pop_frame(shadow, pps);
+	}
+}
+
+void update_shadow_stacks(struct ls_state *ls)
+{
+	struct agent *a = ls->sched.cur_agent;
+	struct shadow_stack *kern = &a->kern_shadow_stack;
+	struct shadow_stack *user = &a->user_shadow_stack;
+	struct pp_withins *kern_pps = &ls->pps.kern_withins;
+	struct pp_withins *user_pps = &ls->pps.user_withins;
+	uint8_t *text = ls->instruction_text;
+	unsigned int eip = ls->eip;
+
+	if (KERNEL_MEMORY(eip)) {
+		if (ARRAY_LIST_SIZE(&kern_pps->list) == 0) {
+			return;
+		}
+		if (kern_timer_entering(eip) ||
+		    kern_page_fault_handler_entering(eip)) {
+			/* The interrupted instruction is on the stack, as if
+			 * it were a call, unless we came from userspace, in
+			 * which case the kernel stack was empty before this. */
+			unsigned int slot = GET_CPU_ATTR(ls->cpu0, esp);
+			if (kern_page_fault_handler_entering(eip)) {
+				slot += WORD_SIZE; /* error code */
+			}
+			if (READ_MEMORY(ls->cpu0, slot + WORD_SIZE) ==
+			    SEGSEL_KERNEL_CS) {
+				push_frame(kern, kern_pps,
+					   READ_MEMORY(ls->cpu0, slot), slot);
+			} else {
+				clear_frames(kern, kern_pps, true);
+			}
+		}
+		if (OPCODE_IS_CALL(text)) {
+			push_frame(kern, kern_pps, eip,
+				   GET_CPU_ATTR(ls->cpu0, esp) - WORD_SIZE);
+		} else if (OPCODE_IS_RET(text)) {
+			return_to(kern, kern_pps, GET_CPU_ATTR(ls->cpu0, esp),
+				  false);
+		} else if (text[0] == OPCODE_IRET) {
+			unsigned int esp = GET_CPU_ATTR(ls->cpu0, esp);
+			if (READ_MEMORY(ls->cpu0, esp + WORD_SIZE) ==
+			    SEGSEL_KERNEL_CS) {
+				/* Only interrupts handled above will have left
+				 * a frame to pop; others are fine to miss. */
+				return_to(kern, kern_pps, esp, true);
+			} else {
+				/* Back to userspace with an empty stack. */
+				clear_frames(kern, kern_pps, true);
+			}
+		}
+	} else {
+		if (text[0] == OPCODE_INT && ARRAY_LIST_SIZE(&kern_pps->list) > 0) {
+			/* Entering the kernel with an empty stack. */
+			clear_frames(kern, kern_pps, true);
+		}
+		if (ARRAY_LIST_SIZE(&user_pps->list) == 0) {
+			return;
+		}
+		if (OPCODE_IS_CALL(text)) {
+			push_frame(user, user_pps, eip,
+				   GET_CPU_ATTR(ls->cpu0, esp) - WORD_SIZE);
+		} else if (OPCODE_IS_RET(text)) {
+			return_to(user, user_pps, GET_CPU_ATTR(ls->cpu0, esp),
+				  false);
+		}
+	}
+}
+
+static bool check_withins(struct ls_state *ls, struct pp_withins *pps,
+			  struct shadow_stack *shadow, bool kernel)
 {
 #ifndef PREEMPT_EVERYWHERE
 	/* If there are no within_functions, the default answer is yes.
@@ -149,11 +444,32 @@ static bool check_withins(struct ls_state *ls, pp_within_list_t *pps)
 	bool answer = true;
 	unsigned int i;
 	struct pp_within *pp;
+	struct pp_within_segment *current;
+	unsigned int current_index = 0;
 
-	struct stack_trace *st = stack_trace(ls);
+	if (ARRAY_LIST_SIZE(&pps->list) == 0) {
+		return answer;
+	}
+
+	if (!shadow->synced) {
+		shadow_stack_sync(ls, shadow, kernel);
+		recount_withins(shadow, pps);
+	} else if (ARRAY_LIST_SIZE(&shadow->within_counts) !=
+		   ARRAY_LIST_SIZE(&pps->list)) {
+		recount_withins(shadow, pps);
+	}
 
-	ARRAY_LIST_FOREACH(pps, i, pp) {
-		bool in = within_function_st(st, pp->func_start, pp->func_end);
+	/* the current frame is never on the shadow stack */
+	current = find_withins(pps, ls->eip);
+
+	ARRAY_LIST_FOREACH(&pps->list, i, pp) {
+		bool in = *ARRAY_LIST_GET(&shadow->within_counts, i) > 0;
+		/* members are in ascending order, as are we */
+		if (current != NULL && current_index < current->count &&
+		    pps->members.array[current->first + current_index] == i) {
+			in = true;
+			current_index++;
+		}
 		if (pp->within) {
 #ifndef PREEMPT_EVERYWHERE
 			/* Switch to whitelist mode. */
@@ -174,18 +490,19 @@ static bool check_withins(struct ls_state *ls, pp_within_list_t *pps)
 		}
 	}
 
-	free_stack_trace(st);
 	return answer;
 }
 
 bool kern_within_functions(struct ls_state *ls)
 {
-	return check_withins(ls, &ls->pps.kern_withins);
+	return check_withins(ls, &ls->pps.kern_withins,
+			     &ls->sched.cur_agent->kern_shadow_stack, true);
 }
 
 bool user_within_functions(struct ls_state *ls)
 {
-	return check_withins(ls, &ls->pps.user_withins);
+	return check_withins(ls, &ls->pps.user_withins,
+			     &ls->sched.cur_agent->user_shadow_stack, false);
 }
 
 #ifdef PREEMPT_EVERYWHERE
@@ -30,20 +30,41 @@ struct pp_data_race {
 	unsigned int most_recent_syscall;
 };
 
-typedef ARRAY_LIST(struct pp_within) pp_within_list_t;
+/* A piece of the address space covered by the same set of within directives
+ * throughout; members[first] through members[first+count-1] are their indices,
+ * in ascending order. */
+struct pp_within_segment {
+	unsigned int start;
+	unsigned int end; /* inclusive */
+	unsigned int first;
+	unsigned int count;
+};
+
+/* Later within directives take precedence over earlier ones, so unlike the
+ * scheduler functions (see interval.h), their ranges can't be merged together.
+ * Instead, they're split at every endpoint into disjoint, sorted segments, so
+ * finding every directive an eip is within takes one binary search. The index
+ * gets rebuilt whenever directives are added. */
+struct pp_withins {
+	ARRAY_LIST(struct pp_within) list; /* in the order they were given */
+	ARRAY_LIST(struct pp_within_segment) segments;
+	ARRAY_LIST(unsigned int) members;
+};
 
 struct pp_config {
 	bool dynamic_pps_loaded;
-	pp_within_list_t kern_withins;
-	pp_within_list_t user_withins;
+	struct pp_withins kern_withins;
+	struct pp_withins user_withins;
 	ARRAY_LIST(struct pp_data_race) data_races;
 	char *output_pipe_filename;
 	char *input_pipe_filename;
+	char *control_filename;
 };
 
 void pps_init(struct pp_config *p);
 bool load_dynamic_pps(struct ls_state *ls, const char *filename);
 
+void update_shadow_stacks(struct ls_state *ls);
 bool kern_within_functions(struct ls_state *ls);
 bool user_within_functions(struct ls_state *ls);
 bool suspected_data_race(struct ls_state *ls);
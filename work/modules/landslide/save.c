@@ -5,7 +5,8 @@
  */
 
 #include <inttypes.h>
-#include <string.h> /* for memcmp, strlen */
+#include <pthread.h>
+#include <string.h> /* for memcmp, memcpy, strlen */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h> /* for open */
@@ -18,6 +19,7 @@
 #define MODULE_COLOUR COLOUR_MAGENTA
 
 #include "arbiter.h"
+#include "bitset.h"
 #include "common.h"
 #include "compiler.h"
 #include "estimate.h"
@@ -128,8 +130,12 @@ static void copy_malloc_actions(struct malloc_actions *dest, const struct malloc
 	dest->palloc_request_size = src->palloc_request_size;
 }
 
+/* When "move" is set, the clocks and stack traces are stolen from
+ * the source instead of duplicated. Nothing but a restore ever reads those out
+ * of a saved sched, so this is fine once the source will never be restored to
+ * again. The remaining fields are still copied, as DPOR et al. need them. */
 #define COPY_FIELD(name) do { a_dest->name = a_src->name; } while (0)
-static struct agent *copy_agent(struct agent *a_src)
+static struct agent *copy_agent(struct agent *a_src, bool move)
 {
 	struct agent *a_dest = MM_XMALLOC(1, struct agent);
 	assert(a_src != NULL && "cannot copy null agent");
@@ -194,18 +200,33 @@ static struct agent *copy_agent(struct agent *a_src)
 	COPY_FIELD(delayed_vr_exit_eip);
 	COPY_FIELD(most_recent_syscall);
 	COPY_FIELD(last_call);
-	lockset_clone(&a_dest->kern_locks_held, &a_src->kern_locks_held);
-	lockset_clone(&a_dest->user_locks_held, &a_src->user_locks_held);
+	COPY_FIELD(kern_locks_held);
+	COPY_FIELD(user_locks_held);
 #ifdef PURE_HAPPENS_BEFORE
-	vc_copy(&a_dest->clock, &a_src->clock);
+	if (move) {
+		vc_move(&a_dest->clock, &a_src->clock);
+	} else {
+		vc_copy(&a_dest->clock, &a_src->clock);
+	}
 #endif
 	copy_user_yield_state(&a_dest->user_yield, &a_src->user_yield);
 #ifdef ALLOW_REENTRANT_MALLOC_FREE
 	copy_malloc_actions(&a_dest->kern_malloc_flags, &a_src->kern_malloc_flags);
 	copy_malloc_actions(&a_dest->user_malloc_flags, &a_src->user_malloc_flags);
 #endif
-	a_dest->pre_vanish_trace = (a_src->pre_vanish_trace == NULL) ?
-		NULL : copy_stack_trace(a_src->pre_vanish_trace);
+	if (move || a_src->pre_vanish_trace == NULL) {
+		a_dest->pre_vanish_trace = a_src->pre_vanish_trace;
+		a_src->pre_vanish_trace = NULL;
+	} else {
+		a_dest->pre_vanish_trace = stack_trace_ref(a_src->pre_vanish_trace);
+	}
+
+	/* Not worth copying; the next within-function query on each restored
+	 * agent will resync its shadow stacks with one real stack walk. */
+	shadow_stack_init(&a_dest->kern_shadow_stack);
+	shadow_stack_init(&a_dest->user_shadow_stack);
+	chunk_cache_init(&a_dest->kern_chunk_cache);
+	chunk_cache_init(&a_dest->user_chunk_cache);
 
 	a_dest->do_explore = false;
 
@@ -217,14 +238,14 @@ static struct agent *copy_agent(struct agent *a_src)
  * corresponding agence in the s_src. */
 static void copy_sched_q(struct agent_q *q_dest, const struct agent_q *q_src,
 			 struct sched_state *dest,
-			 const struct sched_state *src)
+			 const struct sched_state *src, bool move)
 {
 	struct agent *a_src;
 
 	assert(Q_GET_SIZE(q_dest) == 0);
 
 	Q_FOREACH(a_src, q_src, nobe) {
-		struct agent *a_dest = copy_agent(a_src);
+		struct agent *a_dest = copy_agent(a_src, move);
 
 		// XXX: Q_INSERT_TAIL causes an assert to trip. ???
 		Q_INSERT_HEAD(q_dest, a_dest, nobe);
@@ -236,7 +257,8 @@ static void copy_sched_q(struct agent_q *q_dest, const struct agent_q *q_src,
 			dest->schedule_in_flight = a_dest;
 	}
 }
-static void copy_sched(struct sched_state *dest, const struct sched_state *src)
+static void copy_sched(struct sched_state *dest, struct sched_state *src,
+		       bool move)
 {
 	dest->cur_agent           = NULL;
 	dest->last_agent          = NULL;
@@ -245,9 +267,9 @@ static void copy_sched(struct sched_state *dest, const struct sched_state *src)
 	Q_INIT_HEAD(&dest->rq);
 	Q_INIT_HEAD(&dest->dq);
 	Q_INIT_HEAD(&dest->sq);
-	copy_sched_q(&dest->rq, &src->rq, dest, src);
-	copy_sched_q(&dest->dq, &src->dq, dest, src);
-	copy_sched_q(&dest->sq, &src->sq, dest, src);
+	copy_sched_q(&dest->rq, &src->rq, dest, src, move);
+	copy_sched_q(&dest->dq, &src->dq, dest, src, move);
+	copy_sched_q(&dest->sq, &src->sq, dest, src, move);
 	assert((src->cur_agent == NULL || dest->cur_agent != NULL) &&
 	       "copy_sched couldn't set cur_agent!");
 	assert((src->schedule_in_flight == NULL ||
@@ -257,7 +279,7 @@ static void copy_sched(struct sched_state *dest, const struct sched_state *src)
 	/* The last_vanished agent is not on any queues. */
 	if (src->last_vanished_agent != NULL) {
 		dest->last_vanished_agent =
-			copy_agent(src->last_vanished_agent);
+			copy_agent(src->last_vanished_agent, move);
 		if (src->last_agent == src->last_vanished_agent) {
 			assert(dest->last_agent == NULL &&
 			       "but last_agent was already found!");
@@ -280,13 +302,24 @@ static void copy_sched(struct sched_state *dest, const struct sched_state *src)
 	dest->guest_init_done        = src->guest_init_done;
 	dest->entering_timer         = src->entering_timer;
 	dest->voluntary_resched_tid  = src->voluntary_resched_tid;
-	dest->voluntary_resched_stack =
-		(src->voluntary_resched_stack == NULL) ? NULL :
-			copy_stack_trace(src->voluntary_resched_stack);
-	lockset_clone(&dest->known_semaphores, &src->known_semaphores);
+	if (move) {
+		dest->voluntary_resched_stack = src->voluntary_resched_stack;
+		src->voluntary_resched_stack = NULL;
+		lockset_move(&dest->known_semaphores, &src->known_semaphores);
+	} else {
+		dest->voluntary_resched_stack =
+			(src->voluntary_resched_stack == NULL) ? NULL :
+				stack_trace_ref(src->voluntary_resched_stack);
+		lockset_clone(&dest->known_semaphores, &src->known_semaphores);
+	}
 #ifdef PURE_HAPPENS_BEFORE
+	/* shared copy-on-write; nothing to be gained by moving */
 	lock_clocks_copy(&dest->lock_clocks, &src->lock_clocks);
-	vc_copy(&dest->scheduler_lock_clock, &src->scheduler_lock_clock);
+	if (move) {
+		vc_move(&dest->scheduler_lock_clock, &src->scheduler_lock_clock);
+	} else {
+		vc_copy(&dest->scheduler_lock_clock, &src->scheduler_lock_clock);
+	}
 	dest->scheduler_lock_held = src->scheduler_lock_held;
 #endif
 	dest->deadlock_fp_avoidance_count = src->deadlock_fp_avoidance_count;
@@ -296,7 +329,8 @@ static void copy_sched(struct sched_state *dest, const struct sched_state *src)
 	dest->delayed_txn_fail_tid = src->delayed_txn_fail_tid;
 }
 
-static void copy_test(struct test_state *dest, const struct test_state *src)
+static void copy_test(struct test_state *dest, struct test_state *src,
+		      bool move)
 {
 	dest->test_is_running      = src->test_is_running;
 	dest->test_ended           = src->test_ended;
@@ -304,54 +338,19 @@ static void copy_test(struct test_state *dest, const struct test_state *src)
 	dest->start_kern_heap_size = src->start_kern_heap_size;
 	dest->start_user_heap_size = src->start_user_heap_size;
 
-	if (src->current_test == NULL) {
-		dest->current_test = NULL;
+	if (move || src->current_test == NULL) {
+		dest->current_test = src->current_test;
+		src->current_test = NULL;
 	} else {
 		dest->current_test = MM_XSTRDUP(src->current_test);
 	}
 }
-static struct rb_node *dup_chunk(const struct rb_node *nobe,
-				 const struct rb_node *parent)
-{
-	if (nobe == NULL)
-		return NULL;
-
-	struct chunk *src = rb_entry(nobe, struct chunk, nobe);
-	struct chunk *dest = MM_XMALLOC(1, struct chunk);
-
-	/* dup rb node contents */
-	int colour_flag = src->nobe.rb_parent_color & 1;
-
-	assert(((unsigned long)parent & 1) == 0);
-	dest->nobe.rb_parent_color = (unsigned long)parent | colour_flag;
-	dest->nobe.rb_right = dup_chunk(src->nobe.rb_right, &dest->nobe);
-	dest->nobe.rb_left  = dup_chunk(src->nobe.rb_left, &dest->nobe);
-
-	dest->base = src->base;
-	dest->len  = src->len;
-	dest->id   = src->id;
-
-	if (src->malloc_trace == NULL) {
-		dest->malloc_trace = NULL;
-	} else {
-		dest->malloc_trace = copy_stack_trace(src->malloc_trace);
-	}
-	if (src->free_trace == NULL) {
-		dest->free_trace = NULL;
-	} else {
-		dest->free_trace = copy_stack_trace(src->free_trace);
-	}
-
-	dest->pages_reserved_for_malloc = src->pages_reserved_for_malloc;
-
-	return &dest->nobe;
-}
 static void copy_mem(struct mem_state *dest, const struct mem_state *src, bool in_tree)
 {
 	dest->guest_init_done     = src->guest_init_done;
 	dest->in_mm_init          = src->in_mm_init;
-	dest->malloc_heap.rb_node = dup_chunk(src->malloc_heap.rb_node, NULL);
-	dest->palloc_heap.rb_node = dup_chunk(src->palloc_heap.rb_node, NULL);
+	dest->malloc_heap         = shared_heap_ref(src->malloc_heap);
+	dest->palloc_heap         = shared_heap_ref(src->palloc_heap);
 	dest->heap_size           = src->heap_size;
 	dest->heap_next_id        = src->heap_next_id;
 #ifndef ALLOW_REENTRANT_MALLOC_FREE
@@ -367,11 +366,16 @@ static void copy_mem(struct mem_state *dest, const struct mem_state *src, bool i
 	 * and we want it to reset the shm and freed heap to empty. But,
 	 * depending whether we're testing user or kernel, we might skip
 	 * the shimsham_shm call, so we at least must initialize them here. */
-	dest->shm.rb_node         = NULL;
+	shm_set_init(&dest->shm);
+	arena_init(&dest->shm_arena);
+#ifdef PURE_HAPPENS_BEFORE
+	dest->last_arena_clock.s = NULL;
+#endif
 	dest->freed.rb_node       = NULL;
-	/* do NOT copy data_races! */
+	/* do NOT copy data_races (or the freed index)! */
 	if (in_tree) {
 		/* see corresponding assert in free_mem() */
+		dest->freed_index = NULL;
 		dest->data_races.rb_node = NULL;
 		dest->data_races_suspected = 0;
 		dest->data_races_confirmed = 0;
@@ -387,27 +391,7 @@ static void copy_user_sync(struct user_sync_state *dest,
 		 * over again. it's not like user mutex size ever changes. */
 		dest->mutex_size = src->mutex_size;
 	}
-	Q_INIT_HEAD(&dest->mutexes);
-
-	struct mutex *mp_src;
-	Q_FOREACH(mp_src, &src->mutexes, nobe) {
-		struct mutex *mp_dest = MM_XMALLOC(1, struct mutex);
-		mp_dest->addr = mp_src->addr;
-		Q_INIT_HEAD(&mp_dest->chunks);
-
-		struct mutex_chunk *c_src;
-		Q_FOREACH(c_src, &mp_src->chunks, nobe) {
-			struct mutex_chunk *c_dest = MM_XMALLOC(1, struct mutex_chunk);
-			c_dest->base = c_src->base;
-			c_dest->size = c_src->size;
-			Q_INSERT_HEAD(&mp_dest->chunks, c_dest, nobe);
-		}
-		assert(Q_GET_SIZE(&mp_dest->chunks) == Q_GET_SIZE(&mp_src->chunks));
-
-		Q_INSERT_HEAD(&dest->mutexes, mp_dest, nobe);
-	}
-
-	assert(Q_GET_SIZE(&dest->mutexes) == Q_GET_SIZE(&src->mutexes));
+	dest->mutexes = shared_mutexes_ref(src->mutexes);
 
 	assert(src->yield_progress == NOTHING_INTERESTING &&
 	       "user yield progress flag wasn't reset before checkpoint");
@@ -423,13 +407,13 @@ static void free_sched_q(struct agent_q *q)
 		struct agent *a = Q_GET_HEAD(q);
 		assert(a != NULL);
 		Q_REMOVE(q, a, nobe);
-		lockset_free(&a->kern_locks_held);
-		lockset_free(&a->user_locks_held);
+		shadow_stack_free(&a->kern_shadow_stack);
+		shadow_stack_free(&a->user_shadow_stack);
 #ifdef PURE_HAPPENS_BEFORE
 		vc_destroy(&a->clock);
 #endif
 		if (a->pre_vanish_trace != NULL) {
-			free_stack_trace(a->pre_vanish_trace);
+			stack_trace_unref(a->pre_vanish_trace);
 		}
 		MM_FREE(a);
 	}
@@ -450,52 +434,24 @@ static void free_test(const struct test_state *t)
 	MM_FREE(t->current_test);
 }
 
-static void free_heap(struct rb_node *nobe)
-{
-	if (nobe == NULL)
-		return;
-	free_heap(nobe->rb_left);
-	free_heap(nobe->rb_right);
-
-	struct chunk *c = rb_entry(nobe, struct chunk, nobe);
-	if (c->malloc_trace != NULL) free_stack_trace(c->malloc_trace);
-	if (c->free_trace   != NULL) free_stack_trace(c->free_trace);
-	MM_FREE(c);
-}
-
-static void free_shm(struct rb_node *nobe)
+static void free_mem(struct mem_state *m, bool in_tree)
 {
-	if (nobe == NULL)
-		return;
-	free_shm(nobe->rb_left);
-	free_shm(nobe->rb_right);
-	struct mem_access *ma = rb_entry(nobe, struct mem_access, nobe);
-	while (Q_GET_SIZE(&ma->locksets) > 0) {
-		struct mem_lockset *l = Q_GET_HEAD(&ma->locksets);
-		assert(l != NULL);
-		Q_REMOVE(&ma->locksets, l, nobe);
-		lockset_free(&l->locks_held);
+	shared_heap_unref(m->malloc_heap);
+	m->malloc_heap = NULL;
+	shared_heap_unref(m->palloc_heap);
+	m->palloc_heap = NULL;
+	/* everything in the shm set lives in its arena */
+	shm_set_free(&m->shm);
+	arena_reset(&m->shm_arena);
 #ifdef PURE_HAPPENS_BEFORE
-		vc_destroy(&l->clock);
+	m->last_arena_clock.s = NULL;
 #endif
-		MM_FREE(l);
-	}
-	MM_FREE(ma);
-}
-
-static void free_mem(struct mem_state *m, bool in_tree)
-{
-	free_heap(m->malloc_heap.rb_node);
-	m->malloc_heap.rb_node = NULL;
-	free_heap(m->palloc_heap.rb_node);
-	m->palloc_heap.rb_node = NULL;
-	free_shm(m->shm.rb_node);
-	m->shm.rb_node = NULL;
 	free_heap(m->freed.rb_node);
 	m->freed.rb_node = NULL;
 	if (in_tree) {
 		/* data races are "glowing green", and should only appear in the
 		 * copy of mem_state owned by landslide itself; never copied */
+		assert(m->freed_index == NULL);
 		assert(m->data_races.rb_node == NULL);
 		assert(m->data_races_suspected == 0);
 		assert(m->data_races_confirmed == 0);
@@ -504,19 +460,8 @@ static void free_mem(struct mem_state *m, bool in_tree)
 
 static unsigned int free_user_sync(struct user_sync_state *u)
 {
-	while (Q_GET_SIZE(&u->mutexes) > 0) {
-		struct mutex *mp = Q_GET_HEAD(&u->mutexes);
-		assert(mp != NULL);
-		Q_REMOVE(&u->mutexes, mp, nobe);
-		while (Q_GET_SIZE(&mp->chunks) > 0) {
-			struct mutex_chunk *c = Q_GET_HEAD(&mp->chunks);
-			assert(c != NULL);
-			Q_REMOVE(&mp->chunks, c, nobe);
-			MM_FREE(c);
-		}
-		MM_FREE(mp);
-	}
-
+	shared_mutexes_unref(u->mutexes);
+	u->mutexes = NULL;
 	return u->mutex_size;
 }
 
@@ -528,13 +473,17 @@ static void free_arbiter_choices(struct arbiter_state *a)
 	}
 }
 
-static void free_haxs_children(struct hax *h)
+/* returns how many bytes of explored-tree bookkeeping were reclaimed */
+static uint64_t free_haxs_children(struct hax *h)
 {
+	uint64_t freed_bytes = h->num_compacted_children * sizeof(int);
+
 	while (Q_GET_SIZE(&h->children) > 0) {
 		struct hax *child = Q_GET_HEAD(&h->children);
 		assert(child != NULL);
 		Q_REMOVE(&h->children, child, sibling);
 		assert(Q_GET_SIZE(&child->children) == 0);
+		assert(child->num_compacted_children == 0);
 		assert(child->oldsched == NULL);
 		assert(child->oldtest == NULL);
 		assert(child->old_kern_mem == NULL);
@@ -542,10 +491,16 @@ static void free_haxs_children(struct hax *h)
 		assert(child->conflicts == NULL);
 		assert(child->happens_before == NULL);
 		MM_FREE(child);
+		freed_bytes += sizeof(struct hax);
 	}
+
+	MM_FREE(h->compacted_children);
+	h->compacted_children = NULL;
+	h->num_compacted_children = 0;
+	return freed_bytes;
 }
 
-static void free_hax(struct hax *h)
+static uint64_t free_hax(struct hax *h)
 {
 	free_sched(h->oldsched);
 	MM_FREE(h->oldsched);
@@ -565,16 +520,100 @@ static void free_hax(struct hax *h)
 	MM_FREE(h->happens_before);
 	h->conflicts = NULL;
 	h->happens_before = NULL;
-	free_stack_trace(h->stack_trace);
-	free_haxs_children(h);
+	stack_trace_unref(h->stack_trace);
+	uint64_t freed_bytes = free_haxs_children(h);
 	if (h->xbegin) {
 		ARRAY_LIST_FREE(&h->xabort_codes_ever);
 		ARRAY_LIST_FREE(&h->xabort_codes_todo);
 	}
+	return freed_bytes;
 }
 
-/* Reverse that which is not glowing green. */
-static void restore_ls(struct ls_state *ls, struct hax *h)
+/******************************************************************************
+ * Explored subtree compaction
+ ******************************************************************************/
+
+/* Once a child's subtree is fully explored and the child is no longer on the
+ * current branch, all that remains of it is its struct hax, which is only ever
+ * consulted for its chosen_thread. Collapse each such child of each nobe on
+ * the current branch into a single int. */
+static void compact_explored_children(struct save_state *ss)
+{
+	for (struct hax *h = ss->current; h != NULL; h = h->parent) {
+		unsigned int num_explored = 0;
+		struct hax *child;
+
+		Q_FOREACH(child, &h->children, sibling) {
+			if (child->oldsched == NULL) {
+				num_explored++;
+			}
+		}
+		if (num_explored == 0) {
+			continue;
+		}
+
+		unsigned int old_num = h->num_compacted_children;
+		int *compacted = MM_XMALLOC(old_num + num_explored, int);
+		if (old_num > 0) {
+			memcpy(compacted, h->compacted_children,
+			       old_num * sizeof(int));
+		}
+		MM_FREE(h->compacted_children);
+		h->compacted_children = compacted;
+
+		for (child = Q_GET_HEAD(&h->children); child != NULL; ) {
+			struct hax *next = Q_GET_NEXT(child, sibling);
+			if (child->oldsched == NULL) {
+				assert(child->all_explored);
+				assert(Q_GET_SIZE(&child->children) == 0);
+				assert(child->num_compacted_children == 0);
+				Q_REMOVE(&h->children, child, sibling);
+				h->compacted_children[h->num_compacted_children++] =
+					child->chosen_thread;
+				MM_FREE(child);
+				ss->tree_bytes -= sizeof(struct hax);
+				ss->tree_bytes += sizeof(int);
+			}
+			child = next;
+		}
+		assert(h->num_compacted_children == old_num + num_explored);
+	}
+
+	ss->total_compactions++;
+	lsprintf(DEV, "compacted explored subtrees; now using %" PRIu64
+		 " bytes\n", ss->tree_bytes);
+}
+
+/* Counts all children that were ever explored or are being explored now. */
+unsigned int num_children(struct hax *h)
+{
+	return Q_GET_SIZE(&h->children) + h->num_compacted_children;
+}
+
+/* Is there a child of h that ran the given tid? If need_all_explored, that
+ * child's subtree must also be done. (Compacted ones always are.) */
+bool has_explored_child(struct hax *h, int tid, bool need_all_explored)
+{
+	struct hax *child;
+
+	Q_FOREACH(child, &h->children, sibling) {
+		if (child->chosen_thread == tid &&
+		    (child->all_explored || !need_all_explored)) {
+			return true;
+		}
+	}
+	for (unsigned int i = 0; i < h->num_compacted_children; i++) {
+		if (h->compacted_children[i] == tid) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Reverse that which is not glowing green. If "move" is set, h promises never
+ * to be restored to again, so its saved state may be cannibalized (see
+ * copy_agent). */
+static void restore_ls(struct ls_state *ls, struct hax *h, bool move)
 {
 	lsprintf(DEV, "88 MPH: eip 0x%x -> 0x%x; "
 		 "triggers %lu -> %lu (absolute %" PRIu64 "); last choice %d\n",
@@ -584,15 +623,19 @@ static void restore_ls(struct ls_state *ls, struct hax *h)
 	ls->eip           = h->eip;
 	ls->trigger_count = h->trigger_count;
 
-	// TODO: can have "move" instead of "copy" for these
+	/* (the heaps, user mutexes, and lock clocks are shared copy-on-write,
+	 * so for them these are just reference count adjustments.) */
 	free_sched(&ls->sched);
-	copy_sched(&ls->sched, h->oldsched);
+	copy_sched(&ls->sched, h->oldsched, move);
 	free_test(&ls->test);
-	copy_test(&ls->test, h->oldtest);
+	copy_test(&ls->test, h->oldtest, move);
 	free_mem(&ls->kern_mem, false);
 	copy_mem(&ls->kern_mem, h->old_kern_mem, false); /* note: leaves shm empty, as we want */
 	free_mem(&ls->user_mem, false);
 	copy_mem(&ls->user_mem, h->old_user_mem, false); /* as above */
+	/* frees made after h went away with its descendants' freed trees */
+	mem_forget_frees_after(&ls->kern_mem, h->depth);
+	mem_forget_frees_after(&ls->user_mem, h->depth);
 	int already_known_size = free_user_sync(&ls->user_sync);
 	copy_user_sync(&ls->user_sync, h->old_user_sync, already_known_size);
 	free_arbiter_choices(&ls->arbiter);
@@ -608,10 +651,7 @@ static void restore_ls(struct ls_state *ls, struct hax *h)
 
 static void inherit_happens_before(struct hax *h, struct hax *old)
 {
-	for (int i = 0; i < old->depth; i++) {
-		h->happens_before[i] =
-			h->happens_before[i] || old->happens_before[i];
-	}
+	bitset_or(h->happens_before, old->happens_before, old->depth);
 }
 
 static bool enabled_by(struct hax *h, struct hax *old)
@@ -648,34 +688,35 @@ static void compute_happens_before(struct hax *h)
 	 * earliest such Y (the one soonest after X_0) is the actual enabler. */
 	struct hax *enabler = NULL;
 
-	for (i = 0; i < h->depth; i++) {
-		h->happens_before[i] = false;
+	if (h->depth > 0) {
+		bitset_clear_all(h->happens_before, h->depth);
 	}
+	i = h->depth;
 
 	for (struct hax *old = h->parent; old != NULL; old = old->parent) {
 		assert(--i == old->depth); /* sanity check */
 		assert(old->depth >= 0 && old->depth < h->depth);
 		if (h->chosen_thread == old->chosen_thread) {
-			h->happens_before[old->depth] = true;
+			bitset_set(h->happens_before, old->depth, true);
 			inherit_happens_before(h, old);
 			/* Computing any further would be redundant, and would
 			 * break the true-enabler finding alg. */
 			break;
 		} else if (enabled_by(h, old)) {
 			enabler = old;
-			h->happens_before[enabler->depth] = true;
+			bitset_set(h->happens_before, enabler->depth, true);
 		}
 	}
 
 	/* Take the happens-before set of the oldest enabler. */
 	if (enabler != NULL) {
-		h->happens_before[enabler->depth] = true;
+		bitset_set(h->happens_before, enabler->depth, true);
 		inherit_happens_before(h, enabler);
 	}
 
 	lsprintf(DEV, "Transitions { ");
 	for (i = 0; i < h->depth; i++) {
-		if (h->happens_before[i]) {
+		if (bitset_get(h->happens_before, i)) {
 			printf(DEV, "#%d ", i);
 		}
 	}
@@ -715,9 +756,210 @@ void abort_transaction(unsigned int tid, struct hax *h2, unsigned int code)
 #endif
 }
 
+/******************************************************************************
+ * Background transition analysis
+ ******************************************************************************/
+
+/* Intersecting a just-completed transition's shm set with those of each of its
+ * ancestors reads only state saved in the tree, none of which changes until
+ * the branch ends (save for accesses belonging to the last transition that
+ * straggle in during a schedule in flight; see mem_check_shared_access). So it
+ * is done by a pool of ANALYSIS_THREADS worker threads, while simics runs the
+ * next transition. The intersections with different ancestors are independent,
+ * so the workers claim them one at a time; only their results are recorded,
+ * on the main thread and in ancestor order, by save_finish_analysis. Hence
+ * the output is the same regardless of how many workers there are. */
+
+struct analysis_worker {
+	struct analysis *a;
+	pthread_t thread;
+	/* conflicts found by this worker, in the order it found them */
+	shm_conflict_list_t conflicts;
+};
+
+struct intersection {
+	struct hax *old;
+	bool in_kernel;
+	/* false if mem_shm_may_conflict ruled it out without the full walk */
+	bool performed;
+	bool conflict;
+	/* this intersection's range of its worker's conflicts */
+	struct analysis_worker *worker;
+	unsigned int first_conflict;
+	unsigned int num_conflicts;
+};
+
+struct analysis {
+	/* The transition whose intersections are pending, or NULL. */
+	struct hax *h;
+	ARRAY_LIST(struct intersection) intersections;
+	/* Index of the next intersection for a worker to claim. */
+	unsigned int next;
+	/* How many worker threads are running. If none, everything is done
+	 * inline, using workers[0]'s conflict list. */
+	unsigned int num_threads;
+	struct analysis_worker *workers;
+	/* Bumped by the main thread to hand the workers a new job. */
+	unsigned int generation;
+	/* How many workers have yet to finish the current job. Protected by
+	 * lock, as is generation; all parties wait on cond for changes. */
+	unsigned int busy;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void run_intersections(struct analysis_worker *w)
+{
+	struct analysis *a = w->a;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&a->next, 1)) <
+	       ARRAY_LIST_SIZE(&a->intersections)) {
+		struct intersection *x = ARRAY_LIST_GET(&a->intersections, i);
+		x->worker = w;
+		x->first_conflict = ARRAY_LIST_SIZE(&w->conflicts);
+		x->performed = mem_shm_may_conflict(a->h, x->old, x->in_kernel);
+		x->conflict = x->performed &&
+			mem_shm_intersect(a->h, x->old, x->in_kernel,
+					  &w->conflicts);
+		x->num_conflicts =
+			ARRAY_LIST_SIZE(&w->conflicts) - x->first_conflict;
+	}
+}
+
+static void *analysis_thread(void *arg)
+{
+	struct analysis_worker *w = (struct analysis_worker *)arg;
+	struct analysis *a = w->a;
+	unsigned int generation = 0;
+
+	pthread_mutex_lock(&a->lock);
+	while (true) {
+		while (a->generation == generation) {
+			pthread_cond_wait(&a->cond, &a->lock);
+		}
+		generation = a->generation;
+		pthread_mutex_unlock(&a->lock);
+		run_intersections(w);
+		pthread_mutex_lock(&a->lock);
+		if (--a->busy == 0) {
+			pthread_cond_broadcast(&a->cond);
+		}
+	}
+	return NULL;
+}
+
+static void analysis_init(struct analysis *a)
+{
+	unsigned int i;
+
+	a->h = NULL;
+	ARRAY_LIST_INIT(&a->intersections, 64);
+	a->next = 0;
+	a->generation = 0;
+	a->busy = 0;
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->cond, NULL);
+
+	a->workers = MM_XMALLOC(MAX(ANALYSIS_THREADS, 1), struct analysis_worker);
+	for (i = 0; i < MAX(ANALYSIS_THREADS, 1); i++) {
+		a->workers[i].a = a;
+		ARRAY_LIST_INIT(&a->workers[i].conflicts, 64);
+	}
+
+	for (a->num_threads = 0; a->num_threads < ANALYSIS_THREADS;
+	     a->num_threads++) {
+		struct analysis_worker *w = &a->workers[a->num_threads];
+		if (pthread_create(&w->thread, NULL, analysis_thread, w) != 0) {
+			lsprintf(DEV, COLOUR_BOLD COLOUR_YELLOW "WARNING: "
+				 "could only start %u of %u analysis threads\n",
+				 a->num_threads, ANALYSIS_THREADS);
+			break;
+		}
+		pthread_detach(w->thread);
+	}
+}
+
+/* Queues up an intersection of the transition being created with an ancestor. */
+static void analysis_add(struct analysis *a, struct hax *old, bool in_kernel)
+{
+	struct intersection x;
+	x.old = old;
+	x.in_kernel = in_kernel;
+	ARRAY_LIST_APPEND(&a->intersections, x);
+}
+
+/* Starts computing the intersections queued up for h. */
+static void analysis_start(struct analysis *a, struct hax *h)
+{
+	assert(a->h == NULL && "previous analysis was never finished");
+	a->h = h;
+	a->next = 0;
+
+	if (a->num_threads == 0 || ARRAY_LIST_SIZE(&a->intersections) == 0) {
+		run_intersections(&a->workers[0]);
+		return;
+	}
+	pthread_mutex_lock(&a->lock);
+	a->busy = a->num_threads;
+	a->generation++;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+void save_finish_analysis(struct save_state *ss, struct ls_state *ls)
+{
+	struct analysis *a = ss->analysis;
+	struct hax *h = a->h;
+	struct intersection *x;
+	unsigned int i;
+
+	if (h == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&a->lock);
+	while (a->busy > 0) {
+		pthread_cond_wait(&a->cond, &a->lock);
+	}
+	pthread_mutex_unlock(&a->lock);
+
+	ARRAY_LIST_FOREACH(&a->intersections, i, x) {
+		struct hax *old = x->old;
+		if (!x->performed) {
+			/* Disjoint at a glance; no need for the full walk. */
+			bitset_set(h->conflicts, old->depth, false);
+			ss->total_intersects_skipped++;
+			continue;
+		}
+
+		mem_shm_report_conflicts(ls, h, old, x->in_kernel,
+					 &x->worker->conflicts.array[x->first_conflict],
+					 x->num_conflicts);
+		ss->total_intersects_performed++;
+		/* The haxes are independent if there was no intersection. */
+		bitset_set(h->conflicts, old->depth, x->conflict);
+		if (x->conflict) {
+			// TODO: reduction challenge: does it suffice
+			// TODO: to only tag one of these txns?
+			abort_transaction(h->chosen_thread, h->parent,
+					  _XABORT_CONFLICT);
+			abort_transaction(old->chosen_thread, old->parent,
+					  _XABORT_CONFLICT);
+		}
+	}
+
+	a->h = NULL;
+	a->intersections.size = 0;
+	for (i = 0; i < MAX(a->num_threads, 1); i++) {
+		a->workers[i].conflicts.size = 0;
+	}
+}
+
 /* Resets the current set of shared-memory accesses by moving what we've got so
- * far into the save point we're creating. Then, intersects the memory accesses
- * with those of each ancestor to compute independences and find data races.
+ * far into the save point we're creating. Then, queues up the intersections of
+ * its memory accesses with those of each ancestor, to compute independences
+ * and find data races in the background (see above).
  * NB: Looking for data races depends on having computed happens_before first. */
 static void shimsham_shm(struct ls_state *ls, struct hax *h, bool in_kernel)
 {
@@ -726,8 +968,14 @@ static void shimsham_shm(struct ls_state *ls, struct hax *h, bool in_kernel)
 	struct mem_state *newmem = in_kernel ? &ls->kern_mem   : &ls->user_mem;
 
 	/* store shared memory accesses from this transition; reset to empty */
-	oldmem->shm.rb_node = newmem->shm.rb_node;
-	newmem->shm.rb_node = NULL;
+	oldmem->shm = newmem->shm;
+	shm_set_init(&newmem->shm);
+	arena_move(&oldmem->shm_arena, &newmem->shm_arena);
+#ifdef PURE_HAPPENS_BEFORE
+	newmem->last_arena_clock.s = NULL;
+#endif
+	/* from now on it gets intersected with descendants' sets */
+	shm_set_freeze(&oldmem->shm);
 
 	/* do the same for the list of freed chunks in this transition */
 	oldmem->freed.rb_node = newmem->freed.rb_node;
@@ -736,11 +984,11 @@ static void shimsham_shm(struct ls_state *ls, struct hax *h, bool in_kernel)
 	/* ensure that memory tracking kept the shm heap totally empty for the
 	 * space (kernel or user) that we're NOT testing. */
 	if (in_kernel && testing_userspace()) {
-		assert(oldmem->shm.rb_node == NULL &&
+		assert(oldmem->shm.size == 0 &&
 		       "kernel shm nonempty when testing userspace");
 		return;
 	} else if (!in_kernel && !testing_userspace()) {
-		assert(oldmem->shm.rb_node == NULL &&
+		assert(oldmem->shm.size == 0 &&
 		       "user shm nonempty when testing kernelspace");
 		return;
 	}
@@ -754,25 +1002,15 @@ static void shimsham_shm(struct ls_state *ls, struct hax *h, bool in_kernel)
 		} else if (TID_IS_IDLE(h->chosen_thread) ||
 			   TID_IS_IDLE(old->chosen_thread)) {
 			/* Idle shouldn't have siblings, but just in case. */
-			h->conflicts[old->depth] = true;
+			bitset_set(h->conflicts, old->depth, true);
 		} else if (old->depth == 0) {
 			/* Basically guaranteed, and irrelevant. Suppress printing. */
-			h->conflicts[0] = true;
-		} else if (h->happens_before[old->depth]) {
+			bitset_set(h->conflicts, 0, true);
+		} else if (bitset_get(h->happens_before, old->depth)) {
 			/* No conflict if reordering is impossible */
-			h->conflicts[old->depth] = false;
+			bitset_set(h->conflicts, old->depth, false);
 		} else {
-			/* The haxes are independent if there was no intersection. */
-			h->conflicts[old->depth] =
-				mem_shm_intersect(ls, h, old, in_kernel);
-			if (h->conflicts[old->depth]) {
-				// TODO: reduction challenge: does it suffice
-				// TODO: to only tag one of these txns?
-				abort_transaction(h->chosen_thread, h->parent,
-						  _XABORT_CONFLICT);
-				abort_transaction(old->chosen_thread, old->parent,
-						  _XABORT_CONFLICT);
-			}
+			analysis_add(ls->save.analysis, old, in_kernel);
 		}
 	}
 }
@@ -786,23 +1024,37 @@ void save_init(struct save_state *ss)
 	ss->root = NULL;
 	ss->current = NULL;
 	ss->next_tid = -1;
+	ss->next_txn = false;
+	ss->next_xabort_code = 0;
 	ss->total_choice_poince = 0;
 	ss->total_choices = 0;
 	ss->total_jumps = 0;
 	ss->total_triggers = 0;
 	ss->depth_total = 0;
 	ss->total_usecs = 0;
+	ss->total_restore_moves = 0;
+	ss->total_restore_copies = 0;
+	ss->total_intersects_skipped = 0;
+	ss->total_intersects_performed = 0;
+	ss->tree_bytes = 0;
+	ss->total_compactions = 0;
+
+	ss->analysis = MM_XMALLOC(1, struct analysis);
+	analysis_init(ss->analysis);
 
 	update_time(&ss->last_save_time);
 }
 
-void save_recover(struct save_state *ss, struct ls_state *ls, int new_tid)
+void save_recover(struct save_state *ss, struct ls_state *ls, int new_tid,
+		  bool txn, unsigned int xabort_code)
 {
 	/* After a longjmp, we will be on exactly the node we jumped to, but
 	 * there must be a special call to let us know what our new course is
 	 * (see sched_recover). */
 	assert(ls->just_jumped);
 	ss->next_tid = new_tid;
+	ss->next_txn = txn;
+	ss->next_xabort_code = xabort_code;
 	lsprintf(INFO, "explorer chose tid %d; ready for action\n", new_tid);
 }
 
@@ -820,6 +1072,10 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 {
 	struct hax *h;
 
+	/* the last transition's results must be in the tree before this one's
+	 * intersections with it can be started */
+	save_finish_analysis(ss, ls);
+
 	lsprintf(INFO, "tid %d to eip 0x%x, where we %s tid %d\n", ss->next_tid,
 		 ls->eip, our_choice ? "choose" : "follow", new_tid);
 
@@ -834,6 +1090,8 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 		h->eip           = ls->eip;
 		h->trigger_count = ls->trigger_count;
 		h->chosen_thread = ss->next_tid;
+		h->chosen_txn    = ss->next_txn;
+		h->chosen_xabort_code = ss->next_xabort_code;
 
 		/* compute elapsed and cumulative time */
 		h->usecs = update_time(&ss->last_save_time);
@@ -866,6 +1124,8 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 		}
 
 		Q_INIT_HEAD(&h->children);
+		h->compacted_children = NULL;
+		h->num_compacted_children = 0;
 		h->all_explored = end_of_test;
 
 		h->data_race_eip = data_race_eip;
@@ -903,11 +1163,8 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 				/* first frame of stack will be bogus, due to
 				 * the technique for delaying the access (in
 				 * x86.c). fix it up with the proper eip. */
-				struct stack_frame *first_frame =
-					Q_GET_HEAD(&h->stack_trace->frames);
-				assert(first_frame != NULL);
-				destroy_frame(first_frame);
-				eip_to_frame(data_race_eip, first_frame);
+				h->stack_trace = stack_trace_replace_top(
+					h->stack_trace, data_race_eip);
 			}
 		}
 
@@ -935,10 +1192,10 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 	}
 
 	h->oldsched = MM_XMALLOC(1, struct sched_state);
-	copy_sched(h->oldsched, &ls->sched);
+	copy_sched(h->oldsched, &ls->sched, false);
 
 	h->oldtest = MM_XMALLOC(1, struct test_state);
-	copy_test(h->oldtest, &ls->test);
+	copy_test(h->oldtest, &ls->test, false);
 
 	h->old_kern_mem = MM_XMALLOC(1, struct mem_state);
 	copy_mem(h->old_kern_mem, &ls->kern_mem, true);
@@ -952,8 +1209,8 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 	h->old_symtable = get_symtable();
 
 	if (h->depth > 0) {
-		h->conflicts      = MM_XMALLOC(h->depth, bool);
-		h->happens_before = MM_XMALLOC(h->depth, bool);
+		h->conflicts      = BITSET_XMALLOC(h->depth);
+		h->happens_before = BITSET_XMALLOC(h->depth);
 		/* For progress sense. */
 		ss->total_triggers +=
 			ls->trigger_count - h->parent->trigger_count;
@@ -968,9 +1225,11 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 	 * at all (e.g., running in user mode, the kernel shm will be empty). */
 	shimsham_shm(ls, h, true);
 	shimsham_shm(ls, h, false);
+	analysis_start(ss->analysis, h);
 
 	ss->current  = h;
 	ss->next_tid = new_tid;
+	ss->next_txn = false;
 	if (h->chosen_thread == -1) {
 		lsprintf(CHOICE, MODULE_COLOUR "#%d: Starting test with TID %d.\n"
 			 COLOUR_DEFAULT, h->depth, ss->next_tid);
@@ -999,10 +1258,14 @@ void save_setjmp(struct save_state *ss, struct ls_state *ls,
 	ss->total_choices++;
 }
 
-void save_longjmp(struct save_state *ss, struct ls_state *ls, struct hax *h)
+void save_longjmp(struct save_state *ss, struct ls_state *ls, struct hax *h,
+		  bool last_visit)
 {
 	struct hax *rabbit = ss->current;
 
+	/* about to free the saved state it reads */
+	save_finish_analysis(ss, ls);
+
 	assert(ss->root != NULL && "Can't longjmp with no decision tree!");
 	assert(ss->current != NULL);
 	assert(ss->current->estimate_computed);
@@ -1015,8 +1278,10 @@ void save_longjmp(struct save_state *ss, struct ls_state *ls, struct hax *h)
 
 	/* Find the target choice point from among our ancestors. */
 	while (ss->current != h) {
-		/* This nobe will soon be in the future. Reclaim memory. */
-		free_hax(ss->current);
+		/* This nobe will soon be in the future. Reclaim memory. What's
+		 * left of it stays in the tree until its parent is freed. */
+		ss->tree_bytes -= free_hax(ss->current);
+		ss->tree_bytes += sizeof(struct hax);
 		run_command(ls->cmd_file, CMD_DELETE, (lang_void *)ss->current);
 
 		ss->current = ss->current->parent;
@@ -1032,15 +1297,26 @@ void save_longjmp(struct save_state *ss, struct ls_state *ls, struct hax *h)
 		assert(rabbit != ss->current && "somehow, a cycle?!?");
 	}
 
+	if (last_visit) {
+		assert(h->parent != NULL && "root may be revisited by ICB");
+		ss->total_restore_moves++;
+	} else {
+		ss->total_restore_copies++;
+	}
+
+	if (TREE_MEMORY_LIMIT_KB != 0 &&
+	    ss->tree_bytes > (uint64_t)TREE_MEMORY_LIMIT_KB * 1024) {
+		compact_explored_children(ss);
+	}
+
 	PRINT_TREE_INFO(DEV, ls);
 
-	restore_ls(ls, h);
+	restore_ls(ls, h, last_visit);
 
 	run_command(ls->cmd_file, CMD_SKIPTO, (lang_void *)h);
 	ss->total_jumps++;
 }
 
-#ifdef ICB
 void save_reset_tree(struct save_state *ss, struct ls_state *ls)
 {
 	struct hax *root = ss->root;
@@ -1052,10 +1328,11 @@ void save_reset_tree(struct save_state *ss, struct ls_state *ls)
 	);
 
 	/* As before but with some additional changes */
-	save_longjmp(ss, ls, root);
+	save_longjmp(ss, ls, root, false);
 
 	/* Need to reset tree state as if this is the 1st time we came here. */
-	free_haxs_children(root);
+	ss->tree_bytes -= free_haxs_children(root);
+	assert(ss->tree_bytes == 0);
 	root->all_explored = false;
 	root->marked_children = 0;
 	root->proportion = 0.0L;
@@ -1068,10 +1345,8 @@ void save_reset_tree(struct save_state *ss, struct ls_state *ls)
 	ss->total_triggers = 0;
 	ss->depth_total = 0;
 	ss->total_usecs = root->usecs;
+	ss->total_restore_moves = 0;
+	ss->total_restore_copies = 0;
+	ss->total_intersects_skipped = 0;
+	ss->total_intersects_performed = 0;
 }
-#else
-void save_reset_tree(struct save_state *ss, struct ls_state *ls)
-{
-	assert(0 && "how did this get here i am not good with computer");
-}
-#endif
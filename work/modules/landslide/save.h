@@ -13,6 +13,7 @@
 
 struct ls_state;
 struct hax;
+struct analysis;
 
 struct save_state {
 	/* The root of the decision tree, or NULL if save_setjmp() was never
@@ -21,12 +22,27 @@ struct save_state {
 	/* If root is set, this points to the "current" node in the tree */
 	struct hax *current;
 	int next_tid;
+	/* Whether next_tid is to fail its transaction, rather than just run. */
+	bool next_txn;
+	unsigned int next_xabort_code;
 	/* Statistics */
 	uint64_t total_choice_poince;
 	uint64_t total_choices;
 	uint64_t total_jumps;
 	uint64_t total_triggers;
 	uint64_t depth_total;
+	/* How many longjmps could hand over the target's saved state outright,
+	 * versus having to duplicate it because it might be restored again. */
+	uint64_t total_restore_moves;
+	uint64_t total_restore_copies;
+	/* How many pairs of transitions' shm sets were ruled independent by
+	 * their summaries alone, versus needing the full intersection. */
+	uint64_t total_intersects_skipped;
+	uint64_t total_intersects_performed;
+	/* Memory footprint of fully-explored children kept in the tree, which
+	 * is kept under TREE_MEMORY_LIMIT_KB by compacting them. */
+	uint64_t tree_bytes;
+	uint64_t total_compactions;
 
 	/* Records the timestamp last time we arrived at a node in the tree.
 	 * This is updated only during save_setjmp -- it doesn't need to be during
@@ -34,13 +50,18 @@ struct save_state {
 	 * on the last nobe in the previous branch. */
 	struct timeval last_save_time;
 	uint64_t total_usecs;
+
+	/* Intersections of the last transition with its ancestors, which may
+	 * still be in progress; see save_finish_analysis. */
+	struct analysis *analysis;
 };
 
 void abort_transaction(unsigned int tid, struct hax *h2, unsigned int code);
 
 void save_init(struct save_state *);
 
-void save_recover(struct save_state *, struct ls_state *, int new_tid);
+void save_recover(struct save_state *, struct ls_state *, int new_tid,
+		  bool txn, unsigned int xabort_code);
 
 /* Current state, and the next_tid/our_choice is about the next in-flight
  * choice. */
@@ -50,9 +71,21 @@ void save_setjmp(struct save_state *, struct ls_state *,
 		 bool voluntary, bool xbegin);
 
 /* If hax is NULL, then longjmps to the root. Otherwise, hax must be between
- * the current choice point and the root (inclusive). */
-void save_longjmp(struct save_state *, struct ls_state *, struct hax *);
+ * the current choice point and the root (inclusive). If last_visit is set, the
+ * caller promises that hax will never be longjmped to again (see explore.h). */
+void save_longjmp(struct save_state *, struct ls_state *, struct hax *,
+		  bool last_visit);
 
 void save_reset_tree(struct save_state *ss, struct ls_state *ls);
 
+/* The conflicts and data races between the most recent transition and its
+ * ancestors are computed in the background after each setjmp. This waits for
+ * them, then records them in the tree. Anything that reads h->conflicts, the
+ * data race state, or PPs enabled by data races, or that changes the current
+ * transition's saved shm set, must call this first. */
+void save_finish_analysis(struct save_state *ss, struct ls_state *ls);
+
+unsigned int num_children(struct hax *h);
+bool has_explored_child(struct hax *h, int tid, bool need_all_explored);
+
 #endif
@@ -126,8 +126,12 @@ static void agent_fork(struct sched_state *s, unsigned int tid, bool on_runqueue
 	init_malloc_actions(&a->user_malloc_flags);
 #endif
 
-	lockset_init(&a->kern_locks_held);
-	lockset_init(&a->user_locks_held);
+	a->kern_locks_held = LOCKSET_EMPTY;
+	a->user_locks_held = LOCKSET_EMPTY;
+	shadow_stack_init(&a->kern_shadow_stack);
+	shadow_stack_init(&a->user_shadow_stack);
+	chunk_cache_init(&a->kern_chunk_cache);
+	chunk_cache_init(&a->user_chunk_cache);
 #ifdef PURE_HAPPENS_BEFORE
 	vc_init(&a->clock);
 	/* start child clock at a non-bottom value - not quite sure if needed,
@@ -228,13 +232,13 @@ static void agent_vanish(struct sched_state *s)
 	if (s->last_vanished_agent) {
 		assert(!s->last_vanished_agent->action.handling_timer);
 		assert(s->last_vanished_agent->action.context_switch);
-		lockset_free(&s->last_vanished_agent->kern_locks_held);
-		lockset_free(&s->last_vanished_agent->user_locks_held);
+		shadow_stack_free(&s->last_vanished_agent->kern_shadow_stack);
+		shadow_stack_free(&s->last_vanished_agent->user_shadow_stack);
 #ifdef PURE_HAPPENS_BEFORE
 		vc_destroy(&s->last_vanished_agent->clock);
 #endif
 		if (s->last_vanished_agent->pre_vanish_trace != NULL) {
-			free_stack_trace(s->last_vanished_agent->pre_vanish_trace);
+			stack_trace_unref(s->last_vanished_agent->pre_vanish_trace);
 		}
 		MM_FREE(s->last_vanished_agent);
 	}
@@ -789,7 +793,7 @@ static void sched_update_kern_state_machine(struct ls_state *ls)
 			printf(DEV, "\n");
 			s->voluntary_resched_tid = CURRENT(s, tid);
 			if (s->voluntary_resched_stack != NULL)
-				free_stack_trace(s->voluntary_resched_stack);
+				stack_trace_unref(s->voluntary_resched_stack);
 			s->voluntary_resched_stack = stack_trace(ls);
 		}
 		if (ls->instruction_text[0] == OPCODE_INT) {
@@ -1100,7 +1104,7 @@ static void sched_update_user_state_machine(struct ls_state *ls)
 	if (USER_MEMORY(ls->eip) && CURRENT(s, pre_vanish_trace) != NULL) {
 		assert(0 && "thread went back to userspace after entering vanish");
 		// FIXME(#130) uncomment below to enable more flexibility
-		// free_stack_trace(CURRENT(s, pre_vanish_trace));
+		// stack_trace_unref(CURRENT(s, pre_vanish_trace));
 		// CURRENT(s, pre_vanish_trace) = NULL;
 	}
 
@@ -1636,6 +1640,13 @@ void sched_update(struct ls_state *ls)
 	}
 #endif
 
+	/* Likewise, keep the shadow call stacks up to date (skipping the
+	 * context switcher, during which cur_agent can't be trusted to match
+	 * the stack in use), for the sake of within_function directives. */
+	if (!ACTION(s, context_switch)) {
+		update_shadow_stacks(ls);
+	}
+
 	/**********************************************************************
 	 * Exercise our will upon the guest kernel
 	 **********************************************************************/
@@ -1793,6 +1804,8 @@ void sched_update(struct ls_state *ls)
 		struct agent *current = voluntary ? s->last_agent : s->cur_agent;
 		struct agent *chosen;
 		bool our_choice;
+		bool replayed, replay_txn;
+		unsigned int replay_xabort_code;
 
 		assert(!(data_race && voluntary));
 		assert(!ACTION(s, user_txn));
@@ -1829,13 +1842,22 @@ void sched_update(struct ls_state *ls)
 		 * must not choose it). */
 		check_user_yield_activity(&ls->user_sync, current);
 
-		if (arbiter_choose(ls, current, voluntary, &chosen, &our_choice)) {
+		replayed = arbiter_replay_choice(ls, voluntary, &chosen,
+						 &our_choice, &replay_txn,
+						 &replay_xabort_code);
+		if (replayed ||
+		    arbiter_choose(ls, current, voluntary, &chosen, &our_choice)) {
 			int data_race_eip = -1;
 			if (data_race) {
 				/* Is this a "fake" preemption point? If so we
 				 * are not to forcibly preempt, only to record
 				 * a save point. */
-				if (!agent_is_user_yield_blocked(&current->user_yield)) {
+				if (replayed) {
+					/* Unless the trace being replayed says
+					 * it became real on the way to a bug. */
+					lsprintf(DEV, "DR PP; replaying choice "
+						 "of TID %d\n", chosen->tid);
+				} else if (!agent_is_user_yield_blocked(&current->user_yield)) {
 					lsprintf(DEV, "DR PP; overriding arb "
 						 "choice %d with current %d\n",
 						 chosen->tid, current->tid);
@@ -1894,6 +1916,16 @@ void sched_update(struct ls_state *ls)
 					    our_choice, false, !data_race,
 					    data_race_eip, voluntary, xbegin);
 			}
+			/* As in sched_recover, but going forwards. */
+			if (replayed && replay_txn) {
+				assert(chosen == s->cur_agent);
+				lsprintf(INFO, "TID %d fails to transact\n",
+					 chosen->tid);
+				ls->eip = cause_transaction_failure(
+					ls->cpu0, replay_xabort_code);
+				ls->save.next_txn = true;
+				ls->save.next_xabort_code = replay_xabort_code;
+			}
 		} else {
 			lsprintf(DEV, "no agent was chosen at eip 0x%x\n",
 				 ls->eip);
@@ -1927,6 +1959,26 @@ void sched_update(struct ls_state *ls)
 	 * switch, so we should watch out if a handler doesn't enter the c-s. */
 }
 
+/* Whether sched_update() would do nothing at the current instruction, assuming
+ * it's not at any annotated eip, nor any opcode the state machines look for.
+ * That's so unless some operation spanning several instructions is underway,
+ * such as a schedule in flight or a delayed instruction. */
+bool sched_can_skip_update(struct ls_state *ls)
+{
+	struct sched_state *s = &ls->sched;
+
+	return s->guest_init_done && !s->entering_timer &&
+		s->schedule_in_flight == NULL && !s->delayed_in_flight &&
+		!s->just_finished_reschedule && !s->delayed_txn_fail &&
+		!ACTION(s, just_forked) && !ACTION(s, user_txn) &&
+		!CURRENT(s, just_delayed_for_data_race) &&
+		!CURRENT(s, just_delayed_for_vr_exit) &&
+#ifdef PREEMPT_EVERYWHERE
+		!CURRENT(s, preempt_for_shm_here) &&
+#endif
+		!XCHG_BLOCKED(&CURRENT(s, user_yield));
+}
+
 void sched_recover(struct ls_state *ls)
 {
 	struct sched_state *s = &ls->sched;
@@ -1960,12 +2012,12 @@ void sched_recover(struct ls_state *ls)
 			 * as a preemption for ICB. */
 			if (!NO_PREEMPTION_REQUIRED(s, ls->save.current->voluntary, a)) {
 				s->icb_preemption_count++;
-#ifdef ICB
-				lsprintf(DEV, "Switching to TID %d counts as a "
-					 "preemption for ICB.\n", a->tid);
-				assert(s->icb_preemption_count <= ls->icb_bound &&
-				       "ouch! BPOR tried to preempt too much!");
-#endif
+				if (ls->icb) {
+					lsprintf(DEV, "Switching to TID %d counts as "
+						 "a preemption for ICB.\n", a->tid);
+					assert(s->icb_preemption_count <= ls->icb_bound &&
+					       "ouch! BPOR tried to preempt too much!");
+				}
 			}
 		} else if (kern_timer_entering(ls->eip)) {
 			/* Oops, we ended up trying to leave the thread we want
@@ -1996,8 +2048,10 @@ void sched_recover(struct ls_state *ls)
 		 * will always be legal w/o "preempting" (per ICB). */
 	} else {
 		tid = CURRENT(s, tid);
+		txn = false;
+		xabort_code = 0;
 		lsprintf(BUG, "Explorer chose no tid; defaulting to %d\n", tid);
 	}
 
-	save_recover(&ls->save, ls, tid);
+	save_recover(&ls->save, ls, tid, txn, xabort_code);
 }
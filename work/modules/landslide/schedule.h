@@ -126,8 +126,8 @@ struct agent {
 	unsigned int most_recent_syscall;
 	unsigned int last_call; /* like a mini (much faster) stack trace */
 	/* locks held for data race detection */
-	struct lockset kern_locks_held;
-	struct lockset user_locks_held;
+	lockset_id_t kern_locks_held;
+	lockset_id_t user_locks_held;
 #ifdef PURE_HAPPENS_BEFORE
 	struct vector_clock clock;
 #endif
@@ -135,6 +135,12 @@ struct agent {
 	struct user_yield_state user_yield;
 	/* Possible stack trace saved from before sim_unreg_process. */
 	struct stack_trace *pre_vanish_trace;
+	/* For answering within-function queries; see pp.c. */
+	struct shadow_stack kern_shadow_stack;
+	struct shadow_stack user_shadow_stack;
+	/* For the per-access heap check; see find_alloced_chunk_cached. */
+	struct chunk_cache kern_chunk_cache;
+	struct chunk_cache user_chunk_cache;
 	/* Used by partial order reduction, only in "oldsched"s in the tree. */
 	bool do_explore;
 };
@@ -294,14 +300,13 @@ struct sched_state {
 	(__a == ____s->cur_agent ||					\
 	 ((voluntary) && __a == ____s->last_agent)); })
 
-#ifdef ICB
+/* Without ICB the bound is ICB_UNBOUNDED, so this never holds, and needs no
+ * separate check of whether ICB is enabled. */
+#define ICB_UNBOUNDED ((unsigned int)-1)
 #define ICB_BLOCKED(s, bound, voluntary, a) ({			\
 	struct sched_state *__s = (s);				\
 	(__s->icb_preemption_count >= (bound) &&		\
 	 !NO_PREEMPTION_REQUIRED(__s, voluntary, a)); })
-#else
-#define ICB_BLOCKED(ls, bound, voluntary, a) false
-#endif
 
 #define HTM_BLOCKED(s, a) ((s)->any_thread_txn && \
 			   (a)->action.user_wants_txn && !(a)->action.user_txn)
@@ -318,6 +323,7 @@ struct agent *find_runnable_agent(struct sched_state *s, unsigned int tid);
 
 /* called at every "interesting" point ... */
 void sched_update(struct ls_state *);
+bool sched_can_skip_update(struct ls_state *);
 /* called after time-travel */
 void sched_recover(struct ls_state *);
 
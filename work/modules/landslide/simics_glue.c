@@ -14,6 +14,7 @@
 
 #include "landslide.h"
 #include "found_a_bug.h"
+#include "snapshot.h"
 
 #define SIM_MODULE_NAME "landslide"
 
@@ -141,12 +142,48 @@ static attr_value_t get_ls_quicksand_pps_attribute(
 	return SIM_make_attr_string("/dev/null");
 }
 
+/* Boot snapshots; see snapshot.c. Like the filenames above, write-only. */
+static set_error_t set_ls_boot_snapshot_attribute(
+	void *arg, conf_object_t *obj, attr_value_t *val, attr_value_t *idx)
+{
+	struct ls_state *ls = (struct ls_state *)obj;
+	if (snapshot_save(ls, SIM_attr_string(*val))) {
+		return Sim_Set_Ok;
+	} else {
+		return Sim_Set_Not_Writable;
+	}
+}
+static attr_value_t get_ls_boot_snapshot_attribute(
+	void *arg, conf_object_t *obj, attr_value_t *idx)
+{
+	return SIM_make_attr_string("/dev/null");
+}
+
+static set_error_t set_ls_warm_start_attribute(
+	void *arg, conf_object_t *obj, attr_value_t *val, attr_value_t *idx)
+{
+	struct ls_state *ls = (struct ls_state *)obj;
+	if (snapshot_load(ls, SIM_attr_string(*val))) {
+		return Sim_Set_Ok;
+	} else {
+		return Sim_Set_Not_Writable;
+	}
+}
+static attr_value_t get_ls_warm_start_attribute(
+	void *arg, conf_object_t *obj, attr_value_t *idx)
+{
+	return SIM_make_attr_string("/dev/null");
+}
+
 /* init_local() is called once when the device module is loaded into Simics */
 void init_local(void)
 {
 	const class_data_t funcs = {
 		.new_instance = ls_new_instance,
 		.class_desc = "hax and sploits",
+		/* Never checkpointed with the machine; for warm starting, the
+		 * boot_snapshot attribute saves what's needed instead. */
+		.kind = Sim_Class_Kind_Pseudo,
 		.description = "here we have a simix module which provides not"
 			" only hax or sploits individually but rather a great"
 			" conjunction of the two."
@@ -173,4 +210,8 @@ void init_local(void)
 			 "Filename to use for HTML preemption trace output");
 	LS_ATTR_REGISTER(conf_class, quicksand_pps, "s",
 			 "Filename for dynamic Quicksand-supplied PP config");
+	LS_ATTR_REGISTER(conf_class, boot_snapshot, "s",
+			 "Filename to save post-boot state to, for warm starts");
+	LS_ATTR_REGISTER(conf_class, warm_start, "s",
+			 "Filename of post-boot state to resume from");
 }
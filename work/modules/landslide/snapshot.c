@@ -0,0 +1,434 @@
+/**
+ * @file snapshot.c
+ * @brief saving landslide's post-boot state, so later jobs can skip booting
+ * @author Ben Blum
+ *
+ * When warm starting (see WARM_START in config.landslide.example), the first
+ * job checkpoints the simulated machine when it's ready for the test case to
+ * be typed at the shell, and landslide saves alongside it what it learned by
+ * watching the guest boot. Later jobs restore the machine instead of booting
+ * it, and load that state into their freshly created landslide object, which
+ * is itself never part of a simics checkpoint (see simics_glue.c).
+ *
+ * A snapshot is only good for the build that wrote it, which is why it lives
+ * in that build's cache entry (see build.sh), so structs are written raw, and
+ * anything they point to is written after them and repointed when read back.
+ */
+
+#include <string.h>
+
+#define MODULE_NAME "SNAPSHOT"
+#define MODULE_COLOUR COLOUR_DARK COLOUR_GREEN
+
+#include "common.h"
+#include "landslide.h"
+#include "lockset.h"
+#include "memory.h"
+#include "rand.h"
+#include "schedule.h"
+#include "snapshot.h"
+#include "stack.h"
+#include "user_sync.h"
+
+#define SNAPSHOT_MAGIC 0x15b007ed
+
+/* In case it gets loaded by some other build anyway. */
+struct snapshot_header {
+	unsigned int magic;
+	unsigned int agent_size;
+	unsigned int sched_size;
+	unsigned int mem_size;
+};
+
+static void init_header(struct snapshot_header *header)
+{
+	memset(header, 0, sizeof(*header));
+	header->magic      = SNAPSHOT_MAGIC;
+	header->agent_size = sizeof(struct agent);
+	header->sched_size = sizeof(struct sched_state);
+	header->mem_size   = sizeof(struct mem_state);
+}
+
+/******************************************************************************
+ * file helpers
+ ******************************************************************************/
+
+void snapshot_write(struct snapshot *s, const void *buf, unsigned int len)
+{
+	if (s->ok && fwrite(buf, 1, len, s->file) != len) {
+		s->ok = false;
+	}
+}
+
+/* On failure, the rest of the file reads as zeroes. */
+void snapshot_read(struct snapshot *s, void *buf, unsigned int len)
+{
+	if (!s->ok || fread(buf, 1, len, s->file) != len) {
+		s->ok = false;
+		memset(buf, 0, len);
+	}
+}
+
+void snapshot_write_trace(struct snapshot *s, const struct stack_trace *st)
+{
+	bool present = st != NULL;
+	SNAPSHOT_WRITE(s, present);
+	if (present) {
+		unsigned int num_eips = ARRAY_LIST_SIZE(&st->eips);
+		SNAPSHOT_WRITE(s, st->tid);
+		SNAPSHOT_WRITE(s, num_eips);
+		snapshot_write(s, st->eips.array, num_eips * sizeof(unsigned int));
+	}
+}
+
+struct stack_trace *snapshot_read_trace(struct snapshot *s)
+{
+	bool present = false;
+	SNAPSHOT_READ(s, present);
+	if (!present) {
+		return NULL;
+	}
+
+	unsigned int tid = 0;
+	unsigned int num_eips = 0;
+	SNAPSHOT_READ(s, tid);
+	SNAPSHOT_READ(s, num_eips);
+	if (!s->ok) {
+		return NULL;
+	}
+	unsigned int *eips = MM_XMALLOC(num_eips == 0 ? 1 : num_eips, unsigned int);
+	snapshot_read(s, eips, num_eips * sizeof(unsigned int));
+	struct stack_trace *st = s->ok ?
+		stack_trace_from_eips(tid, eips, num_eips) : NULL;
+	MM_FREE(eips);
+	return st;
+}
+
+/******************************************************************************
+ * scheduler state
+ ******************************************************************************/
+
+static void write_agent(struct snapshot *s, const struct agent *a)
+{
+	SNAPSHOT_WRITE(s, *a);
+	snapshot_write_trace(s, a->pre_vanish_trace);
+}
+
+/* As in copy_agent, caches are left to be rebuilt. */
+static struct agent *read_agent(struct snapshot *s)
+{
+	struct agent *a = MM_XMALLOC(1, struct agent);
+	SNAPSHOT_READ(s, *a);
+	a->kern_blocked_on = NULL; /* Will be recomputed later if needed */
+	a->pre_vanish_trace = snapshot_read_trace(s);
+	shadow_stack_init(&a->kern_shadow_stack);
+	shadow_stack_init(&a->user_shadow_stack);
+	chunk_cache_init(&a->kern_chunk_cache);
+	chunk_cache_init(&a->user_chunk_cache);
+	a->do_explore = false;
+	return a;
+}
+
+static void write_sched_q(struct snapshot *s, struct agent_q *q)
+{
+	unsigned int num_agents = Q_GET_SIZE(q);
+	struct agent *a;
+
+	SNAPSHOT_WRITE(s, num_agents);
+	Q_FOREACH(a, q, nobe) {
+		write_agent(s, a);
+	}
+}
+
+/* Keeps the agents in the order they were written, which exploration order
+ * depends on; inserts at the head, like copy_sched_q, back to front. */
+static void read_sched_q(struct snapshot *s, struct agent_q *q)
+{
+	unsigned int num_agents = 0;
+	SNAPSHOT_READ(s, num_agents);
+	if (!s->ok || num_agents == 0) {
+		return;
+	}
+
+	struct agent **agents = MM_XMALLOC(num_agents, struct agent *);
+	for (unsigned int i = 0; i < num_agents; i++) {
+		agents[i] = read_agent(s);
+	}
+	for (unsigned int i = num_agents; i > 0; i--) {
+		Q_INSERT_HEAD(q, agents[i - 1], nobe);
+	}
+	MM_FREE(agents);
+}
+
+/* Gets rid of the agents sched_init made for the threads in a fresh guest. */
+static void discard_sched_q(struct agent_q *q)
+{
+	while (Q_GET_SIZE(q) > 0) {
+		struct agent *a = Q_GET_HEAD(q);
+		Q_REMOVE(q, a, nobe);
+		shadow_stack_free(&a->kern_shadow_stack);
+		shadow_stack_free(&a->user_shadow_stack);
+#ifdef PURE_HAPPENS_BEFORE
+		vc_destroy(&a->clock);
+#endif
+		if (a->pre_vanish_trace != NULL) {
+			stack_trace_unref(a->pre_vanish_trace);
+		}
+		MM_FREE(a);
+	}
+}
+
+static void write_sched(struct snapshot *s, struct sched_state *sched)
+{
+	assert(sched->cur_agent != NULL && "no current agent after boot?");
+	assert(sched->schedule_in_flight == NULL);
+
+	write_sched_q(s, &sched->rq);
+	write_sched_q(s, &sched->dq);
+	write_sched_q(s, &sched->sq);
+
+	/* The last_vanished agent is not on any queues. */
+	bool has_vanished = sched->last_vanished_agent != NULL;
+	SNAPSHOT_WRITE(s, has_vanished);
+	if (has_vanished) {
+		write_agent(s, sched->last_vanished_agent);
+	}
+
+	/* The others are on queues, so just remember which. */
+	bool has_last = sched->last_agent != NULL;
+	bool last_vanished = has_last &&
+		sched->last_agent == sched->last_vanished_agent;
+	unsigned int last_tid = has_last ? sched->last_agent->tid : 0;
+	SNAPSHOT_WRITE(s, sched->cur_agent->tid);
+	SNAPSHOT_WRITE(s, has_last);
+	SNAPSHOT_WRITE(s, last_vanished);
+	SNAPSHOT_WRITE(s, last_tid);
+
+	unsigned int num_semaphores = ARRAY_LIST_SIZE(&sched->known_semaphores.list);
+	SNAPSHOT_WRITE(s, num_semaphores);
+	snapshot_write(s, sched->known_semaphores.list.array,
+		       num_semaphores * sizeof(struct lock));
+
+	SNAPSHOT_WRITE(s, sched->current_extra_runnable);
+	SNAPSHOT_WRITE(s, sched->num_agents);
+	SNAPSHOT_WRITE(s, sched->most_agents_ever);
+	SNAPSHOT_WRITE(s, sched->deadlock_fp_avoidance_count);
+	SNAPSHOT_WRITE(s, sched->icb_preemption_count);
+	SNAPSHOT_WRITE(s, sched->any_thread_txn);
+	SNAPSHOT_WRITE(s, sched->delayed_txn_fail);
+	SNAPSHOT_WRITE(s, sched->delayed_txn_fail_tid);
+	SNAPSHOT_WRITE(s, sched->delayed_txn_fail_code);
+	SNAPSHOT_WRITE(s, sched->guest_init_done);
+	SNAPSHOT_WRITE(s, sched->inflight_tick_count);
+	SNAPSHOT_WRITE(s, sched->delayed_in_flight);
+	SNAPSHOT_WRITE(s, sched->just_finished_reschedule);
+	SNAPSHOT_WRITE(s, sched->entering_timer);
+	SNAPSHOT_WRITE(s, sched->voluntary_resched_tid);
+	snapshot_write_trace(s, sched->voluntary_resched_stack);
+}
+
+/* sched must be as sched_init left it. */
+static void read_sched(struct snapshot *s, struct sched_state *sched)
+{
+	assert(sched->last_vanished_agent == NULL);
+	assert(sched->voluntary_resched_stack == NULL);
+	discard_sched_q(&sched->rq);
+	discard_sched_q(&sched->dq);
+	discard_sched_q(&sched->sq);
+	sched->cur_agent = NULL;
+	sched->last_agent = NULL;
+
+	read_sched_q(s, &sched->rq);
+	read_sched_q(s, &sched->dq);
+	read_sched_q(s, &sched->sq);
+
+	bool has_vanished = false;
+	SNAPSHOT_READ(s, has_vanished);
+	if (has_vanished) {
+		sched->last_vanished_agent = read_agent(s);
+	}
+
+	unsigned int cur_tid = 0;
+	bool has_last = false;
+	bool last_vanished = false;
+	unsigned int last_tid = 0;
+	SNAPSHOT_READ(s, cur_tid);
+	SNAPSHOT_READ(s, has_last);
+	SNAPSHOT_READ(s, last_vanished);
+	SNAPSHOT_READ(s, last_tid);
+	if (!s->ok) {
+		return;
+	}
+	sched->cur_agent = find_agent(sched, cur_tid);
+	if (last_vanished) {
+		sched->last_agent = sched->last_vanished_agent;
+	} else if (has_last) {
+		sched->last_agent = find_agent(sched, last_tid);
+	}
+	assert(sched->cur_agent != NULL && "snapshot lost the current agent");
+	assert((!has_last || sched->last_agent != NULL) &&
+	       "snapshot lost the last agent");
+
+	unsigned int num_semaphores = 0;
+	SNAPSHOT_READ(s, num_semaphores);
+	for (unsigned int i = 0; i < num_semaphores && s->ok; i++) {
+		struct lock lock;
+		SNAPSHOT_READ(s, lock);
+		ARRAY_LIST_APPEND(&sched->known_semaphores.list, lock);
+	}
+
+	SNAPSHOT_READ(s, sched->current_extra_runnable);
+	SNAPSHOT_READ(s, sched->num_agents);
+	SNAPSHOT_READ(s, sched->most_agents_ever);
+	SNAPSHOT_READ(s, sched->deadlock_fp_avoidance_count);
+	SNAPSHOT_READ(s, sched->icb_preemption_count);
+	SNAPSHOT_READ(s, sched->any_thread_txn);
+	SNAPSHOT_READ(s, sched->delayed_txn_fail);
+	SNAPSHOT_READ(s, sched->delayed_txn_fail_tid);
+	SNAPSHOT_READ(s, sched->delayed_txn_fail_code);
+	SNAPSHOT_READ(s, sched->guest_init_done);
+	SNAPSHOT_READ(s, sched->inflight_tick_count);
+	SNAPSHOT_READ(s, sched->delayed_in_flight);
+	SNAPSHOT_READ(s, sched->just_finished_reschedule);
+	SNAPSHOT_READ(s, sched->entering_timer);
+	SNAPSHOT_READ(s, sched->voluntary_resched_tid);
+	sched->voluntary_resched_stack = snapshot_read_trace(s);
+}
+
+/******************************************************************************
+ * interface
+ ******************************************************************************/
+
+/* Held locks are interned lockset ids, and the intern table isn't saved. */
+static bool agent_holds_locks(const struct agent *a)
+{
+	return a->kern_locks_held != LOCKSET_EMPTY ||
+		a->user_locks_held != LOCKSET_EMPTY;
+}
+
+/* Whether there's any state that can't (or needn't ever) be snapshotted, in
+ * which case later jobs will just have to boot for themselves. */
+static const char *cannot_snapshot(struct ls_state *ls)
+{
+	struct agent *a;
+
+#ifdef PURE_HAPPENS_BEFORE
+	return "vector clocks aren't supported";
+#endif
+	if (ls->test.test_ever_caused) {
+		return "the test already started";
+	} else if (ls->save.root != NULL) {
+		return "the tree already has a root";
+	} else if (ls->sched.schedule_in_flight != NULL) {
+		return "a reschedule is in flight";
+	} else if (Q_GET_SIZE(&ls->user_sync.mutexes->list) > 0) {
+		return "there are known user mutexes";
+	}
+
+	Q_FOREACH(a, &ls->sched.rq, nobe) {
+		if (agent_holds_locks(a)) return "a thread holds locks";
+	}
+	Q_FOREACH(a, &ls->sched.dq, nobe) {
+		if (agent_holds_locks(a)) return "a thread holds locks";
+	}
+	Q_FOREACH(a, &ls->sched.sq, nobe) {
+		if (agent_holds_locks(a)) return "a thread holds locks";
+	}
+	if (ls->sched.last_vanished_agent != NULL &&
+	    agent_holds_locks(ls->sched.last_vanished_agent)) {
+		return "a thread holds locks";
+	}
+	return NULL;
+}
+
+bool snapshot_save(struct ls_state *ls, const char *filename)
+{
+	const char *problem = cannot_snapshot(ls);
+	if (problem != NULL) {
+		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_YELLOW "Not saving a boot "
+			 "snapshot, because %s.\n", problem);
+		return false;
+	}
+
+	struct snapshot s;
+	s.file = fopen(filename, "w");
+	if (s.file == NULL) {
+		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_YELLOW "Couldn't create boot "
+			 "snapshot %s.\n", filename);
+		return false;
+	}
+	s.ok = true;
+
+	struct snapshot_header header;
+	init_header(&header);
+	SNAPSHOT_WRITE(&s, header);
+	SNAPSHOT_WRITE(&s, ls->trigger_count);
+	SNAPSHOT_WRITE(&s, ls->absolute_trigger_count);
+	write_sched(&s, &ls->sched);
+	mem_write_snapshot(&s, &ls->kern_mem);
+	mem_write_snapshot(&s, &ls->user_mem);
+	SNAPSHOT_WRITE(&s, ls->user_sync.mutex_size);
+	SNAPSHOT_WRITE(&s, ls->user_sync.yield_progress);
+	SNAPSHOT_WRITE(&s, ls->user_sync.xchg_count);
+	SNAPSHOT_WRITE(&s, ls->user_sync.xchg_loop_has_pps);
+	SNAPSHOT_WRITE(&s, ls->rand);
+
+	if (fclose(s.file) != 0) {
+		s.ok = false;
+	}
+	if (!s.ok) {
+		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_YELLOW "Couldn't write boot "
+			 "snapshot %s.\n", filename);
+		return false;
+	}
+	lsprintf(DEV, "saved boot snapshot to %s\n", filename);
+	return true;
+}
+
+/* Only valid on a landslide object that has yet to see a single instruction;
+ * if this fails partway, the object should be thrown away. */
+bool snapshot_load(struct ls_state *ls, const char *filename)
+{
+	assert(ls->absolute_trigger_count == 0 && ls->save.root == NULL &&
+	       "can only load a boot snapshot into a fresh landslide");
+
+	struct snapshot s;
+	s.file = fopen(filename, "r");
+	if (s.file == NULL) {
+		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_RED "Couldn't open boot "
+			 "snapshot %s.\n", filename);
+		return false;
+	}
+	s.ok = true;
+
+	struct snapshot_header expected;
+	struct snapshot_header header;
+	init_header(&expected);
+	SNAPSHOT_READ(&s, header);
+	if (memcmp(&header, &expected, sizeof(header)) != 0) {
+		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_RED "Boot snapshot %s is from "
+			 "a different build of landslide.\n", filename);
+		fclose(s.file);
+		return false;
+	}
+
+	SNAPSHOT_READ(&s, ls->trigger_count);
+	SNAPSHOT_READ(&s, ls->absolute_trigger_count);
+	read_sched(&s, &ls->sched);
+	mem_read_snapshot(&s, ls, &ls->kern_mem);
+	mem_read_snapshot(&s, ls, &ls->user_mem);
+	SNAPSHOT_READ(&s, ls->user_sync.mutex_size);
+	SNAPSHOT_READ(&s, ls->user_sync.yield_progress);
+	SNAPSHOT_READ(&s, ls->user_sync.xchg_count);
+	SNAPSHOT_READ(&s, ls->user_sync.xchg_loop_has_pps);
+	SNAPSHOT_READ(&s, ls->rand);
+	fclose(s.file);
+
+	if (!s.ok) {
+		lsprintf(ALWAYS, COLOUR_BOLD COLOUR_RED "Boot snapshot %s is "
+			 "truncated.\n", filename);
+		return false;
+	}
+	lsprintf(DEV, "warm started from boot snapshot %s\n", filename);
+	return true;
+}
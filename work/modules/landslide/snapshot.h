@@ -0,0 +1,35 @@
+/**
+ * @file snapshot.h
+ * @brief saving landslide's post-boot state, so later jobs can skip booting
+ * @author Ben Blum
+ */
+
+#ifndef __LS_SNAPSHOT_H
+#define __LS_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+struct ls_state;
+struct stack_trace;
+
+/* A snapshot file, read or written front to back. A short read or write
+ * sticks in ok, so callers need only check it once at the end. */
+struct snapshot {
+	FILE *file;
+	bool ok;
+};
+
+void snapshot_write(struct snapshot *s, const void *buf, unsigned int len);
+void snapshot_read(struct snapshot *s, void *buf, unsigned int len);
+#define SNAPSHOT_WRITE(s, x) snapshot_write((s), &(x), sizeof(x))
+#define SNAPSHOT_READ(s, x)  snapshot_read((s), &(x), sizeof(x))
+
+/* traces may be null */
+void snapshot_write_trace(struct snapshot *s, const struct stack_trace *st);
+struct stack_trace *snapshot_read_trace(struct snapshot *s);
+
+bool snapshot_save(struct ls_state *ls, const char *filename);
+bool snapshot_load(struct ls_state *ls, const char *filename);
+
+#endif
@@ -7,35 +7,309 @@
 #define MODULE_NAME "STACK"
 #define MODULE_COLOUR COLOUR_DARK COLOUR_BLUE
 
+#include <string.h> /* for memcmp, memset, strcmp */
+
 #include "common.h"
 #include "html.h"
 #include "kernel_specifics.h"
 #include "kspec.h"
 #include "landslide.h"
+#include "memory.h"
 #include "stack.h"
 #include "symtable.h"
-#include "variable_queue.h"
 #include "x86.h"
 
+/******************************************************************************
+ * interning
+ ******************************************************************************/
+
+/* Function and file names are interned forever; there are only as many of
+ * them as there are symbols in the kernel/user binaries. Open addressing. */
+static struct {
+	char **table;
+	unsigned int capacity; /* power of 2 */
+	unsigned int size;
+} interned_strings;
+
+/* Results of symtable lookups, by symtable and eip, so printing the same frames
+ * over and over doesn't keep going back to simics. User programs share text
+ * addresses, so a user eip means nothing without the symtable of the process
+ * it came from; kernel eips are the same in all of them, so are keyed by NULL.
+ * Open addressing. */
+struct symbol_cache_entry {
+	bool valid;
+	bool lookup_success;
+	conf_object_t *symtable;
+	unsigned int eip;
+	char *name;
+	char *file;
+	int line;
+};
+
+static struct {
+	struct symbol_cache_entry *table;
+	unsigned int capacity; /* power of 2 */
+	unsigned int size;
+} symbol_cache;
+
+/* Stack traces are interned while referenced; chained by next_interned. */
+static struct {
+	struct stack_trace **buckets;
+	unsigned int num_buckets; /* power of 2 */
+	unsigned int size;
+} interned_traces;
+
+#define INITIAL_INTERN_CAPACITY 1024
+
+static uint32_t hash_string(const char *s)
+{
+	uint32_t hash = 2166136261U;
+	for (; *s != '\0'; s++) {
+		hash = (hash ^ (unsigned char)*s) * 16777619U;
+	}
+	return hash;
+}
+
+static char **string_slot(char **table, unsigned int capacity, const char *s)
+{
+	unsigned int i = hash_string(s) & (capacity - 1);
+	while (table[i] != NULL && strcmp(table[i], s) != 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &table[i];
+}
+
+/* Takes ownership of s, which may be freed if an equal string is interned. */
+static char *intern_string(char *s)
+{
+	if (s == NULL) {
+		return NULL;
+	}
+
+	if (2 * (interned_strings.size + 1) > interned_strings.capacity) {
+		unsigned int capacity = interned_strings.capacity == 0 ?
+			INITIAL_INTERN_CAPACITY : 2 * interned_strings.capacity;
+		char **table = MM_XMALLOC(capacity, char *);
+		memset(table, 0, capacity * sizeof(char *));
+		for (unsigned int i = 0; i < interned_strings.capacity; i++) {
+			char *old = interned_strings.table[i];
+			if (old != NULL) {
+				*string_slot(table, capacity, old) = old;
+			}
+		}
+		MM_FREE(interned_strings.table);
+		interned_strings.table = table;
+		interned_strings.capacity = capacity;
+	}
+
+	char **slot = string_slot(interned_strings.table,
+				  interned_strings.capacity, s);
+	if (*slot != NULL) {
+		MM_FREE(s);
+	} else {
+		*slot = s;
+		interned_strings.size++;
+	}
+	return *slot;
+}
+
+static uint32_t hash_symbol(conf_object_t *symtable, unsigned int eip)
+{
+	uint32_t hash = (eip ^ (uint32_t)(uintptr_t)symtable) * 0x9e3779b1U;
+	return hash ^ (hash >> 15);
+}
+
+static struct symbol_cache_entry *symbol_slot(struct symbol_cache_entry *table,
+					      unsigned int capacity,
+					      conf_object_t *symtable,
+					      unsigned int eip)
+{
+	unsigned int i = hash_symbol(symtable, eip) & (capacity - 1);
+	while (table[i].valid &&
+	       (table[i].eip != eip || table[i].symtable != symtable)) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &table[i];
+}
+
+/* symtable is the one the eip was recorded under, or NULL for the current. */
+static struct symbol_cache_entry *lookup_symbol(conf_object_t *symtable,
+						unsigned int eip)
+{
+	if (KERNEL_MEMORY(eip)) {
+		symtable = NULL;
+	} else if (symtable == NULL) {
+		symtable = get_symtable();
+	}
+
+
+	if (2 * (symbol_cache.size + 1) > symbol_cache.capacity) {
+		unsigned int capacity = symbol_cache.capacity == 0 ?
+			INITIAL_INTERN_CAPACITY : 2 * symbol_cache.capacity;
+		struct symbol_cache_entry *table =
+			MM_XMALLOC(capacity, struct symbol_cache_entry);
+		memset(table, 0, capacity * sizeof(struct symbol_cache_entry));
+		for (unsigned int i = 0; i < symbol_cache.capacity; i++) {
+			struct symbol_cache_entry *old = &symbol_cache.table[i];
+			if (old->valid) {
+				*symbol_slot(table, capacity, old->symtable,
+					     old->eip) = *old;
+			}
+		}
+		MM_FREE(symbol_cache.table);
+		symbol_cache.table = table;
+		symbol_cache.capacity = capacity;
+	}
+
+	struct symbol_cache_entry *entry = symbol_slot(symbol_cache.table,
+						       symbol_cache.capacity,
+						       symtable, eip);
+	if (!entry->valid) {
+		entry->valid = true;
+		entry->symtable = symtable;
+		entry->eip = eip;
+		entry->name = NULL;
+		entry->file = NULL;
+		entry->line = 0;
+		entry->lookup_success = symtable_lookup(symtable, eip,
+							&entry->name,
+							&entry->file,
+							&entry->line);
+		entry->name = intern_string(entry->name);
+		entry->file = intern_string(entry->file);
+		symbol_cache.size++;
+	}
+	return entry;
+}
+
+static uint32_t hash_stack_trace(struct stack_trace *st)
+{
+	unsigned int i;
+	unsigned int *eipp;
+	uint32_t hash = 2166136261U ^ st->tid;
+	hash = (hash ^ (uint32_t)(uintptr_t)st->symtable) * 0x9e3779b1U;
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		hash = (hash ^ *eipp) * 0x9e3779b1U;
+		hash ^= hash >> 15;
+	}
+	return hash;
+}
+
+static bool stack_traces_equal(struct stack_trace *st0, struct stack_trace *st1)
+{
+	return st0->hash == st1->hash && st0->tid == st1->tid &&
+		st0->symtable == st1->symtable &&
+		ARRAY_LIST_SIZE(&st0->eips) == ARRAY_LIST_SIZE(&st1->eips) &&
+		memcmp(st0->eips.array, st1->eips.array,
+		       ARRAY_LIST_SIZE(&st0->eips) * sizeof(unsigned int)) == 0;
+}
+
+static void free_stack_trace(struct stack_trace *st)
+{
+	ARRAY_LIST_FREE(&st->eips);
+	MM_FREE(st);
+}
+
+/* Takes a freshly-built trace and returns the canonical equal one, which the
+ * caller then holds a reference to. */
+static struct stack_trace *intern_stack_trace(struct stack_trace *st)
+{
+	st->hash = hash_stack_trace(st);
+
+	if (interned_traces.num_buckets > 0) {
+		struct stack_trace *existing = interned_traces.buckets[
+			st->hash & (interned_traces.num_buckets - 1)];
+		for (; existing != NULL; existing = existing->next_interned) {
+			if (stack_traces_equal(existing, st)) {
+				free_stack_trace(st);
+				return stack_trace_ref(existing);
+			}
+		}
+	}
+
+	if (interned_traces.size + 1 > interned_traces.num_buckets) {
+		unsigned int num_buckets = interned_traces.num_buckets == 0 ?
+			INITIAL_INTERN_CAPACITY : 2 * interned_traces.num_buckets;
+		struct stack_trace **buckets =
+			MM_XMALLOC(num_buckets, struct stack_trace *);
+		memset(buckets, 0, num_buckets * sizeof(struct stack_trace *));
+		for (unsigned int i = 0; i < interned_traces.num_buckets; i++) {
+			while (interned_traces.buckets[i] != NULL) {
+				struct stack_trace *old = interned_traces.buckets[i];
+				interned_traces.buckets[i] = old->next_interned;
+				old->next_interned =
+					buckets[old->hash & (num_buckets - 1)];
+				buckets[old->hash & (num_buckets - 1)] = old;
+			}
+		}
+		MM_FREE(interned_traces.buckets);
+		interned_traces.buckets = buckets;
+		interned_traces.num_buckets = num_buckets;
+	}
+
+	struct stack_trace **bucket = &interned_traces.buckets[
+		st->hash & (interned_traces.num_buckets - 1)];
+	st->refcount = 1;
+	st->next_interned = *bucket;
+	*bucket = st;
+	interned_traces.size++;
+	return st;
+}
+
+struct stack_trace *stack_trace_ref(struct stack_trace *st)
+{
+	assert(st->refcount > 0 && "ref of dead or uninterned stack trace");
+	st->refcount++;
+	return st;
+}
+
+void stack_trace_unref(struct stack_trace *st)
+{
+	assert(st->refcount > 0 && "unref of dead or uninterned stack trace");
+	if (--st->refcount > 0) {
+		return;
+	}
+
+	struct stack_trace **link = &interned_traces.buckets[
+		st->hash & (interned_traces.num_buckets - 1)];
+	while (*link != st) {
+		assert(*link != NULL && "stack trace missing from intern table");
+		link = &(*link)->next_interned;
+	}
+	*link = st->next_interned;
+	interned_traces.size--;
+	free_stack_trace(st);
+}
+
 /******************************************************************************
  * printing utilities / glue
  ******************************************************************************/
 
 #define FRAME_BUF_LEN 256
 
-/* guaranteed not to clobber nobe. */
-bool eip_to_frame(unsigned int eip, struct stack_frame *f)
+static bool symbolize(conf_object_t *symtable, unsigned int eip,
+		      struct stack_frame *f)
 {
+	struct symbol_cache_entry *entry = lookup_symbol(symtable, eip);
 	f->eip = eip;
-	f->name = NULL;
-	f->file = NULL;
-	return symtable_lookup(eip, &f->name, &f->file, &f->line);
+	f->name = entry->name;
+	f->file = entry->file;
+	f->line = entry->line;
+	return entry->lookup_success;
+}
+
+/* Looks the eip up in the current symtable; for one from a stack trace, which
+ * may have been recorded in another process, see print_stack_eip. */
+bool eip_to_frame(unsigned int eip, struct stack_frame *f)
+{
+	return symbolize(NULL, eip, f);
 }
 
+/* Names are interned, so there's nothing to free. */
 void destroy_frame(struct stack_frame *f)
 {
-	if (f->name != NULL) MM_FREE(f->name);
-	if (f->file != NULL) MM_FREE(f->file);
+	f->name = NULL;
+	f->file = NULL;
 }
 
 /* Emits a "0xADDR in NAME (FILE:LINE)" line with optional pretty colours. */
@@ -100,23 +374,31 @@ void print_eip(verbosity v, unsigned int eip)
 	destroy_frame(&f);
 }
 
+/* As above, for one of st's eips, in the symtable st was recorded in. */
+void print_stack_eip(verbosity v, const struct stack_trace *st, unsigned int eip)
+{
+	struct stack_frame f;
+	symbolize(st->symtable, eip, &f);
+	print_stack_frame(v, &f);
+	destroy_frame(&f);
+}
+
 /* Prints a stack trace to the console. Uses printf, not lsprintf, separates
  * frames with ", ", and does not emit a newline at the end. */
 void print_stack_trace(verbosity v, struct stack_trace *st)
 {
-	struct stack_frame *f;
-	bool first_frame = true;
+	unsigned int i;
+	unsigned int *eipp;
 
 	/* print TID prefix before first frame */
 	printf(v, "TID%d at ", st->tid);
 
 	/* print each frame */
-	Q_FOREACH(f, &st->frames, nobe) {
-		if (!first_frame) {
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		if (i > 0) {
 			printf(v, ", ");
 		}
-		first_frame = false;
-		print_stack_frame(v, f);
+		print_stack_eip(v, st, *eipp);
 	}
 }
 
@@ -125,14 +407,16 @@ unsigned int html_stack_trace(char *buf, unsigned int maxlen, struct stack_trace
 {
 #define PRINT(...) do { pos += scnprintf(buf + pos, maxlen - pos, __VA_ARGS__); } while (0)
 	unsigned int pos = 0;
-	bool first_frame = true;
-	struct stack_frame *f;
-
-	Q_FOREACH(f, &st->frames, nobe) {
-		if (!first_frame) {
+	unsigned int i;
+	unsigned int *eipp;
+
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		struct stack_frame frame;
+		struct stack_frame *f = &frame;
+		symbolize(st->symtable, *eipp, f);
+		if (i > 0) {
 			PRINT("<br />");
 		}
-		first_frame = false;
 		/* see print_stack_frame, above */
 		PRINT("0x%.8x in ", f->eip);
 		if (f->name == NULL) {
@@ -160,38 +444,20 @@ unsigned int html_stack_trace(char *buf, unsigned int maxlen, struct stack_trace
 #undef PRINT
 }
 
-struct stack_trace *copy_stack_trace(struct stack_trace *src)
+static struct stack_trace *new_stack_trace(unsigned int tid)
 {
-	struct stack_trace *dest = MM_XMALLOC(1, struct stack_trace);
-	struct stack_frame *f_src;
-	dest->tid = src->tid;
-	Q_INIT_HEAD(&dest->frames);
-
-	Q_FOREACH(f_src, &src->frames, nobe) {
-		struct stack_frame *f_dest = MM_XMALLOC(1, struct stack_frame);
-		f_dest->eip = f_src->eip;
-		f_dest->name = f_src->name == NULL ? NULL : MM_XSTRDUP(f_src->name);
-		f_dest->file = f_src->file == NULL ? NULL : MM_XSTRDUP(f_src->file);
-		f_dest->line = f_src->line;
-		Q_INSERT_TAIL(&dest->frames, f_dest, nobe);
-	}
-	return dest;
-}
-
-void free_stack_trace(struct stack_trace *st)
-{
-	while (Q_GET_SIZE(&st->frames) > 0) {
-		struct stack_frame *f = Q_GET_HEAD(&st->frames);
-		assert(f != NULL);
-		Q_REMOVE(&st->frames, f, nobe);
-		destroy_frame(f);
-		MM_FREE(f);
-	}
-	MM_FREE(st);
+	struct stack_trace *st = MM_XMALLOC(1, struct stack_trace);
+	st->tid = tid;
+	st->symtable = NULL;
+	ARRAY_LIST_INIT(&st->eips, 16);
+	st->refcount = 0;
+	st->hash = 0;
+	st->next_interned = NULL;
+	return st;
 }
 
 static bool splice_pre_vanish_trace(struct ls_state *ls, struct stack_trace *st,
-				    unsigned int eip)
+				    struct shadow_stack *shadow, unsigned int eip)
 {
 	struct stack_trace *pvt = ls->sched.cur_agent->pre_vanish_trace;
 	bool found_eip = false;
@@ -200,18 +466,19 @@ static bool splice_pre_vanish_trace(struct ls_state *ls, struct stack_trace *st,
 		return false;
 	}
 
-	struct stack_frame *f;
-	Q_FOREACH(f, &pvt->frames, nobe) {
-		if (f->eip == eip) {
+	unsigned int i;
+	unsigned int *eipp;
+	ARRAY_LIST_FOREACH(&pvt->eips, i, eipp) {
+		if (*eipp == eip) {
 			found_eip = true;
 		}
 		if (found_eip) {
-			struct stack_frame *newf = MM_XMALLOC(1, struct stack_frame);
-			newf->eip  = f->eip;
-			newf->name = f->name == NULL ? NULL : MM_XSTRDUP(f->name);
-			newf->file = f->file == NULL ? NULL : MM_XSTRDUP(f->file);
-			newf->line = f->line;
-			Q_INSERT_TAIL(&st->frames, newf, nobe);
+			ARRAY_LIST_APPEND(&st->eips, *eipp);
+			if (shadow != NULL) {
+				struct shadow_frame frame =
+					{ .eip = *eipp, .slot = 0 };
+				ARRAY_LIST_APPEND(&shadow->frames, frame);
+			}
 		}
 	}
 	return found_eip;
@@ -236,13 +503,19 @@ static unsigned int check_noreturn_function(conf_object_t *cpu, unsigned int eip
  * actual logic
  ******************************************************************************/
 
-/* returns false if symtable lookup failed */
-static bool add_frame(struct stack_trace *st, unsigned int eip)
+/* Symbolization is deferred until printing, except when the 'wrong cr3' end
+ * condition needs to know whether the symtable lookup would succeed. Returns
+ * false if walking should stop here. If shadow is non-null, also records the
+ * frame there (innermost first), with the stack slot its eip was found in. */
+static bool add_frame(struct stack_trace *st, struct shadow_stack *shadow,
+		      unsigned int eip, unsigned int slot, bool wrong_cr3)
 {
-	struct stack_frame *f = MM_XMALLOC(1, struct stack_frame);
-	bool lookup_success = eip_to_frame(eip, f);
-	Q_INSERT_TAIL(&st->frames, f, nobe);
-	return lookup_success;
+	ARRAY_LIST_APPEND(&st->eips, eip);
+	if (shadow != NULL) {
+		struct shadow_frame frame = { .eip = eip, .slot = slot };
+		ARRAY_LIST_APPEND(&shadow->frames, frame);
+	}
+	return !wrong_cr3 || lookup_symbol(NULL, eip)->lookup_success;
 }
 
 /* Suppress stack frames from userspace, if testing userland, unless the
@@ -258,7 +531,10 @@ static bool add_frame(struct stack_trace *st, unsigned int eip)
 #define CHECK_JUNK_EBP_BELOW_TEXT(ebp) ((unsigned)(ebp) < GUEST_DATA_START)
 #endif
 
-struct stack_trace *stack_trace(struct ls_state *ls)
+/* Builds a fresh, uninterned trace. If shadow is non-null, also records the
+ * frames there, without suppressing any. */
+static struct stack_trace *walk_stack(struct ls_state *ls,
+				      struct shadow_stack *shadow)
 {
 	conf_object_t *cpu = ls->cpu0;
 	unsigned int eip = ls->eip;
@@ -266,12 +542,10 @@ struct stack_trace *stack_trace(struct ls_state *ls)
 
 	unsigned int stack_ptr = GET_CPU_ATTR(cpu, esp);
 
-	struct stack_trace *st = MM_XMALLOC(1, struct stack_trace);
-	st->tid = tid;
-	Q_INIT_HEAD(&st->frames);
+	struct stack_trace *st = new_stack_trace(tid);
 
 	/* Add current frame, even if it's in kernel and we're in user. */
-	add_frame(st, eip);
+	add_frame(st, NULL, eip, 0, false);
 
 	unsigned int stop_ebp = 0;
 	unsigned int ebp = GET_CPU_ATTR(cpu, ebp);
@@ -368,11 +642,11 @@ struct stack_trace *stack_trace(struct ls_state *ls)
 			if (extra_frame) {
 				eip = READ_MEMORY(cpu, stack_ptr);
 				eip = check_noreturn_function(cpu, eip);
-				if (splice_pre_vanish_trace(ls, st, eip)) {
+				if (splice_pre_vanish_trace(ls, st, shadow, eip)) {
 					return st;
-				} else if (!SUPPRESS_FRAME(eip)) {
-					bool success = add_frame(st, eip);
-					if (!success && wrong_cr3)
+				} else if (shadow != NULL || !SUPPRESS_FRAME(eip)) {
+					if (!add_frame(st, shadow, eip, stack_ptr,
+						       wrong_cr3))
 						return st;
 				}
 
@@ -411,11 +685,11 @@ struct stack_trace *stack_trace(struct ls_state *ls)
 		}
 		stack_ptr = ebp + (2 * WORD_SIZE);
 		/* Suppress kernel frames if testing user, unless verbose enough. */
-		if (splice_pre_vanish_trace(ls, st, eip)) {
+		if (splice_pre_vanish_trace(ls, st, shadow, eip)) {
 			return st;
-		} else if (!SUPPRESS_FRAME(eip)) {
-			bool success = add_frame(st, eip);
-			if (!success && wrong_cr3)
+		} else if (shadow != NULL || !SUPPRESS_FRAME(eip)) {
+			if (!add_frame(st, shadow, eip, ebp + WORD_SIZE,
+				       wrong_cr3))
 				return st;
 
 			/* special-case termination condition -- _start */
@@ -463,15 +737,79 @@ struct stack_trace *stack_trace(struct ls_state *ls)
 	return st;
 }
 
+/* Symbols are looked up later, by which time another process's symtable may be
+ * in use, so remember the current one if any frame will need it. */
+static void record_symtable(struct stack_trace *st)
+{
+	unsigned int i;
+	unsigned int *eipp;
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		if (!KERNEL_MEMORY(*eipp)) {
+			st->symtable = get_symtable();
+			return;
+		}
+	}
+}
+
+struct stack_trace *stack_trace(struct ls_state *ls)
+{
+	struct stack_trace *st = walk_stack(ls, NULL);
+	record_symtable(st);
+	if (st->symtable != NULL && testing_userspace() &&
+	    check_user_address_space(ls)) {
+		symtable_note_test_program(st->symtable,
+					   ls->test.current_test);
+	}
+	return intern_stack_trace(st);
+}
+
+/* Returns a reference to st with its topmost frame replaced by the given eip,
+ * consuming the caller's reference to st. */
+struct stack_trace *stack_trace_replace_top(struct stack_trace *st,
+					    unsigned int eip)
+{
+	struct stack_trace *fixed = new_stack_trace(st->tid);
+	unsigned int i;
+
+	fixed->symtable = st->symtable;
+	unsigned int *eipp;
+
+	assert(ARRAY_LIST_SIZE(&st->eips) > 0);
+	add_frame(fixed, NULL, eip, 0, false);
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		if (i > 0) {
+			ARRAY_LIST_APPEND(&fixed->eips, *eipp);
+		}
+	}
+	stack_trace_unref(st);
+	return intern_stack_trace(fixed);
+}
+
+/* Rebuilds a trace from its raw eips, as saved in a boot snapshot. Snapshots
+ * are loaded in the same machine state they were saved in, so the current
+ * symtable is the one the trace was recorded in. */
+struct stack_trace *stack_trace_from_eips(unsigned int tid,
+					  const unsigned int *eips,
+					  unsigned int num_eips)
+{
+	struct stack_trace *st = new_stack_trace(tid);
+	for (unsigned int i = 0; i < num_eips; i++) {
+		ARRAY_LIST_APPEND(&st->eips, eips[i]);
+	}
+	record_symtable(st);
+	return intern_stack_trace(st);
+}
+
 /* As below but doesn't require duplicating the work of making a fresh stack
  * trace if you already have one. .*/
 bool within_function_st(struct stack_trace *st, unsigned int func,
 			unsigned int func_end)
 {
-	struct stack_frame *f;
+	unsigned int i;
+	unsigned int *eipp;
 	bool result = false;
-	Q_FOREACH(f, &st->frames, nobe) {
-		if (f->eip >= func && f->eip <= func_end) {
+	ARRAY_LIST_FOREACH(&st->eips, i, eipp) {
+		if (*eipp >= func && *eipp <= func_end) {
 			result = true;
 			break;
 		}
@@ -483,11 +821,56 @@ bool within_function_st(struct stack_trace *st, unsigned int func,
  * function somewhere on it. */
 bool within_function(struct ls_state *ls, unsigned int func, unsigned int func_end)
 {
-	/* Note while it may seem wasteful to malloc a bunch of times to make
-	 * the stack trace, many (not all) of the mallocs are actually needed
-	 * because the 'wrong cr3' end condition requires a symtable lookup. */
-	struct stack_trace *st = stack_trace(ls);
+	/* This one is never kept, so don't bother interning it. */
+	struct stack_trace *st = walk_stack(ls, NULL);
 	bool result = within_function_st(st, func, func_end);
 	free_stack_trace(st);
 	return result;
 }
+
+/******************************************************************************
+ * shadow call stacks
+ ******************************************************************************/
+
+void shadow_stack_init(struct shadow_stack *shadow)
+{
+	/* valid empty lists; these only get allocated if ever used */
+	shadow->frames.size = 0;
+	shadow->frames.capacity = 0;
+	shadow->frames.array = NULL;
+	shadow->within_counts.size = 0;
+	shadow->within_counts.capacity = 0;
+	shadow->within_counts.array = NULL;
+	shadow->synced = false;
+}
+
+void shadow_stack_free(struct shadow_stack *shadow)
+{
+	ARRAY_LIST_FREE(&shadow->frames);
+	ARRAY_LIST_FREE(&shadow->within_counts);
+}
+
+/* Replaces the shadow stack's frames with those found by actually walking the
+ * stack, keeping only the kernel or user ones. Doesn't touch within_counts. */
+void shadow_stack_sync(struct ls_state *ls, struct shadow_stack *shadow,
+		       bool kernel)
+{
+	unsigned int i;
+	unsigned int kept = 0;
+	struct shadow_frame *frame;
+
+	shadow->frames.size = 0;
+	free_stack_trace(walk_stack(ls, shadow));
+
+	/* filter, then flip innermost-first to outermost-first */
+	ARRAY_LIST_FOREACH(&shadow->frames, i, frame) {
+		if ((bool)KERNEL_MEMORY(frame->eip) == kernel) {
+			shadow->frames.array[kept++] = *frame;
+		}
+	}
+	shadow->frames.size = kept;
+	for (i = 0; i < kept / 2; i++) {
+		ARRAY_LIST_SWAP(&shadow->frames, i, kept - 1 - i);
+	}
+	shadow->synced = true;
+}
@@ -7,25 +7,47 @@
 #ifndef __LS_STACK_H
 #define __LS_STACK_H
 
+#include "array_list.h"
 #include "common.h"
-#include "variable_queue.h"
 
 struct ls_state;
 
 /* stack trace data structures. */
+
+/* A symbolized frame, made on demand from an eip when printing. */
 struct stack_frame {
-	Q_NEW_LINK(struct stack_frame) nobe;
 	unsigned int eip;
-	char *name; /* may be null if symtable lookup failed */
+	char *name; /* may be null if symtable lookup failed; interned */
 	char *file; /* may be null, as above */
 	int line;   /* valid iff above fields are not null */
 };
 
-Q_NEW_HEAD(struct stack_frames, struct stack_frame);
-
+/* Stack traces are hash-consed: all traces with the same tid, symtable and
+ * sequence of eips are the same immutable object, shared by refcount. Never
+ * modify one returned by stack_trace(); use stack_trace_ref() instead of
+ * copying. Only eips are recorded; symbols are looked up when the trace is
+ * printed, in the symtable that was current when it was taken. */
 struct stack_trace {
 	unsigned int tid;
-	struct stack_frames frames;
+	conf_object_t *symtable; /* NULL if there are no user frames */
+	ARRAY_LIST(unsigned int) eips; /* innermost frame first */
+	unsigned int refcount;
+	uint32_t hash;
+	struct stack_trace *next_interned;
+};
+
+/* A shadow call stack, kept up to date by watching calls and returns, so that
+ * within-function queries needn't walk the real stack (see pp.c). Frames are
+ * identified by the address of the stack slot holding their return address. */
+struct shadow_frame {
+	unsigned int eip;
+	unsigned int slot; /* 0 if unknown */
+};
+
+struct shadow_stack {
+	ARRAY_LIST(struct shadow_frame) frames; /* outermost first */
+	ARRAY_LIST(unsigned int) within_counts; /* per pp_within; see pp.c */
+	bool synced; /* if false, frames may be missing; must walk the stack */
 };
 
 /* interface */
@@ -36,15 +58,23 @@ bool eip_to_frame(unsigned int eip, struct stack_frame *f);
 void destroy_frame(struct stack_frame *f);
 void print_stack_frame(verbosity v, struct stack_frame *f);
 void print_eip(verbosity v, unsigned int eip);
+void print_stack_eip(verbosity v, const struct stack_trace *st, unsigned int eip);
 void print_stack_trace(verbosity v, struct stack_trace *st);
 unsigned int html_stack_trace(char *buf, unsigned int maxlen, struct stack_trace *st);
-struct stack_trace *copy_stack_trace(struct stack_trace *src);
-void free_stack_trace(struct stack_trace *st);
+struct stack_trace *stack_trace_ref(struct stack_trace *st);
+void stack_trace_unref(struct stack_trace *st);
 
 /* actual logic */
 struct stack_trace *stack_trace(struct ls_state *ls);
+struct stack_trace *stack_trace_replace_top(struct stack_trace *st, unsigned int eip);
+struct stack_trace *stack_trace_from_eips(unsigned int tid,
+					  const unsigned int *eips,
+					  unsigned int num_eips);
 bool within_function_st(struct stack_trace *st, unsigned int func, unsigned int func_end);
 bool within_function(struct ls_state *ls, unsigned int func, unsigned int func_end);
+void shadow_stack_init(struct shadow_stack *shadow);
+void shadow_stack_free(struct shadow_stack *shadow);
+void shadow_stack_sync(struct ls_state *ls, struct shadow_stack *shadow, bool kernel);
 
 /* convenience */
 #define LS_ABORT() do { dump_stack(); assert(0); } while (0)
@@ -54,7 +84,7 @@ static inline void dump_stack() {
 	lsprintf(ALWAYS, "Stack trace: ");
 	print_stack_trace(ALWAYS, st);
 	printf(ALWAYS, "\n");
-	free_stack_trace(st);
+	stack_trace_unref(st);
 }
 
 #endif
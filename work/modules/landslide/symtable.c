@@ -2,11 +2,18 @@
  * @file symtable.c
  * @brief A bunch of gross simics goo for querying the symbol table
  * @author Ben Blum
+ *
+ * Lookups are answered from native indices built from the kernel image and the
+ * test program's image (see elf_index.c) when possible, and fall back to asking
+ * simics otherwise.
  */
 
+#include <stdlib.h> /* for getenv */
+
 #define MODULE_NAME "symtable glue"
 
 #include "common.h"
+#include "elf_index.h"
 #include "kspec.h"
 #include "stack.h"
 #include "symtable.h"
@@ -15,6 +22,13 @@
 #define SYMTABLE_NAME "deflsym"
 #define CONTEXT_NAME "system.cell_context"
 
+/* The same file simics's deflsym loads symbols from (see config.simics). */
+#define KERNEL_IMG_FILE "kernel"
+/* Where user programs' symbols get loaded from, under the project directory
+ * (see user_prog_path in cs410_utils.py). */
+#define OS_PROJ_PATH_ENV "OS_PROJ_PATH"
+#define USER_PROG_DIR "/temp/"
+
 #define LIKELY_DIR "pebsim/"
 #define UNKNOWN_FILE "410kern/boot/head.S"
 
@@ -58,25 +72,67 @@ void set_symtable(conf_object_t *symtable)
 	SIM_free_attribute(table);
 }
 
-/* New interface. Returns malloced strings through output parameters,
- * which caller must free result strings if returnval is true */
-bool symtable_lookup(unsigned int eip, char **func, char **file, int *line)
+static struct elf_index *kernel_index;
+
+/* User programs share text addresses, so a user program's index only answers
+ * for eips recorded under that program's symtable. The only program landslide
+ * can tell the symtable of is the test's, because it knows the test's cr3; see
+ * symtable_note_test_program. Other programs' frames go to simics. */
+static conf_object_t *test_symtable;
+static struct elf_index *test_index;
+
+void symtable_init()
 {
-	conf_object_t *table = get_symtable();
-	if (table == NULL) {
-		return false;
+	kernel_index = elf_index_load(KERNEL_IMG_FILE);
+}
+
+/* Called with the symtable current while the test program is running. */
+void symtable_note_test_program(conf_object_t *symtable, const char *test_name)
+{
+	const char *proj_path = getenv(OS_PROJ_PATH_ENV);
+
+	if (test_symtable != NULL || symtable == NULL || test_name == NULL) {
+		return;
+	}
+	test_symtable = symtable;
+	if (proj_path == NULL) {
+		lsprintf(DEV, "no " OS_PROJ_PATH_ENV "; test program symbols "
+			 "will come from simics\n");
+		return;
 	}
 
-	attr_value_t idx = SIM_make_attr_integer(eip);
-	attr_value_t result = SIM_get_attribute_idx(table, "source_at", &idx);
-	if (!SIM_attr_is_list(result)) {
-		SIM_free_attribute(idx);
-		return false;
+	/* the test string may have arguments after the program name */
+	unsigned int name_len = strcspn(test_name, " \n");
+	unsigned int length = strlen(proj_path) + strlen(USER_PROG_DIR) +
+		name_len + 1;
+	char *path = MM_XMALLOC(length, char);
+	scnprintf(path, length, "%s" USER_PROG_DIR "%.*s", proj_path,
+		  name_len, test_name);
+	test_index = elf_index_load(path);
+	MM_FREE(path);
+}
+
+/* Which native index can answer for eip, recorded under the given symtable
+ * (NULL meaning the current one), if any. */
+static struct elf_index *native_index(conf_object_t *table, unsigned int eip)
+{
+	if (KERNEL_MEMORY(eip)) {
+		return kernel_index;
+	} else if (test_index == NULL) {
+		return NULL;
+	} else if (table == NULL) {
+		table = get_symtable();
 	}
-	assert(SIM_attr_list_size(result) >= 3);
+	return table == test_symtable ? test_index : NULL;
+}
 
-	/* Copy out the function name and line number. However, need to
-	 * do some checks on the filename before copying it out as well. */
+/* Copies out the function name and line number of a successful lookup from
+ * either source. However, need to do some checks on the filename before
+ * copying it out as well. */
+static void copy_lookup_result(unsigned int eip, const char *found_func,
+			       const char *maybe_file, int found_line,
+			       char **func, char **file, int *line)
+{
 	if (testing_userspace() && eip == GUEST_CONTEXT_SWITCH_ENTER) {
 		*func = MM_XSTRDUP("[context switch]");
 #ifdef GUEST_HLT_EXIT
@@ -84,10 +140,9 @@ bool symtable_lookup(unsigned int eip, char **func, char **file, int *line)
 		*func = MM_XSTRDUP("[kernel idle]");
 #endif
 	} else {
-		*func = MM_XSTRDUP(SIM_attr_string(SIM_attr_list_item(result, 2)));
+		*func = MM_XSTRDUP(found_func);
 	}
-	const char *maybe_file = SIM_attr_string(SIM_attr_list_item(result, 0));
-	*line = SIM_attr_integer(SIM_attr_list_item(result, 1));
+	*line = found_line;
 
 	/* A hack to make the filenames shorter */
 	if (strstr(maybe_file, LIKELY_DIR) != NULL) {
@@ -101,16 +156,78 @@ bool symtable_lookup(unsigned int eip, char **func, char **file, int *line)
 	} else {
 		*file = MM_XSTRDUP(maybe_file);
 	}
+}
+
+/* New interface. Returns malloced strings through output parameters,
+ * which caller must free result strings if returnval is true. The table to
+ * ask simics may be NULL, meaning whichever is current. */
+bool symtable_lookup(conf_object_t *table, unsigned int eip, char **func,
+		     char **file, int *line)
+{
+	const char *native_func;
+	const char *native_file;
+	unsigned int native_start;
+	int native_line;
+
+	struct elf_index *index = native_index(table, eip);
+
+	if (elf_index_function(index, eip, &native_func, &native_start) &&
+	    elf_index_line(index, eip, &native_file, &native_line)) {
+		copy_lookup_result(eip, native_func, native_file, native_line,
+				   func, file, line);
+		return true;
+	}
+
+	if (table == NULL && (table = get_symtable()) == NULL) {
+		return false;
+	}
+
+	attr_value_t idx = SIM_make_attr_integer(eip);
+	attr_value_t result = SIM_get_attribute_idx(table, "source_at", &idx);
+	if (!SIM_attr_is_list(result)) {
+		SIM_free_attribute(idx);
+		return false;
+	}
+	assert(SIM_attr_list_size(result) >= 3);
+
+	copy_lookup_result(eip,
+			   SIM_attr_string(SIM_attr_list_item(result, 2)),
+			   SIM_attr_string(SIM_attr_list_item(result, 0)),
+			   SIM_attr_integer(SIM_attr_list_item(result, 1)),
+			   func, file, line);
 
 	SIM_free_attribute(result);
 	SIM_free_attribute(idx);
 	return true;
 }
 
+/* Data symbols are only needed when printing, and the native index doesn't
+ * know their types, so simics is asked first here. */
 unsigned int symtable_lookup_data(char *buf, unsigned int maxlen, unsigned int addr)
 {
+	const char *native_name;
+	unsigned int native_offset;
+	bool native = elf_index_data(native_index(NULL, addr), addr,
+				     &native_name, &native_offset);
+
+	unsigned int print_native()
+	{
+		unsigned int ret = scnprintf(buf, maxlen, GLOBAL_COLOUR "%s",
+					     native_name);
+		if (native_offset != 0) {
+			ret += scnprintf(buf+ret, maxlen-ret, "+%d",
+					 native_offset);
+		}
+		ret += scnprintf(buf+ret, maxlen-ret, GLOBAL_INFO_COLOUR
+				 " (at 0x%.8x)" COLOUR_DEFAULT, addr);
+		return ret;
+	}
+
 	conf_object_t *table = get_symtable();
 	if (table == NULL) {
+		if (native) {
+			return print_native();
+		}
 		return scnprintf(buf, maxlen, GLOBAL_COLOUR "global0x%.8x"
 				 COLOUR_DEFAULT, addr);
 	}
@@ -119,7 +236,9 @@ unsigned int symtable_lookup_data(char *buf, unsigned int maxlen, unsigned int a
 	attr_value_t result = SIM_get_attribute_idx(table, "data_at", &idx);
 	if (!SIM_attr_is_list(result)) {
 		SIM_free_attribute(idx);
-		if (KERNEL_MEMORY(addr)) {
+		if (native) {
+			return print_native();
+		} else if (KERNEL_MEMORY(addr)) {
 			return scnprintf(buf, maxlen, "<user global0x%x>", addr);
 		} else {
 			return scnprintf(buf, maxlen, GLOBAL_COLOUR
@@ -148,6 +267,14 @@ unsigned int symtable_lookup_data(char *buf, unsigned int maxlen, unsigned int a
  * containing function. */
 bool function_eip_offset(unsigned int eip, unsigned int *offset)
 {
+	const char *native_func;
+	unsigned int native_start;
+	if (elf_index_function(native_index(NULL, eip), eip, &native_func,
+			       &native_start)) {
+		*offset = eip - native_start;
+		return true;
+	}
+
 	conf_object_t *table = get_symtable();
 	if (table == NULL) {
 		return false;
@@ -9,9 +9,12 @@
 
 #include <simics/api.h>
 
+void symtable_init();
+void symtable_note_test_program(conf_object_t *symtable, const char *test_name);
 conf_object_t *get_symtable();
 void set_symtable(conf_object_t *symtable);
-bool symtable_lookup(unsigned int eip, char **func, char **file, int *line);
+bool symtable_lookup(conf_object_t *table, unsigned int eip, char **func,
+		     char **file, int *line);
 unsigned int symtable_lookup_data(char *buf, unsigned int maxlen, unsigned int addr);
 bool function_eip_offset(unsigned int eip, unsigned int *offset);
 bool find_user_global_of_type(const char *typename, unsigned int *size_result);
@@ -132,6 +132,12 @@ bool test_update_state(struct ls_state *ls)
 	}
 }
 
+bool test_can_skip_update(struct ls_state *ls)
+{
+	/* Until the test ends, only the run_task eips can change anything. */
+	return !ls->test.test_ended;
+}
+
 #else
 
 /******************************************************************************
@@ -271,4 +277,16 @@ bool test_update_state(struct ls_state *ls)
 	return false;
 }
 
+bool test_can_skip_update(struct ls_state *ls)
+{
+	struct test_state *t = &ls->test;
+	/* In the middle of a test, anybody_alive() answers from the agent
+	 * counts alone, which change only at annotated eips. Before and after,
+	 * it depends on the guest's interrupt state, which can change at any
+	 * instruction. */
+	return t->test_is_running && t->test_ever_caused &&
+		(t->start_population == ls->sched.most_agents_ever ||
+		 t->start_population != ls->sched.num_agents);
+}
+
 #endif /* ndef PINTOS_KERNEL */
@@ -24,6 +24,7 @@ struct test_state {
 
 void test_init(struct test_state *);
 bool test_update_state(struct ls_state *ls);
+bool test_can_skip_update(struct ls_state *ls);
 bool cause_test(conf_object_t *kbd, struct test_state *, struct ls_state *,
 		const char *test_string);
 
@@ -27,6 +27,9 @@ struct hax {
 	unsigned int eip; /* The eip for the *next* preemption point. */
 	unsigned long trigger_count; /* from ls_state */
 	int chosen_thread; /* TID that was chosen to get here. -1 if root. */
+	/* Was a transaction failure injected in chosen_thread to get here? */
+	bool chosen_txn;
+	unsigned int chosen_xabort_code; /* valid iff chosen_txn */
 	struct stack_trace *stack_trace;
 
 	/***** Saved state from the past. The state struct pointers are
@@ -51,13 +54,20 @@ struct hax {
 	unsigned int depth; /* starts at 0 */
 	Q_NEW_LINK(struct hax) sibling;
 	Q_NEW_HEAD(struct, struct hax) children;
+	/* Fully-explored children may get compacted out of the above list to
+	 * save memory (see save.c), leaving behind only their chosen_thread,
+	 * which is all DPOR and the estimator need to know about them. Use
+	 * num_children() and has_explored_child() to account for these. */
+	int *compacted_children;
+	unsigned int num_compacted_children;
 
 	/**** DPOR state ****/
 
 	/* Other transitions (ancestors) that conflict with or happen-before
-	 * this one. The length of each array is given by 'depth'. */
-	bool *conflicts;      /* if true, then they aren't independent. */
-	bool *happens_before; /* "happens_after", really. */
+	 * this one. These are bitsets (see bitset.h) indexed by the ancestor's
+	 * depth; the length of each is given by 'depth'. */
+	uint64_t *conflicts;      /* if set, then they aren't independent. */
+	uint64_t *happens_before; /* "happens_after", really. */
 
 	/* All branches of the subtree rooted here executed already? */
 	bool all_explored;
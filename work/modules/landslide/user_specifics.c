@@ -10,6 +10,7 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "interval.h"
 #include "kernel_specifics.h"
 #include "kspec.h"
 #include "landslide.h"
@@ -26,12 +27,7 @@ bool ignore_dr_function(unsigned int eip)
 	/* true = suppress data race report; false = emit report. we can't use
 	 * within_function since there aren't retroactive stack traces. */
 	static const unsigned int ignore_dr_fns[][3] = IGNORE_DR_FUNCTIONS;
-	for (int i = 0; i < ARRAY_SIZE(ignore_dr_fns); i++) {
-		if (eip >= ignore_dr_fns[i][0] && eip <= ignore_dr_fns[i][1]) {
-			return true;
-		}
-	}
-	return false;
+	return IN_INTERVAL_TABLE(ignore_dr_fns, eip);
 }
 
 /******************************************************************************
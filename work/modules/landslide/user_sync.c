@@ -18,10 +18,18 @@
 #include "variable_queue.h"
 #include "x86.h"
 
+static struct shared_mutexes *shared_mutexes_new(void)
+{
+	struct shared_mutexes *sm = MM_XMALLOC(1, struct shared_mutexes);
+	sm->refcount = 1;
+	Q_INIT_HEAD(&sm->list);
+	return sm;
+}
+
 void user_sync_init(struct user_sync_state *u)
 {
 	u->mutex_size = 0;
-	Q_INIT_HEAD(&u->mutexes);
+	u->mutexes = shared_mutexes_new();
 	u->yield_progress = NOTHING_INTERESTING;
 	u->xchg_count = 0;
 	u->xchg_loop_has_pps = false;
@@ -37,21 +45,88 @@ void user_yield_state_init(struct user_yield_state *y)
  * Mutexes
  ******************************************************************************/
 
+struct shared_mutexes *shared_mutexes_ref(struct shared_mutexes *sm)
+{
+	assert(sm->refcount > 0 && "ref of a dead mutex list");
+	sm->refcount++;
+	return sm;
+}
+
+static void free_mutex(struct mutex *mp)
+{
+	while (Q_GET_SIZE(&mp->chunks) > 0) {
+		struct mutex_chunk *c = Q_GET_HEAD(&mp->chunks);
+		assert(c != NULL);
+		Q_REMOVE(&mp->chunks, c, nobe);
+		MM_FREE(c);
+	}
+	MM_FREE(mp);
+}
+
+void shared_mutexes_unref(struct shared_mutexes *sm)
+{
+	assert(sm->refcount > 0 && "double unref of a mutex list");
+	if (--sm->refcount == 0) {
+		while (Q_GET_SIZE(&sm->list) > 0) {
+			struct mutex *mp = Q_GET_HEAD(&sm->list);
+			assert(mp != NULL);
+			Q_REMOVE(&sm->list, mp, nobe);
+			free_mutex(mp);
+		}
+		MM_FREE(sm);
+	}
+}
+
+/* Gets the mutex list for modification, first breaking sharing with any saved
+ * states in the choice tree if necessary. */
+static struct mutexes *mutexes_for_write(struct user_sync_state *u)
+{
+	struct shared_mutexes *sm = u->mutexes;
+	if (sm->refcount == 1) {
+		return &sm->list;
+	}
+
+	u->mutexes = shared_mutexes_new();
+
+	struct mutex *mp_src;
+	Q_FOREACH(mp_src, &sm->list, nobe) {
+		struct mutex *mp_dest = MM_XMALLOC(1, struct mutex);
+		mp_dest->addr = mp_src->addr;
+		Q_INIT_HEAD(&mp_dest->chunks);
+
+		struct mutex_chunk *c_src;
+		Q_FOREACH(c_src, &mp_src->chunks, nobe) {
+			struct mutex_chunk *c_dest = MM_XMALLOC(1, struct mutex_chunk);
+			c_dest->base = c_src->base;
+			c_dest->size = c_src->size;
+			Q_INSERT_HEAD(&mp_dest->chunks, c_dest, nobe);
+		}
+		assert(Q_GET_SIZE(&mp_dest->chunks) == Q_GET_SIZE(&mp_src->chunks));
+
+		Q_INSERT_HEAD(&u->mutexes->list, mp_dest, nobe);
+	}
+	assert(Q_GET_SIZE(&u->mutexes->list) == Q_GET_SIZE(&sm->list));
+
+	shared_mutexes_unref(sm);
+	return &u->mutexes->list;
+}
+
 /* register a malloced chunk as belonging to a particular mutex.
  * will add mutex to the list of all mutexes if it's not already there. */
 void learn_malloced_mutex_structure(struct user_sync_state *u, unsigned int lock_addr,
 				    unsigned int chunk_addr, unsigned int chunk_size)
 {
+	struct mutexes *mutexes = mutexes_for_write(u);
 	struct mutex *mp;
 	assert(lock_addr != -1);
-	Q_SEARCH(mp, &u->mutexes, nobe, mp->addr == (unsigned int)lock_addr);
+	Q_SEARCH(mp, mutexes, nobe, mp->addr == (unsigned int)lock_addr);
 	if (mp == NULL) {
 		lsprintf(DEV, "created user mutex 0x%x (%u others)\n",
-			 lock_addr, Q_GET_SIZE(&u->mutexes));
+			 lock_addr, Q_GET_SIZE(mutexes));
 		mp = MM_XMALLOC(1, struct mutex);
 		mp->addr = (unsigned int)lock_addr;
 		Q_INIT_HEAD(&mp->chunks);
-		Q_INSERT_FRONT(&u->mutexes, mp, nobe);
+		Q_INSERT_FRONT(mutexes, mp, nobe);
 	}
 
 	struct mutex_chunk *c;
@@ -69,10 +144,14 @@ void learn_malloced_mutex_structure(struct user_sync_state *u, unsigned int lock
 void mutex_destroy(struct user_sync_state *u, unsigned int lock_addr)
 {
 	struct mutex *mp;
-	Q_SEARCH(mp, &u->mutexes, nobe, mp->addr == (unsigned int)lock_addr);
+	Q_SEARCH(mp, &u->mutexes->list, nobe, mp->addr == (unsigned int)lock_addr);
 	if (mp != NULL) {
+		struct mutexes *mutexes = mutexes_for_write(u);
+		/* the one we found may have been in the old shared copy */
+		Q_SEARCH(mp, mutexes, nobe, mp->addr == (unsigned int)lock_addr);
+		assert(mp != NULL);
 		lsprintf(DEV, "forgetting about user mutex 0x%x (chunks:", lock_addr);
-		Q_REMOVE(&u->mutexes, mp, nobe);
+		Q_REMOVE(mutexes, mp, nobe);
 		while (Q_GET_SIZE(&mp->chunks) > 0) {
 			struct mutex_chunk *c = Q_GET_HEAD(&mp->chunks);
 			assert(c != NULL);
@@ -83,7 +162,7 @@ void mutex_destroy(struct user_sync_state *u, unsigned int lock_addr)
 		printf(DEV, ")\n");
 		MM_FREE(mp);
 
-		Q_SEARCH(mp, &u->mutexes, nobe, mp->addr == lock_addr);
+		Q_SEARCH(mp, mutexes, nobe, mp->addr == lock_addr);
 		assert(mp == NULL && "user mutex existed twice??");
 	}
 }
@@ -96,7 +175,7 @@ static bool lock_contains_addr(struct user_sync_state *u,
 	} else {
 		/* search heap chunks of known malloced mutexes */
 		struct mutex *mp;
-		Q_SEARCH(mp, &u->mutexes, nobe, mp->addr == lock_addr);
+		Q_SEARCH(mp, &u->mutexes->list, nobe, mp->addr == lock_addr);
 		if (mp == NULL) {
 			return false;
 		} else {
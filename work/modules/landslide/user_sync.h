@@ -31,12 +31,19 @@ struct mutex {
 
 Q_NEW_HEAD(struct mutexes, struct mutex);
 
+/* the mutex list, shared copy-on-write between the live user_sync_state and the
+ * saved ones in the choice tree; see struct shared_heap in memory.h. */
+struct shared_mutexes {
+	unsigned int refcount;
+	struct mutexes list;
+};
+
 /* the state of all mutexes known in userspace. */
 struct user_sync_state {
 	unsigned int mutex_size;
 	/* list of all known mutexes in userspace. note that mutexes are only
 	 * placed on this list if mutex_init is observed to malloc. */
-	struct mutexes mutexes;
+	struct shared_mutexes *mutexes;
 	/* state machine for the currently-executing thread to guess whether it's
 	 * stuck in a userspace yield loop. at the start of each transition. reset
 	 * at the beginning of each transition; if it says "yielded but didn't do
@@ -92,6 +99,8 @@ struct user_yield_state {
 
 void user_sync_init(struct user_sync_state *u);
 void user_yield_state_init(struct user_yield_state *y);
+struct shared_mutexes *shared_mutexes_ref(struct shared_mutexes *sm);
+void shared_mutexes_unref(struct shared_mutexes *sm);
 
 /* user mutexes interface  */
 
@@ -4,184 +4,288 @@
  * @author Ben Blum
  */
 
+#include <string.h>
+
 #define MODULE_NAME "VC"
 #define MODULE_COLOUR COLOUR_DARK COLOUR_BLUE
 
 #include "common.h"
 #include "vector_clock.h"
 
+/******************************************************************************
+ * Tid compaction
+ ******************************************************************************/
+
+/* Tids below this are mapped through a direct lookup table; as the original
+ * clocks' fast path was, it's sized so that none of the recommended test cases
+ * go beyond it. Larger ones fall back to a linear search. */
+#define TID_MAP_DIRECT_SIZE 64
+
+static struct {
+	ARRAY_LIST(unsigned int) tids; /* index -> tid */
+	int direct[TID_MAP_DIRECT_SIZE]; /* tid -> index + 1, or 0 if none */
+	bool initialized;
+} tid_map;
+
+/* Returns the tid's index, assigning the next one if it has none yet and
+ * assign is set; or -1 if not. */
+static int tid_index(unsigned int tid, bool assign)
+{
+	if (!tid_map.initialized) {
+		ARRAY_LIST_INIT(&tid_map.tids, TID_MAP_DIRECT_SIZE);
+		tid_map.initialized = true;
+	}
+
+	if (tid < TID_MAP_DIRECT_SIZE) {
+		if (tid_map.direct[tid] != 0) {
+			return tid_map.direct[tid] - 1;
+		}
+	} else {
+		unsigned int i;
+		unsigned int *other;
+		ARRAY_LIST_FOREACH(&tid_map.tids, i, other) {
+			if (*other == tid) {
+				return i;
+			}
+		}
+	}
+
+	if (!assign) {
+		return -1;
+	}
+	int index = ARRAY_LIST_SIZE(&tid_map.tids);
+	ARRAY_LIST_APPEND(&tid_map.tids, tid);
+	if (tid < TID_MAP_DIRECT_SIZE) {
+		tid_map.direct[tid] = index + 1;
+	}
+	return index;
+}
+
 /******************************************************************************
  * Vector clock manipulation
  ******************************************************************************/
 
-/* VCs are maps from tid to timestamp, but as a fast path, we will just use
- * the tid as an index into the array list. (IOW, v[tid].tid != tid, then
- * we will do slow-path stuff like O(n) scanning or resizing the array list.
- * Initial size is chosen so none of the recommended test cases create tids
- * higher than it. */
 #define VC_INIT_SIZE 8
+#define VC_STORAGE_SIZE(capacity) \
+	(sizeof(struct vc_storage) + (capacity) * sizeof(unsigned int))
+
+static uint64_t next_version(void)
+{
+	static uint64_t version = 0;
+	return ++version;
+}
+
+static struct vc_storage *vc_storage_new(unsigned int capacity)
+{
+	struct vc_storage *s = (struct vc_storage *)
+		MM_XMALLOC(VC_STORAGE_SIZE(capacity), char);
+	s->refcount = 1;
+	s->length = 0;
+	s->capacity = capacity;
+	s->version = next_version();
+	return s;
+}
 
 void vc_init(struct vector_clock *vc)
 {
-	ARRAY_LIST_INIT(&vc->v, VC_INIT_SIZE);
-	for (int i = 0; i < VC_INIT_SIZE; i++) {
-		struct epoch bottom = { .tid = i, .timestamp = 0 };
-		ARRAY_LIST_APPEND(&vc->v, bottom);
-	}
+	vc->s = vc_storage_new(VC_INIT_SIZE);
 }
 
 /* don't pass something already inited for vc_new, or this will leak!  */
 void vc_copy(struct vector_clock *vc_new, const struct vector_clock *vc_existing)
 {
-	unsigned int i;
-	struct epoch *e;
-	ARRAY_LIST_INIT(&vc_new->v, ARRAY_LIST_SIZE(&vc_existing->v));
-	ARRAY_LIST_FOREACH(&vc_existing->v, i, e) {
-		ARRAY_LIST_APPEND(&vc_new->v, *e);
-	}
+	assert(vc_existing->s->refcount > 0 && "copying a dead or arena clock");
+	vc_existing->s->refcount++;
+	vc_new->s = vc_existing->s;
 }
 
-static bool vc_find(struct vector_clock *vc, unsigned int tid, struct epoch **e)
+/* as above, but the copy lives in an arena, and must not be vc_destroyed nor
+ * modified. */
+void vc_copy_arena(struct vector_clock *vc_new,
+		   const struct vector_clock *vc_existing, struct arena *arena)
 {
-	/* fast path: try find tid at vc[tid] */
-	if (tid < VC_INIT_SIZE) {
-		*e = ARRAY_LIST_GET(&vc->v, tid);
-		assert((*e)->tid == tid);
-		return true;
-	}
+	const struct vc_storage *src = vc_existing->s;
+	struct vc_storage *s = (struct vc_storage *)
+		ARENA_XMALLOC(arena, VC_STORAGE_SIZE(src->length), char);
+	s->refcount = 0;
+	s->length = src->length;
+	s->capacity = src->length;
+	s->version = src->version;
+	memcpy(s->timestamps, src->timestamps, src->length * sizeof(unsigned int));
+	vc_new->s = s;
+}
 
-	/* slow path: tid too large; look for it in a non-reserved slot */
-	unsigned int i;
-	ARRAY_LIST_FOREACH(&vc->v, i, *e) {
-		if ((*e)->tid == tid) {
-			/* slow path 1: found it in some noob slot */
-			assert(i >= VC_INIT_SIZE);
-			return true;
+/* as above, but steals the reference. vc_existing is left holding nothing, and
+ * must not be used again except to vc_destroy it. */
+void vc_move(struct vector_clock *vc_new, struct vector_clock *vc_existing)
+{
+	vc_new->s = vc_existing->s;
+	vc_existing->s = NULL;
+}
+
+void vc_destroy(struct vector_clock *vc)
+{
+	if (vc->s != NULL) {
+		assert(vc->s->refcount > 0 && "destroying a dead or arena clock");
+		if (--vc->s->refcount == 0) {
+			MM_FREE(vc->s);
 		}
+		vc->s = NULL;
 	}
-	/* slow path 2: no entry exists for tid */
-	*e = NULL;
-	return false;
 }
 
-void vc_inc(struct vector_clock *vc, unsigned int tid)
+/* Gets a clock's storage that's about to be modified, with room for at least
+ * length entries, first breaking sharing with any other copies. */
+static struct vc_storage *vc_for_write(struct vector_clock *vc,
+				       unsigned int length)
 {
-	struct epoch *e;
-	if (vc_find(vc, tid, &e)) {
-		e->timestamp++;
+	struct vc_storage *old = vc->s;
+	assert(old->refcount > 0 && "modifying a dead or arena clock");
+
+	if (old->refcount > 1 || old->capacity < length) {
+		unsigned int capacity = MAX(old->capacity, VC_INIT_SIZE);
+		while (capacity < length) {
+			capacity *= 2;
+		}
+		vc->s = vc_storage_new(capacity);
+		vc->s->length = old->length;
+		memcpy(vc->s->timestamps, old->timestamps,
+		       old->length * sizeof(unsigned int));
+		if (--old->refcount == 0) {
+			MM_FREE(old);
+		}
 	} else {
-		struct epoch new_epoch = { .tid = tid, .timestamp = 1 };
-		ARRAY_LIST_APPEND(&vc->v, new_epoch);
+		old->version = next_version();
+	}
+
+	/* newly covered entries start at bottom */
+	for (unsigned int i = vc->s->length; i < length; i++) {
+		vc->s->timestamps[i] = 0;
 	}
+	vc->s->length = MAX(vc->s->length, length);
+	return vc->s;
+}
+
+void vc_inc(struct vector_clock *vc, unsigned int tid)
+{
+	unsigned int index = tid_index(tid, true);
+	vc_for_write(vc, index + 1)->timestamps[index]++;
 }
 
 /* 0 is the bottom value; if a thread was ever inced in this vc, its timestamp
  * will be at least 1. */
 unsigned int vc_get(struct vector_clock *vc, unsigned int tid)
 {
-	struct epoch *e;
-	if (vc_find(vc, tid, &e)) {
-		return e->timestamp;
-	} else {
+	int index = tid_index(tid, false);
+	if (index == -1 || index >= vc->s->length) {
 		return 0;
+	} else {
+		return vc->s->timestamps[index];
 	}
 }
 
+/* The loops below are written branch-free over plain arrays, so that the
+ * compiler can vectorize them. */
+
 /* vc_dest's values are changed, vc_src's are not */
 void vc_merge(struct vector_clock *vc_dest, struct vector_clock *vc_src)
 {
-	unsigned int i;
-	struct epoch *e_dest;
-	struct epoch *e_src;
-
-	/* step 1: anything that vc_dest has, find it in vc_src and merge it */
-	ARRAY_LIST_FOREACH(&vc_dest->v, i, e_dest) {
-		if (vc_find(vc_src, e_dest->tid, &e_src)) {
-			e_dest->timestamp =
-				MAX(e_dest->timestamp, e_src->timestamp);
-		}
+	/* if there's nothing new in src, don't break dest's sharing */
+	if (vc_happens_before(vc_src, vc_dest)) {
+		return;
 	}
 
-	/* step 2: anything that vc_dest was missing, copy vc_src's entry */
-	if (ARRAY_LIST_SIZE(&vc_src->v) >= VC_INIT_SIZE) {
-		ARRAY_LIST_FOREACH(&vc_src->v, i, e_src) {
-			if (!vc_find(vc_dest, e_src->tid, &e_dest)) {
-				/* all fast-path slots should be found in step 1 */
-				assert(i >= VC_INIT_SIZE);
-				assert(e_src->tid >= VC_INIT_SIZE);
-				ARRAY_LIST_APPEND(&vc_dest->v, *e_src);
-			}
-		}
+	const struct vc_storage *src = vc_src->s;
+	struct vc_storage *dest = vc_for_write(vc_dest, src->length);
+	for (unsigned int i = 0; i < src->length; i++) {
+		dest->timestamps[i] = MAX(dest->timestamps[i], src->timestamps[i]);
 	}
 }
 
-bool vc_eq(struct vector_clock *vc1, struct vector_clock *vc2)
+/* Are all of these (presumably trailing) entries bottom? */
+static bool all_bottom(const unsigned int *timestamps, unsigned int start,
+		       unsigned int end)
 {
-	unsigned int i;
-	struct epoch *e1;
-	struct epoch *e2;
-
-	ARRAY_LIST_FOREACH(&vc1->v, i, e1) {
-		if (vc_find(vc2, e1->tid, &e2)) {
-			if (e1->timestamp != e2->timestamp) {
-				return false;
-			}
-		} else if (e1->timestamp != 0) {
-			return false;
-		}
+	unsigned int any = 0;
+	for (unsigned int i = start; i < end; i++) {
+		any |= timestamps[i];
 	}
+	return any == 0;
+}
 
-	/* any elements in v2 not present in v1 at all? */
-	if (ARRAY_LIST_SIZE(&vc2->v) >= VC_INIT_SIZE) {
-		ARRAY_LIST_FOREACH(&vc2->v, i, e2) {
-			/* if it exists, it was already confirmed equal */
-			if (!vc_find(vc1, e2->tid, &e1)) {
-				return false;
-			}
-		}
+bool vc_eq(struct vector_clock *vc1, struct vector_clock *vc2)
+{
+	const struct vc_storage *s1 = vc1->s;
+	const struct vc_storage *s2 = vc2->s;
+
+	if (s1 == s2 || s1->version == s2->version) {
+		return true;
 	}
 
-	return true;
+	unsigned int common = MIN(s1->length, s2->length);
+	unsigned int diff = 0;
+	for (unsigned int i = 0; i < common; i++) {
+		diff |= s1->timestamps[i] ^ s2->timestamps[i];
+	}
+	/* entries only one has must be bottom */
+	return diff == 0 && all_bottom(s1->timestamps, common, s1->length) &&
+		all_bottom(s2->timestamps, common, s2->length);
 }
 
 bool vc_happens_before(struct vector_clock *vc_before, struct vector_clock *vc_after)
 {
-	unsigned int i;
-	struct epoch *e_before;
-	struct epoch *e_after;
-
-	/* step 1: anything that vc_before has, compare to vc_after's version */
-	ARRAY_LIST_FOREACH(&vc_before->v, i, e_before) {
-		if (vc_find(vc_after, e_before->tid, &e_after)) {
-			/* Note use of ">" not ">=". HB is ok if two timestamps
-			 * are equal. (see fasttrack paper, sec 2.2) */
-			if (e_before->timestamp > e_after->timestamp) {
-				return false;
-			}
-		} else if (e_before->timestamp != 0) {
-			/* First vector has an event from this thread, but
-			 * second's value is bottom. No HB here, officer! */
-			return false;
-		}
+	const struct vc_storage *before = vc_before->s;
+	const struct vc_storage *after = vc_after->s;
+
+	if (before == after || before->version == after->version) {
+		return true;
 	}
 
-	/* step 2: any elements vc_before was missing, their timestamps are all
-	 * bottom, and automatically compare OK to new entries in vc_after. */
-	return true;
+	/* Note use of ">" not ">=". HB is ok if two timestamps are equal.
+	 * (see fasttrack paper, sec 2.2) */
+	unsigned int common = MIN(before->length, after->length);
+	unsigned int later = 0;
+	for (unsigned int i = 0; i < common; i++) {
+		later |= before->timestamps[i] > after->timestamps[i];
+	}
+	/* Entries vc_after lacks are bottom; if vc_before has an event from
+	 * such a thread, no HB here, officer! Entries vc_before lacks are
+	 * bottom, and compare OK to anything. */
+	return later == 0 &&
+		all_bottom(before->timestamps, common, before->length);
+}
+
+struct epoch vc_epoch(struct vector_clock *vc, unsigned int tid)
+{
+	struct epoch e;
+	e.index = tid_index(tid, true);
+	e.timestamp = e.index < vc->s->length ? vc->s->timestamps[e.index] : 0;
+	return e;
+}
+
+/* Equivalent to vc_happens_before() of the clock e was taken from, provided
+ * the thread has released nothing since (see struct epoch). */
+bool vc_epoch_happens_before(struct epoch e, struct vector_clock *vc_after)
+{
+	const struct vc_storage *after = vc_after->s;
+	return e.timestamp <=
+		(e.index < after->length ? after->timestamps[e.index] : 0);
 }
 
 void vc_print(verbosity v, struct vector_clock *vc)
 {
-	unsigned int i;
-	struct epoch *e;
 	bool first = true;
 
 	printf(v, "[");
-	ARRAY_LIST_FOREACH(&vc->v, i, e) {
+	for (unsigned int i = 0; i < vc->s->length; i++) {
+		if (vc->s->timestamps[i] == 0) {
+			continue;
+		}
 		if (!first) {
 			printf(v, ", ");
 		}
-		printf(v, "%u@%u", e->tid, e->timestamp);
+		printf(v, "%u@%u", *ARRAY_LIST_GET(&tid_map.tids, i),
+		       vc->s->timestamps[i]);
 		first = false;
 	}
 	printf(v, "]");
@@ -192,12 +296,14 @@ void vc_test()
 {
 	struct vector_clock a;
 	struct vector_clock b;
-	struct epoch *e;
+	struct vector_clock c;
+	struct epoch e;
 
 	/* test inc/get/etc */
 	vc_init(&a); vc_init(&b);
-	assert(vc_find(&a, VC_INIT_SIZE - 1, &e));
-	assert(!vc_find(&a, VC_INIT_SIZE, &e));
+	assert(vc_get(&a, VC_INIT_SIZE - 1) == 0);
+	assert(vc_get(&a, VC_INIT_SIZE) == 0);
+	assert(vc_eq(&a, &b));
 	assert(vc_happens_before(&a, &b));
 	assert(vc_happens_before(&b, &a));
 
@@ -205,7 +311,6 @@ void vc_test()
 	assert(vc_get(&a, 0) == 1);
 	vc_inc(&a, VC_INIT_SIZE);
 	vc_inc(&a, VC_INIT_SIZE);
-	assert(vc_find(&a, VC_INIT_SIZE, &e));
 	assert(vc_get(&a, VC_INIT_SIZE) == 2);
 
 	assert(!vc_happens_before(&a, &b));
@@ -266,6 +371,32 @@ void vc_test()
 	assert(!vc_happens_before(&b, &a));
 	vc_destroy(&a); vc_destroy(&b);
 
+	/* test copy-on-write */
+	vc_init(&a);
+	vc_inc(&a, 1);
+	vc_copy(&b, &a);
+	assert(a.s == b.s);
+	vc_inc(&b, 1);
+	assert(a.s != b.s);
+	assert(vc_get(&a, 1) == 1);
+	assert(vc_get(&b, 1) == 2);
+	assert(!vc_eq(&a, &b));
+	vc_merge(&a, &b);
+	assert(vc_eq(&a, &b));
+	vc_destroy(&a); vc_destroy(&b);
+
+	/* test epochs (release, then inc, as in VC_RELEASE) */
+	vc_init(&a); vc_init(&b);
+	vc_inc(&a, 3);
+	e = vc_epoch(&a, 3);
+	assert(!vc_epoch_happens_before(e, &b));
+	vc_copy(&c, &a); /* release */
+	vc_inc(&a, 3);
+	vc_merge(&b, &c); /* acquire */
+	assert(vc_epoch_happens_before(e, &b));
+	assert(!vc_epoch_happens_before(vc_epoch(&a, 3), &b));
+	vc_destroy(&a); vc_destroy(&b); vc_destroy(&c);
+
 	assert(false && "all tests passed!");
 }
 #endif
@@ -280,11 +411,19 @@ struct lock_clock {
 	struct rb_node nobe;
 };
 
+static struct lock_clock_map *lock_clock_map_new(void)
+{
+	struct lock_clock_map *map = MM_XMALLOC(1, struct lock_clock_map);
+	map->refcount = 1;
+	map->root.rb_node = NULL;
+	map->num_lox = 0;
+	return map;
+}
+
 /* "ls" is kind of already a reserved variable name */
 void lock_clocks_init(struct lock_clocks *lc)
 {
-	lc->map.rb_node = NULL;
-	lc->num_lox = 0;
+	lc->map = lock_clock_map_new();
 }
 
 static void free_lock_clocks(struct rb_node *nobe)
@@ -303,9 +442,12 @@ static void free_lock_clocks(struct rb_node *nobe)
 
 void lock_clocks_destroy(struct lock_clocks *lc)
 {
-	free_lock_clocks(lc->map.rb_node);
-	lc->map.rb_node = NULL;
-	lc->num_lox = 0;
+	assert(lc->map->refcount > 0 && "double free of lock clocks");
+	if (--lc->map->refcount == 0) {
+		free_lock_clocks(lc->map->root.rb_node);
+		MM_FREE(lc->map);
+	}
+	lc->map = NULL;
 }
 
 static struct rb_node *dup_clock(const struct rb_node *nobe,
@@ -330,10 +472,25 @@ static struct rb_node *dup_clock(const struct rb_node *nobe,
 	return &dest->nobe;
 }
 
+/* Shares the existing map; it will be duplicated when next modified. */
 void lock_clocks_copy(struct lock_clocks *lm_new, const struct lock_clocks *lm_existing)
 {
-	lm_new->map.rb_node = dup_clock(lm_existing->map.rb_node, NULL);
-	lm_new->num_lox = lm_existing->num_lox;
+	assert(lm_existing->map->refcount > 0);
+	lm_existing->map->refcount++;
+	lm_new->map = lm_existing->map;
+}
+
+/* Breaks sharing with any saved sched_states before modifying the map. */
+static struct lock_clock_map *lock_clocks_for_write(struct lock_clocks *lc)
+{
+	struct lock_clock_map *old = lc->map;
+	if (old->refcount > 1) {
+		lc->map = lock_clock_map_new();
+		lc->map->root.rb_node = dup_clock(old->root.rb_node, NULL);
+		lc->map->num_lox = old->num_lox;
+		old->refcount--;
+	}
+	return lc->map;
 }
 
 /* see function of same name in memory.c...
@@ -365,7 +522,7 @@ bool lock_clock_find(struct lock_clocks *lc, unsigned int lock_addr,
 		     struct vector_clock **result)
 {
 	struct lock_clock *entry;
-	struct rb_node **p = find_insert_location(&lc->map, lock_addr, &entry);
+	struct rb_node **p = find_insert_location(&lc->map->root, lock_addr, &entry);
 	if (p == NULL) {
 		assert(entry != NULL && "find insert location is broken?");
 		*result = &entry->c;
@@ -386,8 +543,9 @@ struct vector_clock *lock_clock_get(struct lock_clocks *lc, unsigned int lock_ad
 void lock_clock_set(struct lock_clocks *lc, unsigned int lock_addr,
 		    struct vector_clock *vc)
 {
+	struct lock_clock_map *map = lock_clocks_for_write(lc);
 	struct lock_clock *parent = NULL;
-	struct rb_node **p = find_insert_location(&lc->map, lock_addr, &parent);
+	struct rb_node **p = find_insert_location(&map->root, lock_addr, &parent);
 	if (p == NULL) {
 		/* lock already had a clock */
 		assert(parent->lock_addr == lock_addr);
@@ -401,8 +559,8 @@ void lock_clock_set(struct lock_clocks *lc, unsigned int lock_addr,
 
 		rb_init_node(&entry->nobe);
 		rb_link_node(&entry->nobe, parent != NULL ? &parent->nobe : NULL, p);
-		rb_insert_color(&entry->nobe, &lc->map);
-		lc->num_lox++;
+		rb_insert_color(&entry->nobe, &map->root);
+		map->num_lox++;
 	}
 }
 
@@ -422,11 +580,11 @@ void test_lock_clocks()
 	assert(!lock_clock_find(&lc, 0x15410de0u, &vp));
 
 	lock_clock_set(&lc, 0x15410de0u, &va);
-	assert(lc.num_lox == 1);
+	assert(lc.map->num_lox == 1);
 	lock_clock_set(&lc, 0x1badb002, &vb);
-	assert(lc.num_lox == 2);
+	assert(lc.map->num_lox == 2);
 	lock_clock_set(&lc, 0xcdcdcdcd, &vc);
-	assert(lc.num_lox == 3);
+	assert(lc.map->num_lox == 3);
 	assert(lock_clock_find(&lc, 0x15410de0u, &vp));
 	assert(vc_get(vp, 1) == 1);
 	assert(vc_get(vp, 2) == 0);
@@ -444,7 +602,7 @@ void test_lock_clocks()
 	assert(vc_get(vp, 4) == 0);
 
 	lock_clock_set(&lc, 0x1badb002, &vd);
-	assert(lc.num_lox == 3); /* overwrite same lock */
+	assert(lc.map->num_lox == 3); /* overwrite same lock */
 	assert(lock_clock_find(&lc, 0x1badb002, &vp));
 	assert(vc_get(vp, 1) == 0);
 	assert(vc_get(vp, 2) == 0);
@@ -7,35 +7,70 @@
 #ifndef __LS_VECTOR_CLOCK_H
 #define __LS_VECTOR_CLOCK_H
 
+#include <stdint.h>
+
+#include "arena.h"
 #include "array_list.h"
 #include "common.h"
 #include "rbtree.h"
 
-struct epoch {
-	unsigned int tid;
-	unsigned int timestamp;
+/* Clocks are dense arrays of timestamps, indexed not by tid but by a small
+ * index each tid is assigned the first time any clock sees it (at fork, that
+ * is). Indices are global and never reused, so they agree across all clocks
+ * and branches. Entries past the length are bottom (0).
+ * Storage is shared copy-on-write between copies (e.g. each agent's clock and
+ * its saved versions in the choice tree), and is tagged with a version that
+ * changes whenever the contents do, so copies compare equal in O(1). */
+struct vc_storage {
+	unsigned int refcount; /* 0 iff it lives in an arena */
+	unsigned int length;
+	unsigned int capacity;
+	uint64_t version;
+	unsigned int timestamps[];
 };
 
 struct vector_clock {
-	ARRAY_LIST(struct epoch) v;
+	struct vc_storage *s;
+};
+
+/* A thread's own entry in its clock at some moment ("epoch" in fasttrack).
+ * Threads advance their own entry right after every release (see VC_RELEASE
+ * and FT-fork), so any clock whose entry for the thread is at least this has
+ * seen the whole of the thread's clock from then; i.e., "happens-before" for
+ * an epoch is a single comparison, not a whole-clock one. */
+struct epoch {
+	unsigned int index; /* the tid's, as above */
+	unsigned int timestamp;
 };
 
 /* The global set of all vector clocks associated with each mutex/xchg.
  * Corresponds to "L" in the fasttrack paper. Stored in sched_state.
- * C, W, and R are stored individually in the agent and mem_access strux. */
-struct lock_clocks {
-	struct rb_root map;
+ * C, W, and R are stored individually in the agent and mem_access strux.
+ * The map is shared copy-on-write between the live sched_state and saved ones
+ * in the choice tree, since most transitions release no locks at all. */
+struct lock_clock_map {
+	unsigned int refcount;
+	struct rb_root root;
 	unsigned int num_lox;
 };
 
+struct lock_clocks {
+	struct lock_clock_map *map;
+};
+
 void vc_init(struct vector_clock *vc);
 void vc_copy(struct vector_clock *vc_new, const struct vector_clock *vc_existing);
-#define vc_destroy(vc) do { ARRAY_LIST_FREE(&(vc)->v); } while (0)
+void vc_copy_arena(struct vector_clock *vc_new,
+		   const struct vector_clock *vc_existing, struct arena *arena);
+void vc_move(struct vector_clock *vc_new, struct vector_clock *vc_existing);
+void vc_destroy(struct vector_clock *vc);
 void vc_inc(struct vector_clock *vc, unsigned int tid);
 unsigned int vc_get(struct vector_clock *vc, unsigned int tid);
 void vc_merge(struct vector_clock *vc_dest, struct vector_clock *vc_src);
 bool vc_eq(struct vector_clock *vc1, struct vector_clock *vc2);
 bool vc_happens_before(struct vector_clock *vc_before, struct vector_clock *vc_after);
+struct epoch vc_epoch(struct vector_clock *vc, unsigned int tid);
+bool vc_epoch_happens_before(struct epoch e, struct vector_clock *vc_after);
 void vc_print(verbosity v, struct vector_clock *vc);
 
 void lock_clocks_init(struct lock_clocks *lm);
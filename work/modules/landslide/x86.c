@@ -9,6 +9,7 @@
 #define MODULE_NAME "X86"
 #define MODULE_COLOUR COLOUR_DARK COLOUR_GREEN
 
+#include "bitset.h"
 #include "common.h"
 #include "kernel_specifics.h"
 #include "kspec.h"
@@ -258,6 +259,66 @@ bool interrupts_enabled(conf_object_t *cpu)
 	return (eflags & EFL_IF) != 0;
 }
 
+/******************************************************************************
+ * translation cache
+ ******************************************************************************/
+
+/* Page table walks cost two reads through simics apiece, and stack traces and
+ * READ_STACK translate the same few pages over and over. So present mappings
+ * are cached, direct-mapped by virtual page number and tagged with cr3 (which
+ * makes switching address spaces free). An entry goes stale only if the page
+ * tables it was walked through change; any observed write to a frame that was
+ * walked through flushes the whole cache, which is rare enough not to bother
+ * being more precise. */
+#define TLB_ENTRIES 256
+#define PT_FRAME_FILTER_BITS (1 << 16) /* enough frames for 256 MB */
+
+struct tlb_entry {
+	bool valid;
+	unsigned int cr3;
+	unsigned int vpn;
+	unsigned int frame; /* physical address of the page */
+};
+
+static struct {
+	struct tlb_entry entries[TLB_ENTRIES];
+	/* page directory and page table frames that entries were walked
+	 * through, indexed by frame number modulo the filter size */
+	uint64_t pt_frames[BITSET_WORDS(PT_FRAME_FILTER_BITS)];
+	bool empty;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t flushes;
+} tlb = { .empty = true };
+
+#define PT_FRAME_INDEX(phys_addr) (((phys_addr) >> 12) % PT_FRAME_FILTER_BITS)
+
+void mem_translate_flush(void)
+{
+	if (!tlb.empty) {
+		memset(tlb.entries, 0, sizeof(tlb.entries));
+		bitset_clear_all(tlb.pt_frames, PT_FRAME_FILTER_BITS);
+		tlb.empty = true;
+		tlb.flushes++;
+	}
+}
+
+void mem_translate_observe_write(unsigned int phys_addr, unsigned int width)
+{
+	if (!tlb.empty &&
+	    (bitset_get(tlb.pt_frames, PT_FRAME_INDEX(phys_addr)) ||
+	     bitset_get(tlb.pt_frames, PT_FRAME_INDEX(phys_addr + width - 1)))) {
+		mem_translate_flush();
+	}
+}
+
+void mem_translate_stats(uint64_t *hits, uint64_t *misses, uint64_t *flushes)
+{
+	*hits = tlb.hits;
+	*misses = tlb.misses;
+	*flushes = tlb.flushes;
+}
+
 static bool mem_translate(conf_object_t *cpu, unsigned int addr, unsigned int *result)
 {
 #ifdef PINTOS_KERNEL
@@ -282,6 +343,15 @@ static bool mem_translate(conf_object_t *cpu, unsigned int addr, unsigned int *r
 	unsigned int lower = (addr >> 12) & 1023;
 	unsigned int offset = addr & 4095;
 	unsigned int cr3 = GET_CPU_ATTR(cpu, cr3);
+
+	struct tlb_entry *entry = &tlb.entries[(addr >> 12) % TLB_ENTRIES];
+	if (entry->valid && entry->vpn == addr >> 12 && entry->cr3 == cr3) {
+		tlb.hits++;
+		*result = entry->frame + offset;
+		return true;
+	}
+	tlb.misses++;
+
 	unsigned int pde_addr = cr3 + (4 * upper);
 	unsigned int pde = SIM_read_phys_memory(cpu, pde_addr, WORD_SIZE);
 	assert(SIM_get_pending_exception() == SimExc_No_Exception &&
@@ -307,6 +377,14 @@ static bool mem_translate(conf_object_t *cpu, unsigned int addr, unsigned int *r
 #endif
 	}
 	*result = (pte & ~4095) + offset;
+
+	entry->valid = true;
+	entry->cr3 = cr3;
+	entry->vpn = addr >> 12;
+	entry->frame = pte & ~4095;
+	bitset_set(tlb.pt_frames, PT_FRAME_INDEX(pde_addr), true);
+	bitset_set(tlb.pt_frames, PT_FRAME_INDEX(pte_addr), true);
+	tlb.empty = false;
 	return true;
 }
 
@@ -330,6 +408,7 @@ bool write_memory(conf_object_t *cpu, unsigned int addr, unsigned int val, unsig
 		SIM_write_phys_memory(cpu, phys_addr, val, width);
 		assert(SIM_get_pending_exception() == SimExc_No_Exception &&
 		       "failed memory write during VM translation -- kernel VM bug?");
+		mem_translate_observe_write(phys_addr, width);
 		return true;
 	} else {
 		return false;
@@ -440,6 +519,7 @@ unsigned int delay_instruction(conf_object_t *cpu)
 
 	SIM_write_phys_memory(cpu, phys_buf, 0xe9, 1);
 	SIM_write_phys_memory(cpu, phys_buf + 1, offset, 4);
+	mem_translate_observe_write(phys_buf, 5);
 
 	SET_CPU_ATTR(cpu, eip, buf);
 
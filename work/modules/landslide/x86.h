@@ -50,8 +50,13 @@ static inline unsigned int get_cpu_attr(conf_object_t *cpu, const char *name) {
 #define EFL_IF          0x00000200 /* from 410kern/inc/x86/eflags.h */
 #define OPCODE_PUSH_EBP 0x55
 #define OPCODE_RET  0xc3
+#define OPCODE_RET_IMM16 0xc2
 #define OPCODE_IRET 0xcf
 #define OPCODE_CALL 0xe8
+#define OPCODE_CALL_INDIRECT 0xff /* only if modrm's reg field is 2 */
+#define OPCODE_IS_CALL(ops) ((ops)[0] == OPCODE_CALL || \
+	((ops)[0] == OPCODE_CALL_INDIRECT && (((ops)[1] >> 3) & 0x7) == 2))
+#define OPCODE_IS_RET(ops) ((ops)[0] == OPCODE_RET || (ops)[0] == OPCODE_RET_IMM16)
 #define IRET_BLOCK_WORDS 3
 #define OPCODE_HLT 0xf4
 #define OPCODE_INT 0xcd
@@ -79,6 +84,9 @@ void cause_keypress(conf_object_t *kbd, char);
 bool interrupts_enabled(conf_object_t *cpu);
 unsigned int read_memory(conf_object_t *cpu, unsigned int addr, unsigned int width);
 bool write_memory(conf_object_t *cpu, unsigned int addr, unsigned int val, unsigned int width);
+void mem_translate_flush(void);
+void mem_translate_observe_write(unsigned int phys_addr, unsigned int width);
+void mem_translate_stats(uint64_t *hits, uint64_t *misses, uint64_t *flushes);
 char *read_string(conf_object_t *cpu, unsigned int eip);
 bool instruction_is_atomic_swap(conf_object_t *cpu, unsigned int eip); /* slower; uses READ_MEMORY */
 bool opcodes_are_atomic_swap(uint8_t *opcodes); /* faster; ok to use every instruction */